@@ -13,12 +13,16 @@
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <ctype.h>
 #include <fenv.h>
 #include <getopt.h>
 #include <grp.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <jansson.h>
 #include <signal.h>
 #include <stdio.h>
@@ -28,6 +32,7 @@
 
 #include "ckpool.h"
 #include "libckpool.h"
+#include "sha2.h"
 #include "generator.h"
 #include "stratifier.h"
 #include "connector.h"
@@ -53,96 +58,535 @@ static bool open_logfile(ckpool_t *ckp)
 	return true;
 }
 
-/* Use ckmsgqs for logging to console and files to prevent logmsg from blocking
- * on any delays. */
-static void console_log(ckpool_t __maybe_unused *ckp, char *msg)
+/* Log lines are formatted straight into a ring buffer of slots belonging to
+ * the thread logging them, and written out in batches by a single logger
+ * thread so logmsg never takes a lock or blocks. Lines too long for a slot are
+ * allocated separately. When a thread's ring is full its lines are dropped and
+ * counted, with the count logged once the logger catches up. */
+#define LOGRING_SLOTS 256
+#define LOGSLOT_SIZE 640
+
+typedef struct logslot {
+	int loglevel;
+	int len;
+	char *ext; /* Line too long for buf */
+	char buf[LOGSLOT_SIZE];
+} logslot_t;
+
+typedef struct logring logring_t;
+
+struct logring {
+	logring_t *next;
+	/* Head is only written by the owning thread, tail by the logger */
+	unsigned int head;
+	unsigned int tail;
+	int64_t dropped;
+	bool dead; /* Owning thread has exited */
+	logslot_t slots[LOGRING_SLOTS];
+};
+
+/* Rings are only ever added to the head of the list so the logger can walk it
+ * without the lock, which is only needed to change the list. */
+static logring_t *logrings;
+static mutex_t logring_lock;
+static pthread_key_t logring_key;
+static __thread logring_t *logring;
+
+static sem_t logger_sem;
+static int logger_sleeping;
+static bool logger_active;
+
+/* Timestamp prefix up to the seconds, cached per thread */
+static __thread time_t stamp_sec;
+static __thread char stamp_prefix[32];
+static __thread int stamp_len;
+
+/* Write the timestamp of now to stamp, returning its length */
+static int log_stamp(char *stamp)
+{
+	tv_t now_tv;
+
+	tv_time(&now_tv);
+	if (now_tv.tv_sec != stamp_sec) {
+		struct tm tm;
+
+		localtime_r(&(now_tv.tv_sec), &tm);
+		stamp_len = sprintf(stamp_prefix, "[%d-%02d-%02d %02d:%02d:%02d",
+				    tm.tm_year + 1900,
+				    tm.tm_mon + 1,
+				    tm.tm_mday,
+				    tm.tm_hour,
+				    tm.tm_min,
+				    tm.tm_sec);
+		stamp_sec = now_tv.tv_sec;
+	}
+	memcpy(stamp, stamp_prefix, stamp_len);
+	return stamp_len + sprintf(stamp + stamp_len, ".%03d]", (int)(now_tv.tv_usec / 1000));
+}
+
+void get_timestamp(char *stamp)
+{
+	log_stamp(stamp);
+}
+
+/* Called on thread exit, leaving the logger to free the ring once empty */
+static void logring_exit(void *arg)
+{
+	logring_t *ring = arg;
+
+	__atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+	logring = NULL;
+}
+
+static logring_t *get_logring(void)
 {
-	/* Add clear line only if stderr is going to console */
-	if (isatty(fileno(stderr)))
-		fprintf(stderr, "\33[2K\r");
-	fprintf(stderr, "%s", msg);
-	fflush(stderr);
+	if (likely(logring))
+		return logring;
+	logring = ckzalloc(sizeof(logring_t));
+	pthread_setspecific(logring_key, logring);
+	mutex_lock(&logring_lock);
+	logring->next = logrings;
+	__atomic_store_n(&logrings, logring, __ATOMIC_RELEASE);
+	mutex_unlock(&logring_lock);
+	return logring;
+}
 
-	free(msg);
+static void writev_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t ret;
+
+	while (cnt) {
+		ret = writev(fd, iov, cnt);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		while (cnt && ret >= (ssize_t)iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
 }
 
-static void proclog(ckpool_t *ckp, char *msg)
+/* Write out everything queued in ring, logging to the logfile and displaying
+ * warnings on the console as well. Returns how many lines were written. */
+static int drain_logring(ckpool_t *ckp, logring_t *ring, const bool tty)
 {
-	time_t log_t = time(NULL);
+	struct iovec fileiov[LOGRING_SLOTS + 1], coniov[LOGRING_SLOTS * 2 + 2];
+	unsigned int tail = ring->tail, head;
+	int i, files = 0, cons = 0, lines;
+	char dropmsg[128];
+	int64_t dropped;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	lines = head - tail;
+	for (i = 0; i < lines; i++) {
+		logslot_t *slot = &ring->slots[(tail + i) % LOGRING_SLOTS];
+		char *line = slot->ext ? slot->ext : slot->buf;
 
-	/* Reopen log file every minute, allowing us to move/rename it and
-	 * create a new logfile */
-	if (log_t > ckp->lastopen_t + 60) {
-		LOGDEBUG("Reopening logfile");
-		open_logfile(ckp);
+		fileiov[files].iov_base = line;
+		fileiov[files++].iov_len = slot->len;
+		if (slot->loglevel > LOG_WARNING)
+			continue;
+		/* Add clear line only if stderr is going to console */
+		if (tty) {
+			coniov[cons].iov_base = "\33[2K\r";
+			coniov[cons++].iov_len = 5;
+		}
+		coniov[cons].iov_base = line;
+		coniov[cons++].iov_len = slot->len;
 	}
+	dropped = __sync_lock_test_and_set(&ring->dropped, 0);
+	if (unlikely(dropped)) {
+		int len = log_stamp(dropmsg);
 
-	flock(ckp->logfd, LOCK_EX);
-	fprintf(ckp->logfp, "%s", msg);
-	flock(ckp->logfd, LOCK_UN);
+		len += sprintf(dropmsg + len, " Logger dropped %"PRId64" lines from an overloaded thread\n",
+			       dropped);
+		fileiov[files].iov_base = coniov[cons].iov_base = dropmsg;
+		fileiov[files++].iov_len = coniov[cons++].iov_len = len;
+	}
+
+	if (files && ckp->logfd > 0) {
+		flock(ckp->logfd, LOCK_EX);
+		writev_all(ckp->logfd, fileiov, files);
+		flock(ckp->logfd, LOCK_UN);
+	}
+	if (cons)
+		writev_all(STDERR_FILENO, coniov, cons);
 
-	free(msg);
+	for (i = 0; i < lines; i++) {
+		logslot_t *slot = &ring->slots[(tail + i) % LOGRING_SLOTS];
+
+		if (unlikely(slot->ext))
+			dealloc(slot->ext);
+	}
+	__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+	return lines;
 }
 
-void get_timestamp(char *stamp)
+/* Drain every ring, freeing those of exited threads once they're empty */
+static int drain_logrings(ckpool_t *ckp, const bool tty)
 {
-	struct tm tm;
-	tv_t now_tv;
-	int ms;
+	logring_t *ring, **prev, *next;
+	int lines = 0;
 
-	tv_time(&now_tv);
-	ms = (int)(now_tv.tv_usec / 1000);
-	localtime_r(&(now_tv.tv_sec), &tm);
-	sprintf(stamp, "[%d-%02d-%02d %02d:%02d:%02d.%03d]",
-			tm.tm_year + 1900,
-			tm.tm_mon + 1,
-			tm.tm_mday,
-			tm.tm_hour,
-			tm.tm_min,
-			tm.tm_sec, ms);
+	for (ring = __atomic_load_n(&logrings, __ATOMIC_ACQUIRE); ring; ring = next) {
+		bool dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+
+		next = ring->next;
+		lines += drain_logring(ckp, ring, tty);
+		if (!dead)
+			continue;
+		/* New rings may have been added in front of this one */
+		mutex_lock(&logring_lock);
+		for (prev = &logrings; *prev != ring; prev = &(*prev)->next);
+		*prev = next;
+		mutex_unlock(&logring_lock);
+		free(ring);
+	}
+	return lines;
+}
+
+static void *logger(void *arg)
+{
+	bool tty = isatty(STDERR_FILENO);
+	ckpool_t *ckp = arg;
+
+	pthread_detach(pthread_self());
+	rename_proc("logger");
+	while (42) {
+		time_t log_t = time(NULL);
+
+		/* Reopen log file every minute, allowing us to move/rename it
+		 * and create a new logfile */
+		if (log_t > ckp->lastopen_t + 60) {
+			LOGDEBUG("Reopening logfile");
+			open_logfile(ckp);
+		}
+		if (drain_logrings(ckp, tty))
+			continue;
+
+		/* Only sleep once we're sure nothing was queued before the
+		 * loggers could see we're sleeping */
+		__atomic_store_n(&logger_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!drain_logrings(ckp, tty))
+			cksem_mswait(&logger_sem, 1000);
+		__atomic_store_n(&logger_sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
 }
 
 /* Log everything to the logfile, but display warnings on the console as well */
 void logmsg(int loglevel, const char *fmt, ...)
 {
-	int logfd = global_ckp->logfd;
-	char *log, *buf = NULL;
-	char stamp[128];
+	int len, ofs, errn = errno;
+	unsigned int head;
+	logring_t *ring;
+	logslot_t *slot;
+	char stamp[40];
 	va_list ap;
 
 	if (global_ckp->loglevel < loglevel || !fmt)
 		return;
 
-	va_start(ap, fmt);
-	VASPRINTF(&buf, fmt, ap);
-	va_end(ap);
+	if (unlikely(!logger_active)) {
+		char *buf;
 
-	if (unlikely(!buf)) {
-		fprintf(stderr, "Null buffer sent to logmsg\n");
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+		get_timestamp(stamp);
+		fprintf(stderr, "%s %s\n", stamp, buf);
+		free(buf);
 		return;
 	}
-	if (unlikely(!strlen(buf))) {
+
+	ring = get_logring();
+	head = ring->head;
+	if (unlikely(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOGRING_SLOTS)) {
+		__sync_fetch_and_add(&ring->dropped, 1);
+		return;
+	}
+	slot = &ring->slots[head % LOGRING_SLOTS];
+	slot->loglevel = loglevel;
+	slot->ext = NULL;
+	ofs = log_stamp(stamp);
+	memcpy(slot->buf, stamp, ofs);
+	slot->buf[ofs++] = ' ';
+
+	va_start(ap, fmt);
+	len = vsnprintf(slot->buf + ofs, LOGSLOT_SIZE - ofs, fmt, ap);
+	va_end(ap);
+	if (unlikely(len < 1)) {
 		fprintf(stderr, "Zero length string sent to logmsg\n");
-		goto out;
+		return;
 	}
-	get_timestamp(stamp);
-	if (loglevel <= LOG_ERR && errno != 0)
-		ASPRINTF(&log, "%s %s with errno %d: %s\n", stamp, buf, errno, strerror(errno));
-	else
-		ASPRINTF(&log, "%s %s\n", stamp, buf);
-
-	if (unlikely(!global_ckp->console_logger)) {
-		fprintf(stderr, "%s", log);
-		goto out_free;
-	}
-	if (loglevel <= LOG_WARNING)
-		ckmsgq_add(global_ckp->console_logger, strdup(log));
-	if (logfd > 0)
-		ckmsgq_add(global_ckp->logger, strdup(log));
-out_free:
-	free(log);
-out:
-	free(buf);
+	ofs += len;
+	if (loglevel <= LOG_ERR && errn != 0 && ofs < LOGSLOT_SIZE)
+		ofs += snprintf(slot->buf + ofs, LOGSLOT_SIZE - ofs, " with errno %d: %s", errn,
+				strerror(errn));
+	if (likely(ofs < LOGSLOT_SIZE - 1)) {
+		slot->buf[ofs++] = '\n';
+		slot->len = ofs;
+	} else {
+		char *buf;
+
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+		if (loglevel <= LOG_ERR && errn != 0)
+			ASPRINTF(&slot->ext, "%s %s with errno %d: %s\n", stamp, buf, errn, strerror(errn));
+		else
+			ASPRINTF(&slot->ext, "%s %s\n", stamp, buf);
+		free(buf);
+		slot->len = strlen(slot->ext);
+	}
+
+	/* Publish the slot and wake the logger if it's sleeping */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&logger_sleeping, __ATOMIC_SEQ_CST) &&
+	    __sync_bool_compare_and_swap(&logger_sleeping, 1, 0))
+		cksem_post(&logger_sem);
+}
+
+slab_t ckmsg_slab = SLAB_INIT("ckmsg", ckmsg_t);
+slab_t bus_msg_slab = SLAB_INIT("bus_msg", bus_msg_t);
+static slab_t unix_msg_slab = SLAB_INIT("unix_msg", unix_msg_t);
+
+static int64_t mono_ns(void)
+{
+	ts_t ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void futex_wait(int *uaddr, const int val, const int ms)
+{
+	ts_t ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static void futex_wake(int *uaddr, const int count)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* The ring this thread consumes from, which it must never block on */
+static __thread ckmsg_ring_t *consuming;
+
+static ckmsg_ring_t *create_ring(ckpool_t *ckp)
+{
+	ckmsg_ring_t *ring = ckzalloc(sizeof(ckmsg_ring_t));
+	int64_t i, size = 1;
+
+	while (size < ckp->msgq_size)
+		size <<= 1;
+	ring->cells = ckalloc(sizeof(struct ckmsg_cell) * size);
+	for (i = 0; i < size; i++)
+		ring->cells[i].seq = i;
+	ring->mask = size - 1;
+	ring->block = ckp->msgq_block;
+	mutex_init(&ring->lock);
+	return ring;
+}
+
+static int64_t ring_depth(ckmsg_ring_t *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) -
+		__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) +
+		__atomic_load_n(&ring->nspill, __ATOMIC_RELAXED);
+}
+
+static void ring_hwm(ckmsg_ring_t *ring)
+{
+	int64_t depth = ring_depth(ring), hwm = __atomic_load_n(&ring->hwm, __ATOMIC_RELAXED);
+
+	while (depth > hwm) {
+		if (__atomic_compare_exchange_n(&ring->hwm, &hwm, depth, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/* Claim the next free cell and fill it, returning false if the ring is full */
+static bool ring_push(ckmsg_ring_t *ring, void *data, const int64_t stamp)
+{
+	int64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+	while (42) {
+		struct ckmsg_cell *cell = &ring->cells[pos & ring->mask];
+		int64_t diff = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos;
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				cell->data = data;
+				cell->stamp = stamp;
+				__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+		} else if (diff < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+}
+
+/* Claim up to max consecutive filled cells with one exchange, returning how
+ * many were taken and adding up how long they waited. */
+static int ring_pop(ckmsg_ring_t *ring, void **data, const int max, const int64_t now,
+		    int64_t *total, int64_t *longest)
+{
+	int64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	int i, count;
+
+	while (42) {
+		for (count = 0; count < max; count++) {
+			struct ckmsg_cell *cell = &ring->cells[(pos + count) & ring->mask];
+
+			if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + count + 1)
+				break;
+		}
+		if (!count)
+			return 0;
+		if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + count, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+	for (i = 0; i < count; i++) {
+		struct ckmsg_cell *cell = &ring->cells[(pos + i) & ring->mask];
+		int64_t wait = now - cell->stamp;
+
+		data[i] = cell->data;
+		*total += wait;
+		if (wait > *longest)
+			*longest = wait;
+		__atomic_store_n(&cell->seq, pos + i + ring->mask + 1, __ATOMIC_RELEASE);
+	}
+	return count;
+}
+
+static int list_pop(ckmsg_ring_t *ring, ckmsg_t **list, int64_t *nlist, void **data,
+		    const int max, const int64_t now, int64_t *total, int64_t *longest)
+{
+	int count = 0;
+
+	mutex_lock(&ring->lock);
+	while (*list && count < max) {
+		ckmsg_t *msg = *list;
+		int64_t wait = now - msg->stamp;
+
+		DL_DELETE(*list, msg);
+		data[count++] = msg->data;
+		*total += wait;
+		if (wait > *longest)
+			*longest = wait;
+		slab_free(&ckmsg_slab, msg);
+	}
+	__atomic_store_n(nlist, *nlist - count, __ATOMIC_RELAXED);
+	mutex_unlock(&ring->lock);
+	return count;
+}
+
+/* Take up to max messages from the ring, and from the spill list only once
+ * the ring is drained so messages spilled past a full ring stay in order. */
+static int ckmsgq_pop(ckmsg_ring_t *ring, void **data, const int max)
+{
+	int64_t now = mono_ns(), total = 0, longest = 0, max_wait;
+	int count;
+
+	count = ring_pop(ring, data, max, now, &total, &longest);
+	/* Wake any producers waiting for the room we just made */
+	if (count) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (unlikely(__atomic_load_n(&ring->waiters, __ATOMIC_RELAXED))) {
+			__atomic_add_fetch(&ring->room, 1, __ATOMIC_SEQ_CST);
+			futex_wake(&ring->room, INT_MAX);
+		}
+	}
+	if (count < max && __atomic_load_n(&ring->nspill, __ATOMIC_RELAXED))
+		count += list_pop(ring, &ring->spill, &ring->nspill, data + count, max - count,
+				  now, &total, &longest);
+	if (!count)
+		return 0;
+
+	__atomic_add_fetch(&ring->waited, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ring->wait_ns, total, __ATOMIC_RELAXED);
+	max_wait = __atomic_load_n(&ring->max_wait_ns, __ATOMIC_RELAXED);
+	while (longest > max_wait) {
+		if (__atomic_compare_exchange_n(&ring->max_wait_ns, &max_wait, longest, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+	return count;
+}
+
+/* Backlog a shard needs before idle threads of its group steal from it */
+#define CKMSGQ_STEAL 32
+
+/* Take up to half the backlog of the first busy shard after our own */
+static int ckmsgq_steal(ckmsgq_t *ckmsgq, void **data, const int max)
+{
+	ckmsgq_t *group = ckmsgq - ckmsgq->shard;
+	int i;
+
+	for (i = 1; i < ckmsgq->shards; i++) {
+		ckmsg_ring_t *ring = group[(ckmsgq->shard + i) % ckmsgq->shards].ring;
+		int64_t depth = ring_depth(ring);
+		int count;
+
+		if (depth < CKMSGQ_STEAL)
+			continue;
+		count = ckmsgq_pop(ring, data, MIN(max, depth / 2));
+		if (count)
+			return count;
+	}
+	return 0;
+}
+
+/* Take up to max messages, sleeping up to a second for them to arrive if
+ * there are none. Consumers announce they're sleeping before checking the
+ * ring one last time so a producer always either sees them or has its
+ * message seen. */
+static int ckmsgq_wait(ckmsgq_t *ckmsgq, void **data, const int max)
+{
+	ckmsg_ring_t *ring = ckmsgq->ring;
+	int count, wake;
+
+	count = ckmsgq_pop(ring, data, max);
+	if (count)
+		return count;
+	if (ckmsgq->steal) {
+		count = ckmsgq_steal(ckmsgq, data, max);
+		if (count)
+			return count;
+	}
+
+	__atomic_add_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+	wake = __atomic_load_n(&ring->wake, __ATOMIC_SEQ_CST);
+	count = ckmsgq_pop(ring, data, max);
+	if (!count)
+		futex_wait(&ring->wake, wake, 1000);
+	__atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+	return count;
+}
+
+/* Wake up to count sleeping consumers, if there are any */
+static void ckmsgq_wake(ckmsg_ring_t *ring, const int count)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&ring->sleepers, __ATOMIC_RELAXED))
+		return;
+	__atomic_add_fetch(&ring->wake, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&ring->wake, count);
 }
 
 /* Generic function for creating a message queue receiving and parsing thread */
@@ -153,28 +597,37 @@ static void *ckmsg_queue(void *arg)
 
 	pthread_detach(pthread_self());
 	rename_proc(ckmsgq->name);
+	consuming = ckmsgq->ring;
 	ckmsgq->active = true;
 
 	while (42) {
-		ckmsg_t *msg;
-		tv_t now;
-		ts_t abs;
+		void *data;
 
-		mutex_lock(ckmsgq->lock);
-		tv_time(&now);
-		tv_to_ts(&abs, &now);
-		abs.tv_sec++;
-		if (!ckmsgq->msgs)
-			cond_timedwait(ckmsgq->cond, ckmsgq->lock, &abs);
-		msg = ckmsgq->msgs;
-		if (msg)
-			DL_DELETE(ckmsgq->msgs, msg);
-		mutex_unlock(ckmsgq->lock);
-
-		if (!msg)
-			continue;
-		ckmsgq->func(ckp, msg->data);
-		free(msg);
+		if (ckmsgq_wait(ckmsgq, &data, 1))
+			ckmsgq->func(ckp, data);
+	}
+	return NULL;
+}
+
+/* As ckmsg_queue but dequeues as many messages as are queued up to the batch
+ * size and hands them all to the batch function at once, in queue order. */
+static void *ckmsg_queue_batch(void *arg)
+{
+	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
+	ckpool_t *ckp = ckmsgq->ckp;
+	void **data;
+
+	pthread_detach(pthread_self());
+	rename_proc(ckmsgq->name);
+	data = ckalloc(sizeof(void *) * ckmsgq->batch);
+	consuming = ckmsgq->ring;
+	ckmsgq->active = true;
+
+	while (42) {
+		int count = ckmsgq_wait(ckmsgq, data, ckmsgq->batch);
+
+		if (count)
+			ckmsgq->batchfunc(ckp, data, count);
 	}
 	return NULL;
 }
@@ -186,81 +639,217 @@ ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
 	strncpy(ckmsgq->name, name, 15);
 	ckmsgq->func = func;
 	ckmsgq->ckp = ckp;
-	ckmsgq->lock = ckalloc(sizeof(mutex_t));
-	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(ckmsgq->lock);
-	cond_init(ckmsgq->cond);
+	ckmsgq->ring = create_ring(ckp);
 	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
 
 	return ckmsgq;
 }
 
-ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
+/* Set up count threads sharing one ring, or if sharded each with their own
+ * ring so that messages added with the same key are always processed by the
+ * same thread, in order. */
+static void setup_ckmsgqs(ckpool_t *ckp, ckmsgq_t *ckmsgq, const char *name, const int count,
+			  const bool sharded)
 {
-	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
-	mutex_t *lock;
-	pthread_cond_t *cond;
+	ckmsg_ring_t *ring = NULL;
 	int i;
 
-	lock = ckalloc(sizeof(mutex_t));
-	cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(lock);
-	cond_init(cond);
-
 	for (i = 0; i < count; i++) {
 		snprintf(ckmsgq[i].name, 15, "%.6s%x", name, i);
-		ckmsgq[i].func = func;
 		ckmsgq[i].ckp = ckp;
-		ckmsgq[i].lock = lock;
-		ckmsgq[i].cond = cond;
+		if (sharded) {
+			ckmsgq[i].ring = create_ring(ckp);
+			ckmsgq[i].shard = i;
+			ckmsgq[i].shards = count;
+			ckmsgq[i].steal = ckp->msgq_steal;
+		} else {
+			if (!ring)
+				ring = create_ring(ckp);
+			ckmsgq[i].ring = ring;
+		}
+	}
+}
+
+ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count,
+			 const bool sharded)
+{
+	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
+	int i;
+
+	setup_ckmsgqs(ckp, ckmsgq, name, count, sharded);
+	for (i = 0; i < count; i++) {
+		ckmsgq[i].func = func;
 		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
 	}
 
 	return ckmsgq;
 }
 
-/* Generic function for adding messages to a ckmsgq linked list and signal the
- * ckmsgq parsing thread(s) to wake up and process it. */
-bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
+/* As create_ckmsgqs but with threads that hand up to batch messages at a time
+ * to func which takes an array of the message data and its count. */
+ckmsgq_t *create_ckmsgqs_batch(ckpool_t *ckp, const char *name, const void *func, const int count,
+			       const int batch, const bool sharded)
+{
+	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
+	int i;
+
+	setup_ckmsgqs(ckp, ckmsgq, name, count, sharded);
+	for (i = 0; i < count; i++) {
+		ckmsgq[i].batchfunc = func;
+		ckmsgq[i].batch = batch;
+		create_pthread(&ckmsgq[i].pth, ckmsg_queue_batch, &ckmsgq[i]);
+	}
+
+	return ckmsgq;
+}
+
+/* The thread of a group to add a message with key to, any for a negative key */
+static ckmsgq_t *ckmsgq_shard(ckmsgq_t *ckmsgq, int64_t key)
+{
+	if (!ckmsgq->shards)
+		return ckmsgq;
+	if (key < 0)
+		key = (unsigned)__atomic_fetch_add(&ckmsgq->next, 1, __ATOMIC_RELAXED);
+	return &ckmsgq[key % ckmsgq->shards];
+}
+
+/* Once a shard builds a backlog, wake an idle thread of its group to steal */
+static void ckmsgq_wake_thief(ckmsgq_t *ckmsgq, ckmsg_ring_t *ring)
+{
+	ckmsgq_t *group = ckmsgq - ckmsgq->shard;
+	int i;
+
+	if (ring_depth(ring) < CKMSGQ_STEAL)
+		return;
+	for (i = 0; i < ckmsgq->shards; i++) {
+		ckmsg_ring_t *idle = group[i].ring;
+
+		if (idle != ring && __atomic_load_n(&idle->sleepers, __ATOMIC_RELAXED)) {
+			ckmsgq_wake(idle, 1);
+			break;
+		}
+	}
+}
+
+/* Append to the spill list, which producers keep using while it's not empty
+ * so messages don't overtake those already spilled. */
+static void ckmsgq_spill(ckmsg_ring_t *ring, void *data, const int64_t stamp)
+{
+	ckmsg_t *msg = slab_alloc(&ckmsg_slab);
+
+	msg->data = data;
+	msg->stamp = stamp;
+	mutex_lock(&ring->lock);
+	DL_APPEND(ring->spill, msg);
+	ring->listed++;
+	__atomic_store_n(&ring->nspill, ring->nspill + 1, __ATOMIC_RELAXED);
+	mutex_unlock(&ring->lock);
+}
+
+static void ckmsgq_push(ckmsg_ring_t *ring, void *data, const int64_t stamp)
+{
+	if (unlikely(__atomic_load_n(&ring->nspill, __ATOMIC_RELAXED)))
+		goto spill;
+	if (likely(ring_push(ring, data, stamp)))
+		return;
+
+	__atomic_add_fetch(&ring->fulls, 1, __ATOMIC_RELAXED);
+	/* Never wait on a ring we consume from ourselves since nothing may
+	 * ever make room for us */
+	if (!ring->block || ring == consuming)
+		goto spill;
+	__atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	while (42) {
+		int room = __atomic_load_n(&ring->room, __ATOMIC_SEQ_CST);
+
+		if (ring_push(ring, data, stamp))
+			break;
+		ckmsgq_wake(ring, 1);
+		futex_wait(&ring->room, room, 100);
+	}
+	__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	return;
+spill:
+	ckmsgq_spill(ring, data, stamp);
+}
+
+/* Generic function for adding messages to a ckmsgq and waking one of its
+ * threads to process it if they're all idle. Data is left to the caller to
+ * discard if it can't be queued since only the caller knows how it was
+ * allocated. */
+bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const int64_t key, const char *file,
+		 const char *func, const int line)
 {
-	ckmsg_t *msg;
+	ckmsg_ring_t *ring;
 
 	if (unlikely(!ckmsgq)) {
 		LOGWARNING("Sending messages to no queue from %s %s:%d", file, func, line);
-		/* Discard data if we're unlucky enough to be sending it to
-		 * msg queues not set up during start up */
-		free(data);
 		return false;
 	}
+	ckmsgq = ckmsgq_shard(ckmsgq, key);
 	while (unlikely(!ckmsgq->active))
 		cksleep_ms(10);
 
-	msg = ckalloc(sizeof(ckmsg_t));
-	msg->data = data;
-
-	mutex_lock(ckmsgq->lock);
-	ckmsgq->messages++;
-	DL_APPEND(ckmsgq->msgs, msg);
-	pthread_cond_broadcast(ckmsgq->cond);
-	mutex_unlock(ckmsgq->lock);
+	ring = ckmsgq->ring;
+	ckmsgq_push(ring, data, mono_ns());
+	ring_hwm(ring);
+	ckmsgq_wake(ring, 1);
+	if (ckmsgq->steal)
+		ckmsgq_wake_thief(ckmsgq, ring);
 
 	return true;
 }
 
-/* Return whether there are any messages queued in the ckmsgq linked list. */
+/* Return whether there are any messages queued in the ckmsgq. */
 bool ckmsgq_empty(ckmsgq_t *ckmsgq)
 {
-	bool ret = true;
+	int i;
 
 	if (unlikely(!ckmsgq || !ckmsgq->active))
-		goto out;
+		return true;
+	for (i = 0; i < MAX(ckmsgq->shards, 1); i++) {
+		if (ring_depth(ckmsgq[i].ring))
+			return false;
+	}
+	return true;
+}
 
-	mutex_lock(ckmsgq->lock);
-	if (ckmsgq->msgs)
-		ret = (ckmsgq->msgs->next == ckmsgq->msgs->prev);
-	mutex_unlock(ckmsgq->lock);
-out:
-	return ret;
+/* Counters for the stats, with memory being what the queued data of size
+ * bytes each and the rings themselves take, and wait times in microseconds.
+ * Sharded groups add up their shards and list each shard's count. */
+void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
+{
+	int64_t objects = 0, memsize = 0, generated = 0, hwm = 0, fulls = 0, waited = 0,
+		wait_ns = 0, max_wait_ns = 0;
+	json_t *shard_val = NULL;
+	int i;
+
+	if (ckmsgq->shards)
+		shard_val = json_array();
+	for (i = 0; i < MAX(ckmsgq->shards, 1); i++) {
+		ckmsg_ring_t *ring = ckmsgq[i].ring;
+		int64_t depth = ring_depth(ring);
+
+		objects += depth;
+		memsize += size * depth + sizeof(struct ckmsg_cell) * (ring->mask + 1);
+		mutex_lock(&ring->lock);
+		generated += ring->head + ring->listed;
+		mutex_unlock(&ring->lock);
+		hwm = MAX(hwm, __atomic_load_n(&ring->hwm, __ATOMIC_RELAXED));
+		fulls += __atomic_load_n(&ring->fulls, __ATOMIC_RELAXED);
+		waited += __atomic_load_n(&ring->waited, __ATOMIC_RELAXED);
+		wait_ns += __atomic_load_n(&ring->wait_ns, __ATOMIC_RELAXED);
+		max_wait_ns = MAX(max_wait_ns, __atomic_load_n(&ring->max_wait_ns, __ATOMIC_RELAXED));
+		if (shard_val)
+			json_array_append_new(shard_val, json_integer(depth));
+	}
+
+	JSON_CPACK(*val, "{sI,sI,sI,sI,sI,sf,sf}", "count", objects, "memory", memsize,
+		   "generated", generated, "hwm", hwm, "full", fulls,
+		   "waitavg", waited ? (double)wait_ns / waited / 1000 : 0.0,
+		   "waitmax", (double)max_wait_ns / 1000);
+	if (shard_val)
+		json_set_object(*val, "shards", shard_val);
 }
 
 /* Create a standalone thread that queues received unix messages for a proc
@@ -293,7 +882,7 @@ static void *unix_receiver(void *arg)
 			LOGWARNING("Failed to get message on %s socket", qname);
 			continue;
 		}
-		umsg = ckalloc(sizeof(unix_msg_t));
+		umsg = slab_alloc(&unix_msg_slab);
 		umsg->sockd = sockd;
 		umsg->buf = buf;
 
@@ -330,6 +919,17 @@ unix_msg_t *get_unix_msg(proc_instance_t *pi)
 	return umsg;
 }
 
+/* Close the socket of a unix message we've finished with and free it */
+void clear_unix_msg(unix_msg_t **umsg)
+{
+	if (*umsg) {
+		Close((*umsg)->sockd);
+		free((*umsg)->buf);
+		slab_free(&unix_msg_slab, *umsg);
+		*umsg = NULL;
+	}
+}
+
 static void create_unix_receiver(proc_instance_t *pi)
 {
 	pthread_t pth;
@@ -372,7 +972,11 @@ static void api_message(ckpool_t *ckp, char **buf, int *sockd)
 	*buf = NULL;
 	apimsg->sockd = *sockd;
 	*sockd = -1;
-	ckmsgq_add(ckp->ckpapi, apimsg);
+	if (unlikely(!ckmsgq_add(ckp->ckpapi, apimsg))) {
+		free(apimsg->buf);
+		Close(apimsg->sockd);
+		free(apimsg);
+	}
 }
 
 /* Listen for incoming global requests. Always returns a response if possible */
@@ -427,11 +1031,11 @@ retry:
 		connector_send_fd(ckp, fdno, sockd);
 	} else if (cmdmatch(buf, "accept")) {
 		LOGWARNING("Listener received accept message, accepting clients");
-		send_proc(ckp->connector, "accept");
+		bus_send(ckp->connector, BUS_ACCEPT, 0);
 		send_unix_msg(sockd, "accepting");
 	} else if (cmdmatch(buf, "reject")) {
 		LOGWARNING("Listener received reject message, rejecting clients");
-		send_proc(ckp->connector, "reject");
+		bus_send(ckp->connector, BUS_REJECT, 0);
 		send_unix_msg(sockd, "rejecting");
 	} else if (cmdmatch(buf, "reconnect")) {
 		LOGWARNING("Listener received request to send reconnect to clients");
@@ -457,6 +1061,14 @@ retry:
 		msg = connector_stats(ckp->cdata, 0);
 		send_unix_msg(sockd, msg);
 		dealloc(msg);
+	} else if (cmdmatch(buf, "slabstats")) {
+		json_t *val = slab_stats();
+
+		LOGDEBUG("Listener received slabstats request");
+		msg = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+		json_decref(val);
+		send_unix_msg(sockd, msg);
+		dealloc(msg);
 	} else if (cmdmatch(buf, "resetshares")) {
 		LOGWARNING("Resetting best shares");
 		send_proc(ckp->stratifier, buf);
@@ -694,7 +1306,7 @@ void _queue_proc(proc_instance_t *pi, const char *msg, const char *file, const c
 		LOGWARNING("Null msg passed to queue_proc from %s %s:%d", file, func, line);
 		return;
 	}
-	umsg = ckalloc(sizeof(unix_msg_t));
+	umsg = slab_alloc(&unix_msg_slab);
 	umsg->sockd = -1;
 	umsg->buf = strdup(msg);
 
@@ -704,6 +1316,45 @@ void _queue_proc(proc_instance_t *pi, const char *msg, const char *file, const c
 	mutex_unlock(&pi->rmsg_lock);
 }
 
+static const char *bus_ops[BUS_OPS] = {
+	"dropclient",
+	"testclient",
+	"passthrough",
+	"reconnclient",
+	"accept",
+	"reject",
+};
+
+/* Queue a typed message for a process instance's bus handler, keyed by the
+ * client id so each client's messages are handled in order. */
+void _bus_send(proc_instance_t *pi, const enum bus_op op, const int64_t id, const char *file,
+	       const char *func, const int line)
+{
+	bus_msg_t *msg;
+
+	if (unlikely(!pi->bus)) {
+		LOGWARNING("Bus message %s sent to %s without a bus from %s %s:%d", bus_ops[op],
+			   pi->processname, file, func, line);
+		return;
+	}
+	msg = slab_alloc(&bus_msg_slab);
+	msg->op = op;
+	msg->id = id;
+	__atomic_add_fetch(&pi->bus_sent[op], 1, __ATOMIC_RELAXED);
+	if (unlikely(!ckmsgq_add_key(pi->bus, msg, id)))
+		slab_free(&bus_msg_slab, msg);
+}
+
+/* Stats of a process instance's bus queue with the count sent of each op */
+void bus_stats(proc_instance_t *pi, json_t **val)
+{
+	int i;
+
+	ckmsgq_stats(pi->bus, sizeof(bus_msg_t), val);
+	for (i = 0; i < BUS_OPS; i++)
+		json_set_int64(*val, bus_ops[i], __atomic_load_n(&pi->bus_sent[i], __ATOMIC_RELAXED));
+}
+
 /* Send a single message to a process instance and retrieve the response, then
  * close the socket. */
 char *_send_recv_proc(const proc_instance_t *pi, const char *msg, int writetimeout, int readtimedout,
@@ -1063,8 +1714,21 @@ static void rm_namepid(const proc_instance_t *pi)
 
 static void launch_logger(ckpool_t *ckp)
 {
-	ckp->logger = create_ckmsgq(ckp, "logger", &proclog);
-	ckp->console_logger = create_ckmsgq(ckp, "conlog", &console_log);
+	pthread_t pth;
+
+	mutex_init(&logring_lock);
+	cksem_init(&logger_sem);
+	pthread_key_create(&logring_key, logring_exit);
+	create_pthread(&pth, logger, ckp);
+	logger_active = true;
+}
+
+/* The logger thread doesn't survive forking so start another one */
+static void relaunch_logger(ckpool_t *ckp)
+{
+	pthread_t pth;
+
+	create_pthread(&pth, logger, ckp);
 }
 
 static void clean_up(ckpool_t *ckp)
@@ -1439,6 +2103,18 @@ static void parse_config(ckpool_t *ckp)
 	json_get_int(&ckp->nonce1length, json_conf, "nonce1length");
 	json_get_int(&ckp->nonce2length, json_conf, "nonce2length");
 	json_get_int(&ckp->update_interval, json_conf, "update_interval");
+	json_get_int(&ckp->sharelog_sync, json_conf, "sharelog_sync");
+	json_get_bool(&ckp->sharelog_binary, json_conf, "sharelog_binary");
+	json_get_bool(&ckp->io_uring, json_conf, "io_uring");
+	json_get_int(&ckp->msgq_size, json_conf, "msgq_size");
+	json_get_bool(&ckp->msgq_block, json_conf, "msgq_block");
+	json_get_bool(&ckp->msgq_steal, json_conf, "msgq_steal");
+#ifndef USE_IO_URING
+	if (ckp->io_uring) {
+		LOGWARNING("io_uring requested but not built in, using epoll");
+		ckp->io_uring = false;
+	}
+#endif
 	json_get_string(&vmask, json_conf, "version_mask");
 	if (vmask && strlen(vmask) && validhex(vmask))
 		sscanf(vmask, "%x", &ckp->version_mask);
@@ -1474,10 +2150,52 @@ static void parse_config(ckpool_t *ckp)
 	if (arr_val)
 		parse_redirecturls(ckp, arr_val);
 	json_get_string(&ckp->zmqblock, json_conf, "zmqblock");
+	/* Command line overrides the config file */
+	if (!ckp->sha256)
+		json_get_string(&ckp->sha256, json_conf, "sha256");
+	if (!ckp->hex)
+		json_get_string(&ckp->hex, json_conf, "hex");
 
 	json_decref(json_conf);
 }
 
+/* Choose the sha256 implementation at runtime, testing it before use */
+static void select_sha256(ckpool_t *ckp)
+{
+	const char *impl;
+	char impls[64];
+
+	sha256_impls_list(impls, 64);
+	impl = sha256_select(ckp->sha256);
+	if (unlikely(!impl))
+		quit(1, "Unknown or unsupported sha256 implementation %s, built in: %s",
+		     ckp->sha256, impls);
+	if (likely(sha256_selftest())) {
+		LOGWARNING("Using %s sha256 implementation (built in: %s), self test passed", impl, impls);
+		return;
+	}
+	if (ckp->sha256)
+		quit(1, "Forced sha256 implementation %s failed self test", impl);
+	LOGEMERG("Sha256 implementation %s failed self test, falling back to generic", impl);
+	sha256_select("generic");
+	if (!sha256_selftest())
+		quit(1, "Generic sha256 implementation failed self test");
+}
+
+/* Choose the hex implementation, the fastest the CPU supports unless forced */
+static void select_hex(ckpool_t *ckp)
+{
+	const char *impl;
+	char impls[64];
+
+	hex_impls_list(impls, 64);
+	impl = hex_select(ckp->hex);
+	if (unlikely(!impl))
+		quit(1, "Unknown or unsupported hex implementation %s, built in: %s",
+		     ckp->hex, impls);
+	LOGNOTICE("Using %s hex implementation (built in: %s)", impl, impls);
+}
+
 static void manage_old_instance(ckpool_t *ckp, proc_instance_t *pi)
 {
 	struct stat statbuf;
@@ -1506,11 +2224,20 @@ static void manage_old_instance(ckpool_t *ckp, proc_instance_t *pi)
 	}
 }
 
-static void prepare_child(ckpool_t *ckp, proc_instance_t *pi, void *process, char *name)
+/* Processes taking typed messages have their bus created up front so they
+ * can be sent messages before they're ready to handle them. */
+static void prepare_child(ckpool_t *ckp, proc_instance_t *pi, void *process, void *bus,
+			  char *name)
 {
 	pi->ckp = ckp;
 	pi->processname = name;
 	pi->sockname = pi->processname;
+	if (bus) {
+		char busname[16];
+
+		sprintf(busname, "%cbus", name[0]);
+		pi->bus = create_ckmsgq(ckp, busname, bus);
+	}
 	create_process_unixsock(pi);
 	create_pthread(&pi->pth_process, process, pi);
 	create_unix_receiver(pi);
@@ -1523,6 +2250,7 @@ static struct option long_options[] = {
 	{"group",	required_argument,	0,	'g'},
 	{"handover",	no_argument,		0,	'H'},
 	{"help",	no_argument,		0,	'h'},
+	{"hex",		required_argument,	0,	'X'},
 	{"killold",	no_argument,		0,	'k'},
 	{"log-shares",	no_argument,		0,	'L'},
 	{"loglevel",	required_argument,	0,	'l'},
@@ -1532,6 +2260,7 @@ static struct option long_options[] = {
 	{"proxy",	no_argument,		0,	'p'},
 	{"quiet",	no_argument,		0,	'q'},
 	{"redirector",	no_argument,		0,	'R'},
+	{"sha256",	required_argument,	0,	'K'},
 	{"sockdir",	required_argument,	0,	's'},
 	{"trusted",	no_argument,		0,	't'},
 	{"userproxy",	no_argument,		0,	'u'},
@@ -1582,7 +2311,7 @@ int main(int argc, char **argv)
 	if (!strcmp(appname, "ckproxy"))
 		ckp.proxy = true;
 
-	while ((c = getopt_long(argc, argv, "Bc:Dd:g:HhkLl:Nn:PpqRS:s:tu", long_options, &i)) != -1) {
+	while ((c = getopt_long(argc, argv, "Bc:Dd:g:HhK:kLl:Nn:PpqRS:s:tuX:", long_options, &i)) != -1) {
 		switch (c) {
 			case 'B':
 				if (ckp.proxy)
@@ -1619,6 +2348,9 @@ int main(int argc, char **argv)
 						printf("-%c | --%s\n", jopt->val, jopt->name);
 				}
 				exit(0);
+			case 'K':
+				ckp.sha256 = strdup(optarg);
+				break;
 			case 'k':
 				ckp.killold = true;
 				break;
@@ -1671,6 +2403,9 @@ int main(int argc, char **argv)
 					quit(1, "Cannot set both userproxy and another proxy type or redirector");
 				ckp.userproxy = ckp.proxy = true;
 				break;
+			case 'X':
+				ckp.hex = strdup(optarg);
+				break;
 		}
 	}
 
@@ -1757,6 +2492,8 @@ int main(int argc, char **argv)
 		quit(0, "Invalid nonce2length %d specified, must be 2~8", ckp.nonce2length);
 	if (!ckp.update_interval)
 		ckp.update_interval = 30;
+	if (ckp.msgq_size < 64)
+		ckp.msgq_size = 16384;
 	if (!ckp.mindiff)
 		ckp.mindiff = 1;
 	if (!ckp.startdiff)
@@ -1804,6 +2541,9 @@ int main(int argc, char **argv)
 		quit(1, "Failed to make open log file %s", buf);
 	launch_logger(&ckp);
 
+	select_sha256(&ckp);
+	select_hex(&ckp);
+
 	ckp.main.ckp = &ckp;
 	ckp.main.processname = strdup("main");
 	ckp.main.sockname = strdup("listener");
@@ -1849,6 +2589,7 @@ int main(int argc, char **argv)
 
 		if (fork())
 			exit(0);
+		relaunch_logger(&ckp);
 		setsid();
 		fd = open("/dev/null",O_RDWR, 0);
 		if (fd != -1) {
@@ -1882,9 +2623,9 @@ int main(int argc, char **argv)
 	sigaction(SIGINT, &handler, NULL);
 
 	/* Launch separate processes from here */
-	prepare_child(&ckp, &ckp.generator, generator, "generator");
-	prepare_child(&ckp, &ckp.stratifier, stratifier, "stratifier");
-	prepare_child(&ckp, &ckp.connector, connector, "connector");
+	prepare_child(&ckp, &ckp.generator, generator, NULL, "generator");
+	prepare_child(&ckp, &ckp.stratifier, stratifier, stratifier_bus, "stratifier");
+	prepare_child(&ckp, &ckp.connector, connector, connector_bus, "connector");
 
 	/* Shutdown from here if the listener is sent a shutdown message */
 	if (ckp.pth_listener)
@@ -28,10 +28,50 @@ struct ckmsg {
 	struct ckmsg *next;
 	struct ckmsg *prev;
 	void *data;
+	int64_t stamp;
 };
 
 typedef struct ckmsg ckmsg_t;
 
+/* A slot in a ckmsgq ring, whose sequence number tells a producer at that
+ * position it's free or a consumer at that position it holds data. */
+struct ckmsg_cell {
+	int64_t seq;
+	void *data;
+	int64_t stamp; // Monotonic ns it was queued
+};
+
+/* Bounded multi producer multi consumer ring shared by all the threads of a
+ * ckmsgq, with a list for messages spilled once the ring is full, consumed
+ * after it. */
+struct ckmsg_ring {
+	int64_t head __attribute__((aligned(64))); // Next position to produce to
+	int64_t tail __attribute__((aligned(64))); // Next position to consume from
+	struct ckmsg_cell *cells __attribute__((aligned(64)));
+	int64_t mask;
+	bool block; // Producers wait for room when full instead of spilling
+
+	/* Idle consumers sleep on the wake futex and are woken one at a time */
+	int wake;
+	int sleepers;
+	/* Producers blocked on a full ring sleep on the room futex */
+	int room;
+	int waiters;
+
+	mutex_t lock;
+	ckmsg_t *spill;
+	int64_t nspill;
+	int64_t listed; // Total messages ever put on the spill list
+
+	int64_t hwm; // Most messages ever queued at once
+	int64_t fulls; // Times a producer found the ring full
+	int64_t waited; // Messages consumed
+	int64_t wait_ns; // Total time messages waited to be consumed
+	int64_t max_wait_ns;
+};
+
+typedef struct ckmsg_ring ckmsg_ring_t;
+
 typedef struct unix_msg unix_msg_t;
 
 struct unix_msg {
@@ -45,16 +85,40 @@ struct ckmsgq {
 	ckpool_t *ckp;
 	char name[16];
 	pthread_t pth;
-	mutex_t *lock;
-	pthread_cond_t *cond;
-	ckmsg_t *msgs;
+	ckmsg_ring_t *ring;
 	void (*func)(ckpool_t *, void *);
-	int64_t messages;
+	/* Batch processing function and maximum messages per batch if set */
+	void (*batchfunc)(ckpool_t *, void **, int);
+	int batch;
+	/* Sharded groups give each thread its own ring, chosen by key */
+	int shard;
+	int shards;
+	int next; // Round robin shard for unkeyed messages
+	bool steal; // Idle threads take from other shards' backlogs
 	bool active;
 };
 
 typedef struct ckmsgq ckmsgq_t;
 
+/* Opcodes of typed messages passed between the processes' threads on their
+ * bus queues instead of as text commands */
+enum bus_op {
+	BUS_DROPCLIENT,
+	BUS_TESTCLIENT,
+	BUS_PASSTHROUGH,
+	BUS_RECONNCLIENT,
+	BUS_ACCEPT,
+	BUS_REJECT,
+	BUS_OPS
+};
+
+struct bus_msg {
+	enum bus_op op;
+	int64_t id; // Client id if the op takes one
+};
+
+typedef struct bus_msg bus_msg_t;
+
 typedef struct proc_instance proc_instance_t;
 
 struct proc_instance {
@@ -70,6 +134,10 @@ struct proc_instance {
 	unix_msg_t *unix_msgs;
 	mutex_t rmsg_lock;
 	pthread_cond_t rmsg_cond;
+
+	/* Queue of typed bus messages and how many of each op were sent */
+	ckmsgq_t *bus;
+	int64_t bus_sent[BUS_OPS];
 };
 
 struct connsock {
@@ -164,14 +232,14 @@ struct ckpool_instance {
 	bool handover;
 	/* How many clients maximum to accept before rejecting further */
 	int maxclients;
+	/* Forced sha256 implementation instead of the fastest supported */
+	char *sha256;
+	/* Forced hex implementation instead of the fastest supported */
+	char *hex;
 
 	/* API message queue */
 	ckmsgq_t *ckpapi;
 
-	/* Logger message queue */
-	ckmsgq_t *logger;
-	ckmsgq_t *console_logger;
-
 	/* Process instance data of parent/child processes */
 	proc_instance_t main;
 
@@ -261,6 +329,12 @@ struct ckpool_instance {
 	char *upstream; // Upstream pool in trusted remote mode
 
 	int update_interval; // Seconds between stratum updates
+	int sharelog_sync; // Seconds between syncing share logs to disk, 0 for never
+	bool sharelog_binary; // Write compact binary share logs instead of json
+	bool io_uring; // Use the io_uring connector backend if built with it
+	int msgq_size; // Slots in each message queue ring, a power of 2
+	bool msgq_block; // Producers wait for room in full message queues
+	bool msgq_steal; // Idle sharded queue threads steal from busy ones
 
 	uint32_t version_mask; // Bits which set to true means allow miner to modify those bits
 
@@ -340,11 +414,24 @@ static const char __maybe_unused *stratum_msgs[] = {
 void get_timestamp(char *stamp);
 
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func);
-ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count);
-bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
-#define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, __FILE__, __func__, __LINE__)
+ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count,
+			 const bool sharded);
+ckmsgq_t *create_ckmsgqs_batch(ckpool_t *ckp, const char *name, const void *func, const int count,
+			       const int batch, const bool sharded);
+bool __must_check _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const int64_t key, const char *file,
+		 const char *func, const int line);
+#define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, -1, __FILE__, __func__, __LINE__)
+/* Messages with the same key always go to the same thread of a sharded group */
+#define ckmsgq_add_key(ckmsgq, data, key) _ckmsgq_add(ckmsgq, data, key, __FILE__, __func__, __LINE__)
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
+void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val);
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
+void clear_unix_msg(unix_msg_t **umsg);
+
+/* For callers building lists of ckmsgs to add to a ckmsgq in bulk */
+extern slab_t ckmsg_slab;
+/* For bus handlers to free the messages they're handed */
+extern slab_t bus_msg_slab;
 
 extern ckpool_t *global_ckp;
 
@@ -355,6 +442,10 @@ int set_recvbufsize(ckpool_t *ckp, const int fd, const int len);
 int read_socket_line(connsock_t *cs, float *timeout);
 void _queue_proc(proc_instance_t *pi, const char *msg, const char *file, const char *func, const int line);
 #define send_proc(pi, msg) _queue_proc(&(pi), msg, __FILE__, __func__, __LINE__)
+void _bus_send(proc_instance_t *pi, const enum bus_op op, const int64_t id, const char *file,
+	       const char *func, const int line);
+#define bus_send(pi, op, id) _bus_send(&(pi), op, id, __FILE__, __func__, __LINE__)
+void bus_stats(proc_instance_t *pi, json_t **val);
 char *_send_recv_proc(const proc_instance_t *pi, const char *msg, int writetimeout, int readtimedout,
 		      const char *file, const char *func, const int line);
 #define send_recv_proc(pi, msg) _send_recv_proc(&(pi), msg, UNIX_WRITE_TIMEOUT, UNIX_READ_TIMEOUT, __FILE__, __func__, __LINE__)
@@ -0,0 +1,345 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Converts binary share logs written with the sharelog_binary option back to
+ * the json lines ckpool writes to .sharelog files, optionally filtering them.
+ * Reads the files named on the command line in order, or stdin if none. */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "sharelog.h"
+
+static int msg_loglevel = LOG_WARNING;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (loglevel > msg_loglevel)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static struct option long_options[] = {
+	{"accepted",	no_argument,		0,	'a'},
+	{"clientid",	required_argument,	0,	'c'},
+	{"help",	no_argument,		0,	'h'},
+	{"loglevel",	required_argument,	0,	'l'},
+	{"username",	required_argument,	0,	'u'},
+	{"workername",	required_argument,	0,	'w'},
+	{0, 0, 0, 0}
+};
+
+/* Filters, where unset ones match everything */
+static bool accepted;
+static int64_t clientid = -1;
+static char *username;
+static char *workername;
+
+/* String and client tables of the current write session of a file */
+static char **strs;
+static uint32_t nstrs;
+static struct sharelog_client *clis;
+static uint32_t nclis;
+
+static int64_t workinfoid;
+
+static void reset_tables(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < nstrs; i++)
+		free(strs[i]);
+	dealloc(strs);
+	nstrs = 0;
+	dealloc(clis);
+	nclis = 0;
+}
+
+static const char *lookup_str(const uint32_t index)
+{
+	if (index == SHARELOG_NULL || index >= nstrs)
+		return NULL;
+	return strs[index];
+}
+
+/* Read exactly len bytes, returning false at a clean end of file */
+static bool read_all(FILE *fp, void *buf, const size_t len, const char *fname)
+{
+	size_t ret = fread(buf, 1, len, fp);
+
+	if (ret == len)
+		return true;
+	if (ret)
+		LOGWARNING("Truncated record in %s", fname);
+	return false;
+}
+
+static bool read_string(FILE *fp, const char *fname)
+{
+	struct sharelog_string rec;
+	char *str;
+
+	if (!read_all(fp, (char *)&rec + 1, sizeof(rec) - 1, fname))
+		return false;
+	/* Indexes are handed out in order so anything past the end of the
+	 * table is corrupt, and would have us allocate a huge table */
+	if (unlikely(rec.index > nstrs)) {
+		LOGWARNING("Invalid string index %u in %s", rec.index, fname);
+		return false;
+	}
+	str = ckalloc(rec.len + 1);
+	if (!read_all(fp, str, rec.len, fname)) {
+		free(str);
+		return false;
+	}
+	str[rec.len] = '\0';
+	if (rec.index >= nstrs) {
+		strs = realloc(strs, sizeof(char *) * (rec.index + 1));
+		if (unlikely(!strs))
+			quit(1, "Failed to realloc strs");
+		memset(strs + nstrs, 0, sizeof(char *) * (rec.index + 1 - nstrs));
+		nstrs = rec.index + 1;
+	}
+	free(strs[rec.index]);
+	strs[rec.index] = str;
+	return true;
+}
+
+static bool read_client(FILE *fp, const char *fname)
+{
+	struct sharelog_client rec;
+
+	rec.type = SLR_CLIENT;
+	if (!read_all(fp, (char *)&rec + 1, sizeof(rec) - 1, fname))
+		return false;
+	if (unlikely(rec.index > nclis)) {
+		LOGWARNING("Invalid client index %u in %s", rec.index, fname);
+		return false;
+	}
+	if (rec.index >= nclis) {
+		clis = realloc(clis, sizeof(struct sharelog_client) * (rec.index + 1));
+		if (unlikely(!clis))
+			quit(1, "Failed to realloc clis");
+		memset(clis + nclis, 0, sizeof(struct sharelog_client) * (rec.index + 1 - nclis));
+		nclis = rec.index + 1;
+	}
+	memcpy(&clis[rec.index], &rec, sizeof(rec));
+	return true;
+}
+
+static bool read_rawstr(FILE *fp, char *buf, const char *fname)
+{
+	uchar len;
+
+	if (!read_all(fp, &len, 1, fname))
+		return false;
+	buf[len] = '\0';
+	return !len || read_all(fp, buf, len, fname);
+}
+
+/* Read a share record and print it as json if it matches the filters */
+static bool read_share(FILE *fp, const char *fname)
+{
+	char hexhash[68] = {}, nonce2[256], nonce[256], ntime[256], cdfield[64];
+	struct sharelog_client *cli = NULL;
+	struct sharelog_share rec;
+	uchar hash[32] = {}, bin[32];
+	const char *user, *worker;
+	json_t *val;
+	char *s;
+
+	if (!read_all(fp, (char *)&rec + 1, sizeof(rec) - 1, fname))
+		return false;
+	if (rec.flags & SLF_HASH) {
+		if (unlikely(rec.hashlen > 32)) {
+			LOGWARNING("Invalid hash length %d in %s", rec.hashlen, fname);
+			return false;
+		}
+		if (!read_all(fp, hash + 32 - rec.hashlen, rec.hashlen, fname))
+			return false;
+		__bin2hex(hexhash, hash, 32);
+	}
+	if (rec.flags & SLF_RAW) {
+		if (!read_rawstr(fp, nonce2, fname) || !read_rawstr(fp, nonce, fname) ||
+		    !read_rawstr(fp, ntime, fname))
+			return false;
+	} else {
+		if (unlikely(rec.nonce2len > 16)) {
+			LOGWARNING("Invalid nonce2 length %d in %s", rec.nonce2len, fname);
+			return false;
+		}
+		if (!read_all(fp, bin, rec.nonce2len, fname))
+			return false;
+		__bin2hex(nonce2, bin, rec.nonce2len);
+		sprintf(nonce, "%08x", rec.nonce);
+		sprintf(ntime, "%08x", rec.ntime);
+	}
+
+	if (likely(rec.client < nclis))
+		cli = &clis[rec.client];
+	if (unlikely(!cli || !cli->type)) {
+		LOGWARNING("Share with unknown client %u in %s", rec.client, fname);
+		return true;
+	}
+	user = lookup_str(cli->username);
+	worker = lookup_str(cli->workername);
+	if (accepted && !(rec.flags & SLF_RESULT))
+		return true;
+	if (clientid >= 0 && cli->clientid != clientid)
+		return true;
+	if (username && safecmp(username, user))
+		return true;
+	if (workername && safecmp(workername, worker))
+		return true;
+
+	/* Build it exactly as parse_submit does for the json share logs */
+	val = json_object();
+	json_set_int(val, "workinfoid", workinfoid);
+	json_set_int64(val, "clientid", cli->clientid);
+	json_set_string(val, "enonce1", lookup_str(cli->enonce1));
+	json_set_string(val, "nonce2", nonce2);
+	json_set_string(val, "nonce", nonce);
+	json_set_string(val, "ntime", ntime);
+	json_set_double(val, "diff", rec.diff);
+	json_set_double(val, "sdiff", rec.sdiff);
+	json_set_string(val, "hash", hexhash);
+	json_set_bool(val, "result", rec.flags & SLF_RESULT);
+	if (rec.flags & SLF_REJECT)
+		json_set_string(val, "reject-reason", SHARE_ERR(rec.errn));
+	if (rec.flags & SLF_ERROR)
+		json_set_string(val, "error", SHARE_ERR(rec.errn));
+	json_set_int(val, "errn", rec.errn);
+	sprintf(cdfield, "%u,%u", rec.createsec, rec.creatensec);
+	json_set_string(val, "createdate", cdfield);
+	json_set_string(val, "createby", "code");
+	json_set_string(val, "createcode", "parse_submit");
+	json_set_string(val, "createinet", lookup_str(cli->createinet));
+	json_set_string(val, "workername", worker);
+	json_set_string(val, "username", user);
+	json_set_string(val, "address", lookup_str(cli->address));
+	json_set_string(val, "agent", lookup_str(cli->agent));
+
+	s = json_dumps(val, JSON_EOL);
+	fputs(s, stdout);
+	free(s);
+	json_decref(val);
+	return true;
+}
+
+static bool convert_file(FILE *fp, const char *fname)
+{
+	struct sharelog_workinfo wi;
+	bool ret = true;
+	uchar type;
+
+	reset_tables();
+	while (ret && fread(&type, 1, 1, fp) == 1) {
+		switch (type) {
+			case SLR_WORKINFO:
+				ret = read_all(fp, (char *)&wi + 1, sizeof(wi) - 1, fname);
+				if (!ret)
+					break;
+				if (wi.version != SHARELOG_VERSION) {
+					LOGERR("Unsupported share log version %d in %s", wi.version, fname);
+					return false;
+				}
+				workinfoid = wi.workinfoid;
+				reset_tables();
+				break;
+			case SLR_STRING:
+				ret = read_string(fp, fname);
+				break;
+			case SLR_CLIENT:
+				ret = read_client(fp, fname);
+				break;
+			case SLR_SHARE:
+				ret = read_share(fp, fname);
+				break;
+			default:
+				LOGERR("Unknown record type %d in %s", type, fname);
+				return false;
+		}
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int c, i = 0, j, ret = 0;
+
+	while ((c = getopt_long(argc, argv, "ac:hl:u:w:", long_options, &i)) != -1) {
+		switch(c) {
+			case 'a':
+				accepted = true;
+				break;
+			case 'c':
+				clientid = strtoll(optarg, NULL, 10);
+				break;
+			case 'h':
+				printf("Usage: %s [options] [sharebin files]\n", argv[0]);
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					if (jopt->has_arg) {
+						char *upper = alloca(strlen(jopt->name) + 1);
+						int offset = 0;
+
+						do {
+							upper[offset] = toupper(jopt->name[offset]);
+						} while (upper[offset++] != '\0');
+						printf("-%c %s | --%s %s\n", jopt->val,
+						       upper, jopt->name, upper);
+					} else
+						printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'l':
+				msg_loglevel = atoi(optarg);
+				break;
+			case 'u':
+				username = strdup(optarg);
+				break;
+			case 'w':
+				workername = strdup(optarg);
+				break;
+			default:
+				exit(1);
+		}
+	}
+
+	if (optind == argc) {
+		if (!convert_file(stdin, "stdin"))
+			ret = 1;
+	}
+	for (i = optind; i < argc; i++) {
+		FILE *fp = fopen(argv[i], "re");
+
+		if (unlikely(!fp)) {
+			LOGERR("Failed to open %s", argv[i]);
+			ret = 1;
+			continue;
+		}
+		if (!convert_file(fp, argv[i]))
+			ret = 1;
+		fclose(fp);
+	}
+	reset_tables();
+	return ret;
+}
@@ -10,9 +10,12 @@
 #include "config.h"
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -22,11 +25,14 @@
 #include "utlist.h"
 #include "stratifier.h"
 #include "generator.h"
+#include "uring.h"
 
 #define MAX_MSGSIZE 1024
 
 typedef struct client_instance client_instance_t;
 typedef struct sender_send sender_send_t;
+typedef struct sendbuf sendbuf_t;
+typedef struct reactor reactor_t;
 typedef struct share share_t;
 typedef struct redirect redirect_t;
 
@@ -63,8 +69,22 @@ struct client_instance {
 	char *buf;
 	unsigned long bufofs;
 
-	/* Are we currently sending a blocked message from this client */
-	sender_send_t *sending;
+	/* The reactor thread that accepted this client and owns its reads
+	 * and writes */
+	reactor_t *reactor;
+	/* Sends queued to this client by its reactor, oldest first */
+	sender_send_t *sends;
+	/* For the reactor's lists of clients ready to send to or blocked */
+	client_instance_t *send_next;
+	client_instance_t *send_prev;
+	/* Is this client on either of those lists, and which */
+	bool send_listed;
+	bool send_blocked;
+#ifdef USE_IO_URING
+	/* Iovecs of the writev an io_uring reactor has in flight, which is on
+	 * the blocked list until it completes */
+	struct iovec *send_iov;
+#endif
 
 	/* Is this a trusted remote server */
 	bool remote;
@@ -87,16 +107,59 @@ struct client_instance {
 	int sendbufsize;
 };
 
+/* A serialised message shared read only by all the sends of a broadcast,
+ * freed when the last of them is cleared */
+struct sendbuf {
+	int ref;
+	char *buf;
+};
+
 struct sender_send {
 	struct sender_send *next;
 	struct sender_send *prev;
 
 	client_instance_t *client;
+	/* Owned by this send unless it refers to a shared sendbuf */
 	char *buf;
+	sendbuf_t *sendbuf;
 	int len;
 	int ofs;
 };
 
+/* Each reactor thread has its own epoll set for the clients it accepted,
+ * reading from and writing to them itself. */
+struct reactor {
+	struct connector_data *cdata;
+	int id;
+	pthread_t pth;
+	int epfd;
+	/* Eventfd to wake the reactor with new sends */
+	int efd;
+
+	/* For protecting the pending sends list and stats */
+	mutex_t lock;
+	/* Linked list of sends queued to this reactor's clients */
+	sender_send_t *sends;
+
+	int64_t sends_generated;
+	int64_t sends_delayed;
+	int64_t sends_queued;
+	int64_t sends_size;
+
+	/* Clients with sends ready to write and those waiting on EPOLLOUT,
+	 * only touched by the reactor thread */
+	client_instance_t *ready;
+	client_instance_t *blocked;
+
+#ifdef USE_IO_URING
+	/* Is this reactor using an io_uring instead of epoll */
+	bool uring;
+	uring_t ring;
+	/* Where the ring reads the eventfd into */
+	uint64_t wake;
+#endif
+};
+
 struct share {
 	share_t *next;
 	share_t *prev;
@@ -124,12 +187,12 @@ struct connector_data {
 	int *serverfd;
 	/* All time count of clients connected */
 	int nfds;
-	/* The epoll fd */
-	int epfd;
 
 	bool accept;
-	pthread_t pth_sender;
-	pthread_t pth_receiver;
+
+	/* Array of reactor threads */
+	reactor_t *reactors;
+	int nreactors;
 
 	/* For the hashtable of all clients */
 	client_instance_t *clients;
@@ -146,21 +209,6 @@ struct connector_data {
 	/* client message process queue */
 	ckmsgq_t *cmpq;
 
-	/* client message event process queue */
-	ckmsgq_t *cevents;
-
-	/* For the linked list of pending sends */
-	sender_send_t *sender_sends;
-
-	int64_t sends_generated;
-	int64_t sends_delayed;
-	int64_t sends_queued;
-	int64_t sends_size;
-
-	/* For protecting the pending sends list */
-	mutex_t sender_lock;
-	pthread_cond_t sender_cond;
-
 	/* Hash list of all redirected IP address in redirector mode */
 	redirect_t *redirects;
 	/* What redirect we're currently up to */
@@ -176,12 +224,16 @@ struct connector_data {
 
 typedef struct connector_data cdata_t;
 
+static slab_t sender_send_slab = SLAB_INIT("sender_send", sender_send_t);
+static slab_t share_slab = SLAB_INIT("redirect_share", share_t);
+
 void connector_upstream_msg(ckpool_t *ckp, char *msg)
 {
 	cdata_t *cdata = ckp->cdata;
 
 	LOGDEBUG("Upstreaming %s", msg);
-	ckmsgq_add(cdata->upstream_sends, msg);
+	if (unlikely(!ckmsgq_add(cdata->upstream_sends, msg)))
+		free(msg);
 }
 
 /* Increase the reference count of instance */
@@ -227,18 +279,32 @@ static client_instance_t *recruit_client(cdata_t *cdata)
 	if (!client) {
 		LOGDEBUG("Connector created new client instance");
 		client = ckzalloc(sizeof(client_instance_t));
+		client->buf = ckzalloc(PAGESIZE);
 	} else
 		LOGDEBUG("Connector recycled client instance");
 
-	client->buf = ckzalloc(PAGESIZE);
-
 	return client;
 }
 
+/* Recycled clients keep their buffers for their next use */
 static void __recycle_client(cdata_t *cdata, client_instance_t *client)
 {
-	dealloc(client->buf);
+	char *buf = client->buf;
+#ifdef USE_IO_URING
+	struct iovec *send_iov = client->send_iov;
+#endif
+	share_t *share, *tmp;
+
+	DL_FOREACH_SAFE(client->shares, share, tmp) {
+		DL_DELETE(client->shares, share);
+		slab_free(&share_slab, share);
+	}
 	memset(client, 0, sizeof(client_instance_t));
+	client->buf = buf;
+	client->buf[0] = '\0';
+#ifdef USE_IO_URING
+	client->send_iov = send_iov;
+#endif
 	client->id = -1;
 	DL_APPEND2(cdata->recycled_clients, client, recycled_prev, recycled_next);
 }
@@ -264,43 +330,14 @@ int64_t connector_newclientid(ckpool_t *ckp)
 	return ret;
 }
 
-/* Accepts incoming connections on the server socket and generates client
- * instances */
-static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
+/* Set up a client instance for a connection just accepted on fd, adding it
+ * to the clients hashtable with a reference for its presence in the reactor.
+ * Returns false if the connection was discarded. */
+static bool setup_client(cdata_t *cdata, reactor_t *reactor, client_instance_t *client,
+			 int fd, const int no_clients)
 {
-	int fd, port, no_clients, sockd;
-	ckpool_t *ckp = cdata->ckp;
-	client_instance_t *client;
-	struct epoll_event event;
-	socklen_t address_len;
 	socklen_t optlen;
-
-	ck_rlock(&cdata->lock);
-	no_clients = HASH_COUNT(cdata->clients);
-	ck_runlock(&cdata->lock);
-
-	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
-		LOGWARNING("Server full with %d clients", no_clients);
-		return 0;
-	}
-
-	sockd = cdata->serverfd[server];
-	client = recruit_client(cdata);
-	client->server = server;
-	client->address = (struct sockaddr *)&client->address_storage;
-	address_len = sizeof(client->address_storage);
-	fd = accept(sockd, client->address, &address_len);
-	if (unlikely(fd < 0)) {
-		/* Handle these errors gracefully should we ever share this
-		 * socket */
-		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
-			LOGERR("Recoverable error on accept in accept_client");
-			return 0;
-		}
-		LOGERR("Failed to accept on socket %d in acceptor", sockd);
-		recycle_client(cdata, client);
-		return -1;
-	}
+	int port;
 
 	switch (client->address->sa_family) {
 		const struct sockaddr_in *inet4_in;
@@ -321,7 +358,7 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 				   cdata->nfds, fd);
 			Close(fd);
 			recycle_client(cdata, client);
-			return 0;
+			return false;
 	}
 
 	keep_sockalive(fd);
@@ -345,9 +382,54 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
 	LOGDEBUG("Client sendbufsize detected as %d", client->sendbufsize);
 
+	client->reactor = reactor;
+	return true;
+}
+
+/* Accepts incoming connections on the server socket and generates client
+ * instances */
+static int accept_client(cdata_t *cdata, reactor_t *reactor, const uint64_t server)
+{
+	int fd, no_clients, sockd;
+	ckpool_t *ckp = cdata->ckp;
+	client_instance_t *client;
+	struct epoll_event event;
+	socklen_t address_len;
+
+	ck_rlock(&cdata->lock);
+	no_clients = HASH_COUNT(cdata->clients);
+	ck_runlock(&cdata->lock);
+
+	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
+		LOGWARNING("Server full with %d clients", no_clients);
+		return 0;
+	}
+
+	sockd = cdata->serverfd[server];
+	client = recruit_client(cdata);
+	client->server = server;
+	client->address = (struct sockaddr *)&client->address_storage;
+	address_len = sizeof(client->address_storage);
+	fd = accept(sockd, client->address, &address_len);
+	if (unlikely(fd < 0)) {
+		/* The listening sockets are shared by all the reactors so
+		 * another one may have accepted this client already */
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+			LOGDEBUG("Recoverable error on accept in accept_client");
+			recycle_client(cdata, client);
+			return 0;
+		}
+		LOGERR("Failed to accept on socket %d in acceptor", sockd);
+		recycle_client(cdata, client);
+		return -1;
+	}
+
+	if (!setup_client(cdata, reactor, client, fd, no_clients))
+		return 0;
+
 	event.data.u64 = client->id;
-	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+	event.events = EPOLLIN | EPOLLRDHUP;
+	if (unlikely(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
 		LOGERR("Failed to epoll_ctl add in accept_client");
 		dec_instance_ref(cdata, client);
 		return 0;
@@ -364,6 +446,12 @@ static int __drop_client(cdata_t *cdata, client_instance_t *client)
 		goto out;
 	client->invalid = true;
 	ret = client->fd;
+#ifdef USE_IO_URING
+	/* Operations an io_uring has pending on the socket keep it open past
+	 * the close so shut it down to complete them */
+	if (client->reactor && client->reactor->uring)
+		shutdown(client->fd, SHUT_RDWR);
+#endif
 	/* Closing the fd will automatically remove it from the epoll list */
 	Close(client->fd);
 	HASH_DEL(cdata->clients, client);
@@ -378,10 +466,7 @@ out:
 
 static void stratifier_drop_id(ckpool_t *ckp, const int64_t id)
 {
-	char buf[256];
-
-	sprintf(buf, "dropclient=%"PRId64, id);
-	send_proc(ckp->stratifier, buf);
+	bus_send(ckp->stratifier, BUS_DROPCLIENT, id);
 }
 
 /* Client must hold a reference count */
@@ -488,7 +573,7 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 		LOGNOTICE("Failed to find redirector share id");
 		return;
 	}
-	share = ckzalloc(sizeof(share_t));
+	share = slab_zalloc(&share_slab);
 	now = time(NULL);
 	share->submitted = now;
 	share->id = id;
@@ -504,29 +589,249 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 	DL_FOREACH_SAFE(client->shares, share, tmp) {
 		if (now > share->submitted + 120) {
 			DL_DELETE(client->shares, share);
-			dealloc(share);
+			slab_free(&share_slab, share);
 		}
 	}
 	ck_wunlock(&cdata->lock);
 }
 
-/* Client is holding a reference count from being on the epoll list. Returns
- * true if we will still be receiving messages from this client. */
-static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+static const char *scan_space(const char *p, const char *end)
 {
-	int buflen, ret;
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	return p;
+}
+
+/* Copy the json string at p into dst, only accepting printable ASCII without
+ * escapes that fits in len so we never decode anything differently to
+ * jansson. Returns the position after the string or NULL on failure. */
+static const char *scan_string(const char *p, const char *end, char *dst, const size_t len)
+{
+	size_t i = 0;
+
+	if (p >= end || *p++ != '"')
+		return NULL;
+	while (p < end && *p != '"') {
+		const uchar c = *p++;
+
+		if (c == '\\' || c < 0x20 || c > 0x7e || i >= len - 1)
+			return NULL;
+		dst[i++] = c;
+	}
+	if (p >= end)
+		return NULL;
+	dst[i] = '\0';
+	return p + 1;
+}
+
+/* Ids are most commonly integers but can be strings or null */
+static const char *scan_id(const char *p, const char *end, submit_msg_t *share)
+{
+	bool neg = false;
+	int64_t id = 0;
+	int digits = 0;
+
+	if (p >= end)
+		return NULL;
+	if (*p == '"') {
+		share->idtype = SUBMIT_ID_STR;
+		return scan_string(p, end, share->idstr, sizeof(share->idstr));
+	}
+	if (end - p >= 4 && !memcmp(p, "null", 4)) {
+		share->idtype = SUBMIT_ID_NULL;
+		return p + 4;
+	}
+	if (*p == '-') {
+		neg = true;
+		p++;
+	}
+	/* No leading zeros, fractions, exponents or anything that may
+	 * overflow */
+	if (p >= end || !isdigit((uchar)*p) || (*p == '0' && p + 1 < end && isdigit((uchar)p[1])))
+		return NULL;
+	while (p < end && isdigit((uchar)*p)) {
+		if (++digits > 18)
+			return NULL;
+		id = id * 10 + *p++ - '0';
+	}
+	if (p < end && (*p == '.' || *p == 'e' || *p == 'E'))
+		return NULL;
+	share->idtype = SUBMIT_ID_INT;
+	share->id = neg ? -id : id;
+	return p;
+}
+
+static const char *scan_params(const char *p, const char *end, submit_msg_t *share)
+{
+	char *fields[] = { share->workername, share->job_id, share->nonce2, share->ntime,
+			   share->nonce, share->version_mask };
+	const size_t lens[] = { sizeof(share->workername), sizeof(share->job_id),
+				sizeof(share->nonce2), sizeof(share->ntime),
+				sizeof(share->nonce), sizeof(share->version_mask) };
+	int i;
+
+	if (p >= end || *p++ != '[')
+		return NULL;
+	share->version_mask[0] = '\0';
+	for (i = 0; i < 6; i++) {
+		p = scan_space(p, end);
+		if (!(p = scan_string(p, end, fields[i], lens[i])))
+			return NULL;
+		p = scan_space(p, end);
+		if (p >= end)
+			return NULL;
+		if (*p == ']') {
+			/* Leave too few params for the stratifier to reject */
+			if (i < 4)
+				return NULL;
+			share->params = i + 1;
+			return p + 1;
+		}
+		if (*p++ != ',')
+			return NULL;
+	}
+	return NULL;
+}
+
+/* Decode a mining.submit in the common form miners send it directly from the
+ * line in the client's buffer without allocating anything. Returns false for
+ * anything else, even valid json, leaving it to jansson. */
+static bool scan_submit(const char *p, const char *end, submit_msg_t *share)
+{
+	bool id = false, method = false, params = false;
+	char key[8], str[16];
+
+	p = scan_space(p, end);
+	if (p >= end || *p++ != '{')
+		return false;
+	do {
+		p = scan_space(p, end);
+		if (!(p = scan_string(p, end, key, sizeof(key))))
+			return false;
+		p = scan_space(p, end);
+		if (p >= end || *p++ != ':')
+			return false;
+		p = scan_space(p, end);
+		if (!id && !strcmp(key, "id")) {
+			p = scan_id(p, end, share);
+			id = true;
+		} else if (!method && !strcmp(key, "method")) {
+			p = scan_string(p, end, str, sizeof(str));
+			if (p && strcmp(str, "mining.submit"))
+				return false;
+			method = true;
+		} else if (!params && !strcmp(key, "params")) {
+			p = scan_params(p, end, share);
+			params = true;
+		} else
+			return false;
+		if (!p)
+			return false;
+		p = scan_space(p, end);
+		if (p >= end)
+			return false;
+	} while (*p++ == ',');
+
+	return p[-1] == '}' && id && method && params;
+}
+
+/* Make room in a client's buffer for another MAX_MSGSIZE of data, returning
+ * false if it has overloaded its buffer without an EOL. */
+static bool client_buf_room(client_instance_t *client)
+{
+	if (likely(client->bufofs <= MAX_MSGSIZE))
+		return true;
+	if (!client->remote) {
+		LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
+			client->id, client->fd);
+		return false;
+	}
+	client->buf = realloc(client->buf, round_up_page(client->bufofs + MAX_MSGSIZE + 1));
+	return true;
+}
+
+/* Handle every complete line in a client's buffer in place, moving whatever
+ * is left of the buffer down only once they've all been handled. Returns
+ * false if the client is to be dropped. */
+static bool parse_client_lines(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	submit_msg_t share;
+	char *line, *eol;
 	json_t *val;
-	char *eol;
+	int buflen;
+
+	line = client->buf;
+	while ((eol = memchr(line, '\n', client->buf + client->bufofs - line))) {
+		/* Do something useful with this message now */
+		buflen = eol - line + 1;
+		if (unlikely(buflen > MAX_MSGSIZE && !client->remote)) {
+			LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
+			return false;
+		}
 
-retry:
-	if (unlikely(client->bufofs > MAX_MSGSIZE)) {
-		if (!client->remote) {
-			LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
-				client->id, client->fd);
+		/* Shares make up almost all messages so decode them directly
+		 * when we're handing them to our own stratifier. */
+		if (!ckp->passthrough && scan_submit(line, eol, &share)) {
+			if (likely(!client->invalid)) {
+				share.client_id = client->id;
+				stratifier_add_submit(ckp, &share);
+			}
+		} else if (!(val = json_loads(line, JSON_DISABLE_EOF_CHECK, NULL))) {
+			char *buf = strdup("Invalid JSON, disconnecting\n");
+
+			LOGINFO("Client id %"PRId64" sent invalid json message %.*s", client->id,
+				(int)(eol - line), line);
+			send_client(ckp, cdata, client->id, buf);
 			return false;
+		} else {
+			if (client->passthrough) {
+				int64_t passthrough_id;
+
+				json_getdel_int64(&passthrough_id, val, "client_id");
+				passthrough_id = (client->id << 32) | passthrough_id;
+				json_object_set_new_nocheck(val, "client_id", json_integer(passthrough_id));
+			} else {
+				if (ckp->redirector && !client->redirected &&
+				    memmem(line, eol - line, "mining.submit", 13))
+					parse_redirector_share(cdata, client, val);
+				json_object_set_new_nocheck(val, "client_id", json_integer(client->id));
+				json_object_set_new_nocheck(val, "address", json_string(client->address_name));
+			}
+			json_object_set_new_nocheck(val, "server", json_integer(client->server));
+
+			/* Do not send messages of clients we've already
+			 * dropped. We do this unlocked as the occasional false
+			 * negative can be filtered by the stratifier. */
+			if (likely(!client->invalid)) {
+				if (!ckp->passthrough)
+					stratifier_add_recv(ckp, val);
+				if (ckp->node)
+					stratifier_add_recv(ckp, json_deep_copy(val));
+				if (ckp->passthrough)
+					generator_add_send(ckp, val);
+			} else
+				json_decref(val);
 		}
-		client->buf = realloc(client->buf, round_up_page(client->bufofs + MAX_MSGSIZE + 1));
+		line = eol + 1;
+	}
+	if (line != client->buf) {
+		client->bufofs -= line - client->buf;
+		if (client->bufofs)
+			memmove(client->buf, line, client->bufofs);
+		client->buf[client->bufofs] = '\0';
 	}
+	return true;
+}
+
+/* Client is holding a reference count from being on the epoll list. Returns
+ * true if we will still be receiving messages from this client. */
+static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	int ret;
+
+retry:
+	if (unlikely(!client_buf_room(client)))
+		return false;
 	/* This read call is non-blocking since the socket is set to O_NOBLOCK */
 	ret = read(client->fd, client->buf + client->bufofs, MAX_MSGSIZE);
 	if (ret < 1) {
@@ -537,321 +842,855 @@ retry:
 		return false;
 	}
 	client->bufofs += ret;
-reparse:
-	eol = memchr(client->buf, '\n', client->bufofs);
-	if (!eol)
-		goto retry;
-
-	/* Do something useful with this message now */
-	buflen = eol - client->buf + 1;
-	if (unlikely(buflen > MAX_MSGSIZE && !client->remote)) {
-		LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
+	client->buf[client->bufofs] = '\0';
+	if (unlikely(!parse_client_lines(ckp, cdata, client)))
 		return false;
+	goto retry;
+}
+
+static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
+{
+	client_instance_t *client;
+
+	ck_wlock(&cdata->lock);
+	HASH_FIND_I64(cdata->clients, &id, client);
+	if (client) {
+		if (!client->invalid)
+			__inc_instance_ref(client);
+		else
+			client = NULL;
 	}
+	ck_wunlock(&cdata->lock);
 
-	if (!(val = json_loads(client->buf, JSON_DISABLE_EOF_CHECK, NULL))) {
-		char *buf = strdup("Invalid JSON, disconnecting\n");
+	return client;
+}
 
-		LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, client->buf);
-		send_client(ckp, cdata, client->id, buf);
-		return false;
-	} else {
-		if (client->passthrough) {
-			int64_t passthrough_id;
+static void redirect_client(ckpool_t *ckp, client_instance_t *client);
+
+static bool redirect_matches(cdata_t *cdata, client_instance_t *client)
+{
+	redirect_t *redirect;
+
+	ck_rlock(&cdata->lock);
+	HASH_FIND_STR(cdata->redirects, client->address_name, redirect);
+	ck_runlock(&cdata->lock);
+
+	return redirect;
+}
 
-			json_getdel_int64(&passthrough_id, val, "client_id");
-			passthrough_id = (client->id << 32) | passthrough_id;
-			json_object_set_new_nocheck(val, "client_id", json_integer(passthrough_id));
+/* Watch a client for reads, and for being writable again once its socket
+ * has filled up. */
+static bool watch_client(reactor_t *reactor, client_instance_t *client, const bool writes)
+{
+	struct epoll_event event;
+
+	event.data.u64 = client->id;
+	event.events = EPOLLIN | EPOLLRDHUP;
+	if (writes)
+		event.events |= EPOLLOUT;
+	return !epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+/* Handle epoll events of a client the reactor holds a reference to */
+static void client_event(ckpool_t *ckp, reactor_t *reactor, client_instance_t *client,
+			 const uint32_t events)
+{
+	cdata_t *cdata = reactor->cdata;
+
+	/* A blocked client can be written to again */
+	if ((events & EPOLLOUT) && client->send_blocked) {
+		client->send_blocked = false;
+		DL_DELETE2(reactor->blocked, client, send_prev, send_next);
+		DL_APPEND2(reactor->ready, client, send_prev, send_next);
+		watch_client(reactor, client, false);
+	}
+	/* We can have both messages and read hang ups so process the
+	 * message first. */
+	if (likely(events & EPOLLIN)) {
+		if (unlikely(!parse_client_msg(ckp, cdata, client))) {
+			invalidate_client(ckp, cdata, client);
+			return;
+		}
+	}
+	if (unlikely(events & EPOLLERR)) {
+		socklen_t errlen = sizeof(int);
+		int error = 0;
+
+		/* See what type of error this is and raise the log
+			* level of the message if it's unexpected. */
+		getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
+		if (error != 104) {
+			LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+					client->id, client->fd, error, strerror(error));
 		} else {
-			if (ckp->redirector && !client->redirected && strstr(client->buf, "mining.submit"))
-				parse_redirector_share(cdata, client, val);
-			json_object_set_new_nocheck(val, "client_id", json_integer(client->id));
-			json_object_set_new_nocheck(val, "address", json_string(client->address_name));
+			LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+				client->id, client->fd, error, strerror(error));
 		}
-		json_object_set_new_nocheck(val, "server", json_integer(client->server));
+		invalidate_client(cdata->pi->ckp, cdata, client);
+	} else if (unlikely(events & EPOLLHUP)) {
+		/* Client connection reset by peer */
+		LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
+		invalidate_client(cdata->pi->ckp, cdata, client);
+	} else if (unlikely(events & EPOLLRDHUP)) {
+		/* Client disconnected by peer */
+		LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
+		invalidate_client(cdata->pi->ckp, cdata, client);
+	}
+}
 
-		/* Do not send messages of clients we've already dropped. We
-		 * do this unlocked as the occasional false negative can be
-		 * filtered by the stratifier. */
-		if (likely(!client->invalid)) {
-			if (!ckp->passthrough)
-				stratifier_add_recv(ckp, val);
-			if (ckp->node)
-				stratifier_add_recv(ckp, json_deep_copy(val));
-			if (ckp->passthrough)
-				generator_add_send(ckp, val);
-		} else
-			json_decref(val);
+static void put_sendbuf(sendbuf_t *sendbuf)
+{
+	if (__sync_sub_and_fetch(&sendbuf->ref, 1))
+		return;
+	free(sendbuf->buf);
+	free(sendbuf);
+}
+
+/* Most queued sends written to a client with one writev */
+#define SENDER_IOVS 64
+/* Most epoll events a reactor harvests at once */
+#define REACTOR_EVENTS 64
+/* Epoll data of the eventfd used to wake a reactor, above any client id */
+#define REACTOR_WAKE UINT64_MAX
+
+enum send_state {
+	SEND_EMPTY,	/* All queued sends were written */
+	SEND_MORE,	/* More can be written straight away */
+	SEND_BLOCKED,	/* The socket is full */
+	SEND_DEAD,	/* The client is gone */
+};
+
+/* Fill iov with up to SENDER_IOVS of a client's queued sends, returning how
+ * many and their total length */
+static int client_send_iovs(client_instance_t *client, struct iovec *iov, ssize_t *total)
+{
+	sender_send_t *send;
+	int iovs = 0;
+
+	*total = 0;
+	DL_FOREACH(client->sends, send) {
+		iov[iovs].iov_base = send->buf + send->ofs;
+		iov[iovs].iov_len = send->len;
+		*total += send->len;
+		if (++iovs == SENDER_IOVS)
+			break;
 	}
-	client->bufofs -= buflen;
-	if (client->bufofs)
-		memmove(client->buf, client->buf + buflen, client->bufofs);
-	client->buf[client->bufofs] = '\0';
+	return iovs;
+}
 
-	if (client->bufofs)
-		goto reparse;
-	goto retry;
+/* Account for ret bytes of a client's queued sends having been written,
+ * moving those completed to the done list */
+static void client_sends_written(client_instance_t *client, ssize_t ret, sender_send_t **done)
+{
+	sender_send_t *send, *tmp;
+
+	DL_FOREACH_SAFE(client->sends, send, tmp) {
+		if (ret < send->len) {
+			send->ofs += ret;
+			send->len -= ret;
+			break;
+		}
+		ret -= send->len;
+		send->ofs += send->len;
+		send->len = 0;
+		DL_DELETE(client->sends, send);
+		DL_APPEND(*done, send);
+	}
 }
 
-static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
+/* Write as many of a client's queued sends as its socket will take with one
+ * writev, moving those completed to the done list. A dead client has all of
+ * its sends moved there. */
+static int flush_client_sends(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			      sender_send_t **done)
 {
+	struct iovec iov[SENDER_IOVS];
+	ssize_t ret, total;
+	int iovs;
+
+	if (unlikely(client->invalid))
+		goto dead;
+
+	iovs = client_send_iovs(client, iov, &total);
+	ret = writev(client->fd, iov, iovs);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return SEND_BLOCKED;
+		LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
+			client->id, client->fd, errno, strerror(errno));
+		invalidate_client(ckp, cdata, client);
+		goto dead;
+	}
+	client->blocked_time = 0;
+	client_sends_written(client, ret, done);
+	if (ret < total)
+		return SEND_BLOCKED;
+	return client->sends ? SEND_MORE : SEND_EMPTY;
+dead:
+	DL_CONCAT(*done, client->sends);
+	client->sends = NULL;
+	return SEND_DEAD;
+}
+
+/* Free a send once its client reference has been dropped */
+static void free_sender_send(sender_send_t *sender_send)
+{
+	if (sender_send->sendbuf)
+		put_sendbuf(sender_send->sendbuf);
+	else
+		free(sender_send->buf);
+	slab_free(&sender_send_slab, sender_send);
+}
+
+/* Hand a list of sends to clients of a reactor, waking it if it may be
+ * waiting on an empty list. */
+static void queue_sender_sends(reactor_t *reactor, sender_send_t *sends, const int count)
+{
+	uint64_t wake = 1;
+	bool empty;
+
+	mutex_lock(&reactor->lock);
+	empty = !reactor->sends;
+	reactor->sends_generated += count;
+	DL_CONCAT(reactor->sends, sends);
+	mutex_unlock(&reactor->lock);
+
+	if (empty && unlikely(write(reactor->efd, &wake, sizeof(wake)) != sizeof(wake)))
+		LOGWARNING("Failed to wake reactor %d with errno %d:%s", reactor->id,
+			   errno, strerror(errno));
+}
+
+static void queue_sender_send(sender_send_t *sender_send)
+{
+	sender_send_t *sends = NULL;
+
+	DL_APPEND(sends, sender_send);
+	queue_sender_sends(sender_send->client->reactor, sends, 1);
+}
+
+/* Move the sends queued to a reactor onto their clients' queues, listing
+ * those clients as ready to be written to */
+static void reactor_take_sends(reactor_t *reactor, int64_t *queued, int64_t *size)
+{
+	ckpool_t *ckp = reactor->cdata->ckp;
+	sender_send_t *sends, *send, *tmp;
 	client_instance_t *client;
 
+	mutex_lock(&reactor->lock);
+	sends = reactor->sends;
+	reactor->sends = NULL;
+	reactor->sends_queued = *queued;
+	reactor->sends_size = *size;
+	mutex_unlock(&reactor->lock);
+
+	DL_FOREACH_SAFE(sends, send, tmp) {
+		DL_DELETE(sends, send);
+		client = send->client;
+		(*queued)++;
+		*size += sizeof(sender_send_t) + send->len + 1;
+
+		/* Increase sendbufsize to match large messages sent to
+		 * clients - this usually only applies to clients as
+		 * mining nodes. */
+		if (unlikely(!ckp->wmem_warn && send->len > client->sendbufsize))
+			client->sendbufsize = set_sendbufsize(ckp, client->fd, send->len);
+		DL_APPEND(client->sends, send);
+		if (!client->send_listed) {
+			client->send_listed = true;
+			DL_APPEND2(reactor->ready, client, send_prev, send_next);
+		}
+	}
+}
+
+/* Drop the references a reactor holds to an array of clients, where any
+ * may be NULL, and those held by completed sends all at once before freeing
+ * the sends. */
+static void reactor_release(reactor_t *reactor, client_instance_t **clients, const int nclients,
+			    sender_send_t *done, int64_t *queued, int64_t *size)
+{
+	cdata_t *cdata = reactor->cdata;
+	sender_send_t *send, *tmp;
+	int i;
+
 	ck_wlock(&cdata->lock);
-	HASH_FIND_I64(cdata->clients, &id, client);
-	if (client) {
-		if (!client->invalid)
-			__inc_instance_ref(client);
+	for (i = 0; i < nclients; i++) {
+		if (clients[i])
+			__dec_instance_ref(clients[i]);
+	}
+	DL_FOREACH(done, send)
+		__dec_instance_ref(send->client);
+	ck_wunlock(&cdata->lock);
+
+	DL_FOREACH_SAFE(done, send, tmp) {
+		(*queued)--;
+		*size -= sizeof(sender_send_t) + send->ofs + send->len + 1;
+		DL_DELETE(done, send);
+		free_sender_send(send);
+	}
+}
+
+#ifdef USE_IO_URING
+/* Submission queue entries and provided receive buffers of each ring */
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024
+
+/* The operation a completion is for is in the low bits of its user_data,
+ * above which is the client it's for, or the server for accepts. */
+enum uring_op {
+	UR_IGNORE,
+	UR_WAKE,
+	UR_ACCEPT,
+	UR_RECV,
+	UR_SEND,
+};
+
+#define UR_OPBITS 3
+#define UR_OPMASK ((1 << UR_OPBITS) - 1)
+#define UR_CLIENT(client, op) ((uint64_t)(uintptr_t)(client) | (op))
+#define UR_SERVER(server) (((uint64_t)(server) << UR_OPBITS) | UR_ACCEPT)
+
+/* Set up a reactor to use an io_uring with a ring of buffers for the
+ * multishot recvs of all its clients to share */
+static bool setup_uring(reactor_t *reactor)
+{
+	if (unlikely(!uring_init(&reactor->ring, URING_ENTRIES)))
+		return false;
+	if (unlikely(!uring_setup_bufs(&reactor->ring, 0, URING_BUFS, MAX_MSGSIZE))) {
+		uring_exit(&reactor->ring);
+		return false;
+	}
+	reactor->uring = true;
+	return true;
+}
+
+static struct io_uring_sqe *uring_sqe(reactor_t *reactor, const uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&reactor->ring);
+
+	if (unlikely(!sqe)) {
+		LOGWARNING("Reactor %d io_uring submission queue full", reactor->id);
+		return NULL;
+	}
+	sqe->user_data = user_data;
+	return sqe;
+}
+
+/* Read the eventfd that wakes the reactor with new sends */
+static void uring_read_wake(reactor_t *reactor)
+{
+	struct io_uring_sqe *sqe = uring_sqe(reactor, UR_WAKE);
+
+	if (unlikely(!sqe))
+		return;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = reactor->efd;
+	sqe->addr = (uintptr_t)&reactor->wake;
+	sqe->len = sizeof(reactor->wake);
+}
+
+static void uring_cancel(reactor_t *reactor, const uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_sqe(reactor, UR_IGNORE);
+
+	if (unlikely(!sqe))
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = user_data;
+}
+
+/* Accept every client connecting to a server until cancelled */
+static void uring_accept(reactor_t *reactor, const int server)
+{
+	struct io_uring_sqe *sqe = uring_sqe(reactor, UR_SERVER(server));
+
+	if (unlikely(!sqe))
+		return;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = reactor->cdata->serverfd[server];
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/* Start or cancel the multishot accepts on every listening socket. Returns
+ * whether we're now accepting. */
+static bool uring_listen(reactor_t *reactor, const bool accept)
+{
+	int i;
+
+	for (i = 0; i < reactor->cdata->ckp->serverurls; i++) {
+		if (accept)
+			uring_accept(reactor, i);
 		else
-			client = NULL;
+			uring_cancel(reactor, UR_SERVER(i));
+	}
+	return accept;
+}
+
+/* Receive everything a client sends into the reactor's provided buffers
+ * until it stops, with a reference held to the client */
+static bool uring_recv(reactor_t *reactor, client_instance_t *client)
+{
+	struct io_uring_sqe *sqe = uring_sqe(reactor, UR_CLIENT(client, UR_RECV));
+
+	if (unlikely(!sqe))
+		return false;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = reactor->ring.bgid;
+	return true;
+}
+
+/* Write as many of a client's queued sends as fit in one writev, which
+ * stays in flight until the socket has taken at least some of them. The
+ * sends it writes hold references to the client until it completes. */
+static bool uring_send(reactor_t *reactor, client_instance_t *client)
+{
+	struct io_uring_sqe *sqe = uring_sqe(reactor, UR_CLIENT(client, UR_SEND));
+	ssize_t total;
+
+	if (unlikely(!sqe))
+		return false;
+	if (!client->send_iov)
+		client->send_iov = ckalloc(sizeof(struct iovec) * SENDER_IOVS);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = client->fd;
+	sqe->addr = (uintptr_t)client->send_iov;
+	sqe->len = client_send_iovs(client, client->send_iov, &total);
+	return true;
+}
+
+/* A multishot accept has given us the fd of a new client */
+static void uring_accept_client(cdata_t *cdata, reactor_t *reactor, const int server, int fd)
+{
+	ckpool_t *ckp = cdata->ckp;
+	client_instance_t *client;
+	socklen_t address_len;
+	int no_clients;
+
+	ck_rlock(&cdata->lock);
+	no_clients = HASH_COUNT(cdata->clients);
+	ck_runlock(&cdata->lock);
+
+	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
+		LOGWARNING("Server full with %d clients", no_clients);
+		nolinger_socket(fd);
+		Close(fd);
+		return;
+	}
+
+	client = recruit_client(cdata);
+	client->server = server;
+	client->address = (struct sockaddr *)&client->address_storage;
+	address_len = sizeof(client->address_storage);
+	if (unlikely(getpeername(fd, client->address, &address_len) < 0)) {
+		LOGDEBUG("Client on socket %d gone before getpeername", fd);
+		Close(fd);
+		recycle_client(cdata, client);
+		return;
 	}
-	ck_wunlock(&cdata->lock);
+	if (!setup_client(cdata, reactor, client, fd, no_clients))
+		return;
 
-	return client;
+	inc_instance_ref(cdata, client);
+	if (unlikely(!uring_recv(reactor, client))) {
+		dec_instance_ref(cdata, client);
+		invalidate_client(ckp, cdata, client);
+	}
 }
 
-static void redirect_client(ckpool_t *ckp, client_instance_t *client);
-
-static bool redirect_matches(cdata_t *cdata, client_instance_t *client)
+static void uring_accept_event(cdata_t *cdata, reactor_t *reactor, const int server,
+			       const struct io_uring_cqe *cqe, const bool accepting)
 {
-	redirect_t *redirect;
-
-	ck_rlock(&cdata->lock);
-	HASH_FIND_STR(cdata->redirects, client->address_name, redirect);
-	ck_runlock(&cdata->lock);
-
-	return redirect;
+	if (likely(cqe->res >= 0))
+		uring_accept_client(cdata, reactor, server, cqe->res);
+	else if (cqe->res != -ECANCELED)
+		LOGDEBUG("Recoverable error %d on accept in reactor", -cqe->res);
+
+	/* Rearm the accept if the kernel stopped it while still accepting */
+	if (!(cqe->flags & IORING_CQE_F_MORE) && accepting && cqe->res != -ECANCELED)
+		uring_accept(reactor, server);
 }
 
-static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
+/* Handle a completion of a client's multishot recv. Returns true once it
+ * has stopped for good and its reference to the client can be dropped. */
+static bool uring_recv_event(ckpool_t *ckp, reactor_t *reactor, client_instance_t *client,
+			     const struct io_uring_cqe *cqe)
 {
-	const uint32_t events = event->events;
-	const uint64_t id = event->data.u64;
-	cdata_t *cdata = ckp->cdata;
-	client_instance_t *client;
+	cdata_t *cdata = reactor->cdata;
+	const int res = cqe->res;
 
-	client = ref_client_by_id(cdata, id);
-	if (unlikely(!client)) {
-		LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
-		goto outnoclient;
-	}
-	/* We can have both messages and read hang ups so process the
-	 * message first. */
-	if (likely(events & EPOLLIN)) {
-		/* Rearm the client for epoll events if we have successfully
-		 * parsed a message from it */
-		if (unlikely(!parse_client_msg(ckp, cdata, client))) {
-			invalidate_client(ckp, cdata, client);
-			goto out;
-		}
-	}
-	if (unlikely(events & EPOLLERR)) {
-		socklen_t errlen = sizeof(int);
-		int error = 0;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		const unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
 
-		/* See what type of error this is and raise the log
-			* level of the message if it's unexpected. */
-		getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
-		if (error != 104) {
-			LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-					client->id, client->fd, error, strerror(error));
-		} else {
-			LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-				client->id, client->fd, error, strerror(error));
+		if (likely(res > 0 && !client->invalid)) {
+			if (unlikely(!client_buf_room(client)))
+				invalidate_client(ckp, cdata, client);
+			else {
+				memcpy(client->buf + client->bufofs, uring_buf(&reactor->ring, bid), res);
+				client->bufofs += res;
+				client->buf[client->bufofs] = '\0';
+				if (unlikely(!parse_client_lines(ckp, cdata, client)))
+					invalidate_client(ckp, cdata, client);
+			}
 		}
-		invalidate_client(cdata->pi->ckp, cdata, client);
-	} else if (unlikely(events & EPOLLHUP)) {
-		/* Client connection reset by peer */
-		LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
-		invalidate_client(cdata->pi->ckp, cdata, client);
-	} else if (unlikely(events & EPOLLRDHUP)) {
-		/* Client disconnected by peer */
-		LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
-		invalidate_client(cdata->pi->ckp, cdata, client);
+		uring_recycle_buf(&reactor->ring, bid);
 	}
-out:
-	if (likely(!client->invalid)) {
-		/* Rearm the fd in the epoll list if it's still active */
-		event->data.u64 = id;
-		event->events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-		epoll_ctl(cdata->epfd, EPOLL_CTL_MOD, client->fd, event);
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return false;
+	if (client->invalid)
+		return true;
+
+	/* The kernel stops a multishot recv when it runs out of buffers, and
+	 * may do so at other times too, so rearm it while there's data */
+	if ((res > 0 || res == -ENOBUFS) && likely(uring_recv(reactor, client)))
+		return false;
+	if (!res)
+		LOGINFO("Client id %"PRId64" fd %d disconnected", client->id, client->fd);
+	else if (res < 0) {
+		LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with bufofs %lu errno %d %s",
+			client->id, client->fd, client->bufofs, -res, strerror(-res));
 	}
-	dec_instance_ref(cdata, client);
-outnoclient:
-	free(event);
+	invalidate_client(ckp, cdata, client);
+	return true;
 }
 
-/* Waits on fds ready to read on from the list stored in conn_instance and
- * handles the incoming messages */
-static void *receiver(void *arg)
+/* A client's writev has completed so move the sends it wrote to the done
+ * list, listing the client as ready again if it still has more to send */
+static void uring_send_event(ckpool_t *ckp, reactor_t *reactor, client_instance_t *client,
+			     const int res, sender_send_t **done)
 {
-	cdata_t *cdata = (cdata_t *)arg;
-	struct epoll_event *event = ckzalloc(sizeof(struct epoll_event));
-	ckpool_t *ckp = cdata->ckp;
-	uint64_t serverfds, i;
-	int ret, epfd;
-
-	rename_proc("creceiver");
+	cdata_t *cdata = reactor->cdata;
+	sender_send_t *send;
+	int delayed;
 
-	epfd = cdata->epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0) {
-		LOGEMERG("FATAL: Failed to create epoll in receiver");
-		goto out;
-	}
-	serverfds = ckp->serverurls;
-	/* Add all the serverfds to the epoll */
-	for (i = 0; i < serverfds; i++) {
-		/* The small values will be less than the first client ids */
-		event->data.u64 = i;
-		event->events = EPOLLIN | EPOLLRDHUP;
-		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], event);
-		if (ret < 0) {
-			LOGEMERG("FATAL: Failed to add epfd %d to epoll_ctl", epfd);
-			goto out;
+	DL_DELETE2(reactor->blocked, client, send_prev, send_next);
+	client->send_blocked = false;
+	if (likely(res > 0)) {
+		client->blocked_time = 0;
+		client_sends_written(client, res, done);
+		/* Count the sends left over when the socket filled up */
+		if (client->sends && client->sends->ofs) {
+			DL_COUNT(client->sends, send, delayed);
+			reactor->sends_delayed += delayed;
 		}
+	} else if (!client->invalid) {
+		LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
+			client->id, client->fd, -res, strerror(-res));
+		invalidate_client(ckp, cdata, client);
 	}
+	if (client->invalid || !client->sends) {
+		DL_CONCAT(*done, client->sends);
+		client->sends = NULL;
+		client->send_listed = false;
+	} else
+		DL_APPEND2(reactor->ready, client, send_prev, send_next);
+}
 
-	/* Wait for the stratifier to be ready for us */
-	while (!ckp->stratifier_ready)
-		cksleep_ms(10);
+/* The io_uring variant of the reactor. Each listening socket has a multishot
+ * accept and each client a multishot recv into buffers shared by all the
+ * clients of the ring, so one submission serves many reads. Each client
+ * has at most one writev in flight, on the blocked list until it completes,
+ * and the completions of all of them are harvested in batches without any
+ * further system calls. */
+static void *uring_reactor(reactor_t *reactor)
+{
+	client_instance_t *unrefs[REACTOR_EVENTS];
+	cdata_t *cdata = reactor->cdata;
+	uring_t *ring = &reactor->ring;
+	int64_t queued = 0, size = 0;
+	ckpool_t *ckp = cdata->ckp;
+	bool accepting = false;
+	time_t last_check = 0;
+
+	LOGNOTICE("Connector reactor %d using io_uring", reactor->id);
+	uring_read_wake(reactor);
 
 	while (42) {
-		uint64_t edu64;
-
-		while (unlikely(!cdata->accept))
-			cksleep_ms(10);
-		ret = epoll_wait(epfd, event, 1, 1000);
-		if (unlikely(ret < 1)) {
-			if (unlikely(ret == -1)) {
-				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
+		client_instance_t *client, *tmp;
+		struct io_uring_cqe *cqe;
+		sender_send_t *done = NULL;
+		int nunrefs = 0;
+		time_t now_t;
+
+		if (unlikely(accepting != cdata->accept))
+			accepting = uring_listen(reactor, cdata->accept);
+
+		/* Only wait if there are no clients that can be written to */
+		if (unlikely(uring_submit_wait(ring, reactor->ready ? 0 : 1000) < 0)) {
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				LOGEMERG("FATAL: Failed to wait on io_uring in reactor with errno %d:%s",
+					 errno, strerror(errno));
 				break;
 			}
-			/* Nothing to service, still very unlikely */
-			continue;
 		}
-		edu64 = event->data.u64;
-		if (edu64 < serverfds) {
-			ret = accept_client(cdata, epfd, edu64);
-			if (unlikely(ret < 0)) {
-				LOGEMERG("FATAL: Failed to accept_client in receiver");
+
+		while ((cqe = uring_peek_cqe(ring))) {
+			const uint64_t user_data = cqe->user_data;
+
+			client = (client_instance_t *)(uintptr_t)(user_data & ~(uint64_t)UR_OPMASK);
+			switch (user_data & UR_OPMASK) {
+				case UR_WAKE:
+					uring_read_wake(reactor);
+					break;
+				case UR_ACCEPT:
+					uring_accept_event(cdata, reactor, user_data >> UR_OPBITS, cqe, accepting);
+					break;
+				case UR_RECV:
+					if (!uring_recv_event(ckp, reactor, client, cqe))
+						break;
+					unrefs[nunrefs++] = client;
+					if (nunrefs == REACTOR_EVENTS) {
+						reactor_release(reactor, unrefs, nunrefs, NULL, &queued, &size);
+						nunrefs = 0;
+					}
+					break;
+				case UR_SEND:
+					uring_send_event(ckp, reactor, client, cqe->res, &done);
+					break;
+			}
+			uring_cqe_seen(ring);
+		}
+
+		reactor_take_sends(reactor, &queued, &size);
+
+		now_t = time(NULL);
+		DL_FOREACH_SAFE2(reactor->ready, client, tmp, send_next) {
+			if (unlikely(client->invalid)) {
+				DL_DELETE2(reactor->ready, client, send_prev, send_next);
+				DL_CONCAT(done, client->sends);
+				client->sends = NULL;
+				client->send_listed = false;
+				continue;
+			}
+			/* Try again after submitting what's queued */
+			if (unlikely(!uring_send(reactor, client)))
 				break;
+			DL_DELETE2(reactor->ready, client, send_prev, send_next);
+			if (!client->blocked_time)
+				client->blocked_time = now_t;
+			client->send_blocked = true;
+			DL_APPEND2(reactor->blocked, client, send_prev, send_next);
+		}
+
+		/* Invalidate clients whose writes have been in flight for
+		 * more than 60 seconds, which completes them once the socket
+		 * is shut down, cancelling them if they haven't. */
+		if (now_t != last_check) {
+			last_check = now_t;
+			DL_FOREACH2(reactor->blocked, client, send_next) {
+				if (client->invalid)
+					uring_cancel(reactor, UR_CLIENT(client, UR_SEND));
+				else if (now_t - client->blocked_time >= 60) {
+					LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
+						  client->id, client->fd);
+					invalidate_client(ckp, cdata, client);
+				}
 			}
-			continue;
 		}
-		/* Event structure is handed off to client_event_processor
-		 * here to be freed so we need to allocate a new one */
-		ckmsgq_add(cdata->cevents, event);
-		event = ckzalloc(sizeof(struct epoll_event));
+
+		reactor_release(reactor, unrefs, nunrefs, done, &queued, &size);
 	}
-out:
 	/* We shouldn't get here unless there's an error */
 	return NULL;
 }
+#endif /* USE_IO_URING */
 
-/* Send a sender_send message and return true if we've finished sending it or
- * are unable to send any more. */
-static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send)
+/* Add or remove the listening sockets shared by every reactor to this one's
+ * epoll, with EPOLLEXCLUSIVE so only one reactor is woken per connection.
+ * Returns whether we're now accepting. */
+static bool listen_reactor(reactor_t *reactor, const bool accept)
 {
-	client_instance_t *client = sender_send->client;
-	time_t now_t;
-
-	if (unlikely(client->invalid))
-		goto out_true;
-
-	/* Make sure we only send one message at a time to each client */
-	if (unlikely(client->sending && client->sending != sender_send))
-		return false;
-
-	client->sending = sender_send;
-	now_t = time(NULL);
-
-	/* Increase sendbufsize to match large messages sent to clients - this
-	 * usually only applies to clients as mining nodes. */
-	if (unlikely(!ckp->wmem_warn && sender_send->len > client->sendbufsize))
-		client->sendbufsize = set_sendbufsize(ckp, client->fd, sender_send->len);
-
-	while (sender_send->len) {
-		int ret = write(client->fd, sender_send->buf + sender_send->ofs, sender_send->len);
+	cdata_t *cdata = reactor->cdata;
+	struct epoll_event event;
+	uint64_t i;
 
-		if (ret < 1) {
-			/* Invalidate clients that block for more than 60 seconds */
-			if (unlikely(client->blocked_time && now_t - client->blocked_time >= 60)) {
-				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
-					  client->id, client->fd);
-				invalidate_client(ckp, cdata, client);
-				goto out_true;
-			}
-			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret) {
-				if (!client->blocked_time)
-					client->blocked_time = now_t;
-				return false;
-			}
-			LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
-				client->id, client->fd, errno, strerror(errno));
-			invalidate_client(ckp, cdata, client);
-			goto out_true;
-		}
-		sender_send->ofs += ret;
-		sender_send->len -= ret;
-		client->blocked_time = 0;
+	for (i = 0; i < (uint64_t)cdata->ckp->serverurls; i++) {
+		/* The small values will be less than the first client ids */
+		event.data.u64 = i;
+		event.events = EPOLLIN | EPOLLEXCLUSIVE;
+		if (accept)
+			epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, cdata->serverfd[i], &event);
+		else
+			epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, cdata->serverfd[i], NULL);
 	}
-out_true:
-	client->sending = NULL;
-	return true;
+	return accept;
 }
 
-static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
+/* Create a reactor's epoll with the eventfd used to wake it in it */
+static bool setup_reactor(cdata_t *cdata, reactor_t *reactor, const int id)
 {
-	dec_instance_ref(cdata, sender_send->client);
-	free(sender_send->buf);
-	free(sender_send);
+	struct epoll_event event;
+
+	reactor->cdata = cdata;
+	reactor->id = id;
+	mutex_init(&reactor->lock);
+	reactor->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(reactor->efd < 0)) {
+		LOGEMERG("FATAL: Failed to create reactor eventfd");
+		return false;
+	}
+#ifdef USE_IO_URING
+	if (cdata->ckp->io_uring) {
+		if (likely(setup_uring(reactor)))
+			return true;
+		LOGWARNING("Failed to set up io_uring for reactor %d, falling back to epoll", id);
+	}
+#endif
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (unlikely(reactor->epfd < 0)) {
+		LOGEMERG("FATAL: Failed to create reactor epoll");
+		return false;
+	}
+	event.data.u64 = REACTOR_WAKE;
+	event.events = EPOLLIN;
+	if (unlikely(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->efd, &event) < 0)) {
+		LOGEMERG("FATAL: Failed to add reactor eventfd to epoll");
+		return false;
+	}
+	return true;
 }
 
-/* Use a thread to send queued messages, appending them to the sends list and
- * iterating over all of them, attempting to send them all non-blocking to
- * only send to those clients ready to receive data. */
-static void *sender(void *arg)
+/* Each reactor waits on its own epoll set, harvesting events in batches to
+ * accept new clients from the shared listening sockets and read from the
+ * clients it accepted. It also writes out their sends, moving them onto per
+ * client queues that are written with writev to those clients ready to
+ * receive data. Clients whose sockets are full are watched for EPOLLOUT
+ * instead of being retried, and are only checked once a second for having
+ * gone away or blocked for too long. */
+static void *reactor(void *arg)
 {
-	cdata_t *cdata = (cdata_t *)arg;
-	sender_send_t *sends = NULL;
+	reactor_t *reactor = (reactor_t *)arg;
+	client_instance_t *clients[REACTOR_EVENTS];
+	struct epoll_event events[REACTOR_EVENTS];
+	cdata_t *cdata = reactor->cdata;
+	int64_t queued = 0, size = 0;
 	ckpool_t *ckp = cdata->ckp;
+	uint64_t serverfds, wake;
+	bool accepting = false;
+	time_t last_check = 0;
+	char name[16];
+
+	snprintf(name, 15, "creactor%d", reactor->id);
+	rename_proc(name);
+
+	serverfds = ckp->serverurls;
+
+	/* Wait for the stratifier to be ready for us */
+	while (!ckp->stratifier_ready)
+		cksleep_ms(10);
 
-	rename_proc("csender");
+#ifdef USE_IO_URING
+	if (reactor->uring)
+		return uring_reactor(reactor);
+#endif
 
 	while (42) {
-		int64_t sends_queued = 0, sends_size = 0;
-		sender_send_t *sending, *tmp;
-
-		/* Check all sends to see if they can be written out */
-		DL_FOREACH_SAFE(sends, sending, tmp) {
-			if (send_sender_send(ckp, cdata, sending)) {
-				DL_DELETE(sends, sending);
-				clear_sender_send(sending, cdata);
-			} else {
-				sends_queued++;
-				sends_size += sizeof(sender_send_t) + sending->len + 1;
+		client_instance_t *client, *tmp;
+		sender_send_t *done = NULL, *send;
+		int i, nevents;
+		time_t now_t;
+
+		if (unlikely(accepting != cdata->accept))
+			accepting = listen_reactor(reactor, cdata->accept);
+
+		/* Only wait if there are no clients that can be written to */
+		nevents = epoll_wait(reactor->epfd, events, REACTOR_EVENTS, reactor->ready ? 0 : 1000);
+		if (unlikely(nevents < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGEMERG("FATAL: Failed to epoll_wait in reactor");
+			break;
+		}
+
+		/* Take references to all the clients with events at once */
+		ck_wlock(&cdata->lock);
+		for (i = 0; i < nevents; i++) {
+			int64_t id = events[i].data.u64;
+
+			clients[i] = NULL;
+			if (events[i].data.u64 < serverfds || events[i].data.u64 == REACTOR_WAKE)
+				continue;
+			HASH_FIND_I64(cdata->clients, &id, client);
+			if (likely(client && !client->invalid)) {
+				__inc_instance_ref(client);
+				clients[i] = client;
 			}
 		}
+		ck_wunlock(&cdata->lock);
+
+		for (i = 0; i < nevents; i++) {
+			uint64_t edu64 = events[i].data.u64;
+
+			if (edu64 == REACTOR_WAKE) {
+				if (read(reactor->efd, &wake, sizeof(wake)) < 0 && errno != EAGAIN)
+					LOGWARNING("Failed to read reactor eventfd with errno %d:%s",
+						   errno, strerror(errno));
+			} else if (edu64 < serverfds) {
+				if (unlikely(accept_client(cdata, reactor, edu64) < 0)) {
+					LOGEMERG("FATAL: Failed to accept_client in reactor");
+					goto out;
+				}
+			} else if (likely(clients[i]))
+				client_event(ckp, reactor, clients[i], events[i].events);
+			else
+				LOGNOTICE("Failed to find client by id %"PRId64" in reactor!", edu64);
+		}
 
-		mutex_lock(&cdata->sender_lock);
-		cdata->sends_delayed += sends_queued;
-		cdata->sends_queued = sends_queued;
-		cdata->sends_size = sends_size;
-		/* Poll every 10ms if there are no new sends. */
-		if (!cdata->sender_sends) {
-			const ts_t polltime = {0, 10000000};
-			ts_t timeout_ts;
-
-			ts_realtime(&timeout_ts);
-			timeraddspec(&timeout_ts, &polltime);
-			cond_timedwait(&cdata->sender_cond, &cdata->sender_lock, &timeout_ts);
+		reactor_take_sends(reactor, &queued, &size);
+
+		now_t = time(NULL);
+		DL_FOREACH_SAFE2(reactor->ready, client, tmp, send_next) {
+			switch (flush_client_sends(ckp, cdata, client, &done)) {
+				case SEND_MORE:
+					break;
+				case SEND_BLOCKED:
+					DL_DELETE2(reactor->ready, client, send_prev, send_next);
+					if (!client->blocked_time)
+						client->blocked_time = now_t;
+					if (unlikely(!watch_client(reactor, client, true))) {
+						LOGINFO("Client id %"PRId64" fd %d failed to epoll for sending",
+							client->id, client->fd);
+						invalidate_client(ckp, cdata, client);
+					}
+					DL_COUNT(client->sends, send, i);
+					reactor->sends_delayed += i;
+					client->send_blocked = true;
+					DL_APPEND2(reactor->blocked, client, send_prev, send_next);
+					break;
+				case SEND_EMPTY:
+				case SEND_DEAD:
+					DL_DELETE2(reactor->ready, client, send_prev, send_next);
+					client->send_listed = false;
+					break;
+			}
 		}
-		if (cdata->sender_sends) {
-			DL_CONCAT(sends, cdata->sender_sends);
-			cdata->sender_sends = NULL;
+
+		/* Invalidate clients that block for more than 60 seconds and
+		 * discard the sends of those that have gone away */
+		if (now_t != last_check) {
+			last_check = now_t;
+			DL_FOREACH_SAFE2(reactor->blocked, client, tmp, send_next) {
+				if (!client->invalid) {
+					if (now_t - client->blocked_time < 60)
+						continue;
+					LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
+						  client->id, client->fd);
+					invalidate_client(ckp, cdata, client);
+				}
+				DL_DELETE2(reactor->blocked, client, send_prev, send_next);
+				client->send_listed = client->send_blocked = false;
+				DL_CONCAT(done, client->sends);
+				client->sends = NULL;
+			}
 		}
-		mutex_unlock(&cdata->sender_lock);
+
+		/* Drop the references to the clients with events last since
+		 * they may be the last references to their clients */
+		reactor_release(reactor, clients, nevents, done, &queued, &size);
 	}
+out:
 	/* We shouldn't get here unless there's an error */
 	return NULL;
 }
@@ -897,17 +1736,12 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
 	json_decref(val);
 
-	sender_send = ckzalloc(sizeof(sender_send_t));
+	sender_send = slab_zalloc(&sender_send_slab);
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = strlen(buf);
 	inc_instance_ref(cdata, client);
-
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_sender_send(sender_send);
 }
 
 /* Look for accepted shares in redirector mode to know we can redirect this
@@ -963,7 +1797,7 @@ static bool test_redirector_shares(cdata_t *cdata, client_instance_t *client, co
 		ck_wlock(&cdata->lock);
 		DL_FOREACH_SAFE(client->shares, share, found) {
 			DL_DELETE(client->shares, share);
-			dealloc(share);
+			slab_free(&share_slab, share);
 		}
 		ck_wunlock(&cdata->lock);
 	}
@@ -1039,16 +1873,11 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 		}
 	}
 
-	sender_send = ckzalloc(sizeof(sender_send_t));
+	sender_send = slab_zalloc(&sender_send_slab);
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = len;
-
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_sender_send(sender_send);
 
 	/* Redirect after sending response to shares and authorise */
 	if (unlikely(redirect))
@@ -1194,7 +2023,8 @@ static void ping_upstream(cdata_t *cdata)
 	char *buf;
 
 	ASPRINTF(&buf, "{\"method\":\"ping\"}\n");
-	ckmsgq_add(cdata->upstream_sends, buf);
+	if (unlikely(!ckmsgq_add(cdata->upstream_sends, buf)))
+		free(buf);
 }
 
 static void *urecv_process(void *arg)
@@ -1326,7 +2156,86 @@ void connector_add_message(ckpool_t *ckp, json_t *val)
 {
 	cdata_t *cdata = ckp->cdata;
 
-	ckmsgq_add(cdata->cmpq, val);
+	if (unlikely(!ckmsgq_add(cdata->cmpq, val)))
+		json_decref(val);
+}
+
+/* Serialise a message on the calling thread and queue it straight to a
+ * directly connected client. Passthrough subclients still go through the
+ * cmpq to be re-addressed to their passthrough, as do all messages in
+ * redirector mode to be inspected. */
+void connector_send_client(ckpool_t *ckp, const int64_t client_id, json_t *val)
+{
+	cdata_t *cdata = ckp->cdata;
+	char *msg;
+
+	if (unlikely(subclient(client_id) || ckp->redirector)) {
+		json_object_set_new_nocheck(val, "client_id", json_integer(client_id));
+		if (unlikely(!ckmsgq_add(cdata->cmpq, val)))
+			json_decref(val);
+		return;
+	}
+	msg = json_dumps(val, JSON_EOL | JSON_COMPACT);
+	json_decref(val);
+	send_client(ckp, cdata, client_id, msg);
+}
+
+/* Send the same serialised message to a list of directly connected clients,
+ * with every client's send referring to the one buffer instead of a copy of
+ * it. Takes over buf and client_ids. */
+void connector_broadcast(ckpool_t *ckp, char *buf, int64_t *client_ids, const int clients)
+{
+	cdata_t *cdata = ckp->cdata;
+	int i, len, dropped = 0;
+	sender_send_t **sends;
+	sendbuf_t *sendbuf;
+	int *counts;
+
+	/* Lists of sends for each client's reactor */
+	sends = ckzalloc(sizeof(sender_send_t *) * cdata->nreactors);
+	counts = ckzalloc(sizeof(int) * cdata->nreactors);
+	len = strlen(buf);
+	sendbuf = ckalloc(sizeof(sendbuf_t));
+	sendbuf->buf = buf;
+	/* Hold a reference of our own till all the sends are queued */
+	sendbuf->ref = 1;
+
+	ck_wlock(&cdata->lock);
+	for (i = 0; i < clients; i++) {
+		sender_send_t *sender_send;
+		client_instance_t *client;
+
+		HASH_FIND_I64(cdata->clients, &client_ids[i], client);
+		if (unlikely(!client || client->invalid)) {
+			/* Flag it to be dropped once we've released the lock */
+			client_ids[dropped++] = client_ids[i];
+			continue;
+		}
+		__inc_instance_ref(client);
+		__sync_add_and_fetch(&sendbuf->ref, 1);
+		sender_send = slab_zalloc(&sender_send_slab);
+		sender_send->client = client;
+		sender_send->buf = buf;
+		sender_send->sendbuf = sendbuf;
+		sender_send->len = len;
+		DL_APPEND(sends[client->reactor->id], sender_send);
+		counts[client->reactor->id]++;
+	}
+	ck_wunlock(&cdata->lock);
+
+	for (i = 0; i < dropped; i++) {
+		LOGINFO("Connector failed to find client id %"PRId64" to broadcast to", client_ids[i]);
+		stratifier_drop_id(ckp, client_ids[i]);
+	}
+
+	for (i = 0; i < cdata->nreactors; i++) {
+		if (sends[i])
+			queue_sender_sends(&cdata->reactors[i], sends[i], counts[i]);
+	}
+	put_sendbuf(sendbuf);
+	free(client_ids);
+	free(counts);
+	free(sends);
 }
 
 /* Send the passthrough the terminate node.method */
@@ -1346,8 +2255,9 @@ static void drop_passthrough_client(ckpool_t *ckp, cdata_t *cdata, const int64_t
 char *connector_stats(void *data, const int runtime)
 {
 	json_t *val = json_object(), *subval;
+	int64_t queued, queued_size, delayed, sends_generated;
 	client_instance_t *client;
-	int objects, generated;
+	int objects, generated, i;
 	cdata_t *cdata = data;
 	sender_send_t *send;
 	int64_t memsize;
@@ -1377,20 +2287,31 @@ char *connector_stats(void *data, const int runtime)
 
 	objects = 0;
 	memsize = 0;
+	sends_generated = queued = queued_size = delayed = 0;
+
+	for (i = 0; i < cdata->nreactors; i++) {
+		reactor_t *reactor = &cdata->reactors[i];
 
-	mutex_lock(&cdata->sender_lock);
-	DL_FOREACH(cdata->sender_sends, send) {
-		objects++;
-		memsize += sizeof(sender_send_t) + send->len + 1;
+		mutex_lock(&reactor->lock);
+		DL_FOREACH(reactor->sends, send) {
+			objects++;
+			memsize += sizeof(sender_send_t) + send->len + 1;
+		}
+		sends_generated += reactor->sends_generated;
+		queued += reactor->sends_queued;
+		queued_size += reactor->sends_size;
+		delayed += reactor->sends_delayed;
+		mutex_unlock(&reactor->lock);
 	}
-	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", cdata->sends_generated);
+	JSON_CPACK(subval, "{si,sI,sI}", "count", objects, "memory", memsize, "generated", sends_generated);
 	json_set_object(val, "sends", subval);
 
-	JSON_CPACK(subval, "{si,si,si}", "count", cdata->sends_queued, "memory", cdata->sends_size, "generated", cdata->sends_delayed);
-	mutex_unlock(&cdata->sender_lock);
-
+	JSON_CPACK(subval, "{sI,sI,sI}", "count", queued, "memory", queued_size, "generated", delayed);
 	json_set_object(val, "delays", subval);
 
+	bus_stats(&cdata->ckp->connector, &subval);
+	json_set_object(val, "bus", subval);
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	if (runtime)
@@ -1400,6 +2321,88 @@ char *connector_stats(void *data, const int runtime)
 	return buf;
 }
 
+static void drop_client_id(ckpool_t *ckp, cdata_t *cdata, const int64_t client_id)
+{
+	client_instance_t *client;
+	int ret;
+
+	/* A passthrough client */
+	if (subclient(client_id)) {
+		drop_passthrough_client(ckp, cdata, client_id);
+		return;
+	}
+	client = ref_client_by_id(cdata, client_id);
+	if (unlikely(!client)) {
+		LOGINFO("Connector failed to find client id %"PRId64" to drop", client_id);
+		return;
+	}
+	ret = invalidate_client(ckp, cdata, client);
+	dec_instance_ref(cdata, client);
+	if (ret >= 0)
+		LOGINFO("Connector dropped client id: %"PRId64, client_id);
+}
+
+static void test_client_id(ckpool_t *ckp, cdata_t *cdata, const int64_t client_id)
+{
+	if (client_exists(cdata, client_id))
+		return;
+	LOGINFO("Connector detected non-existent client id: %"PRId64, client_id);
+	stratifier_drop_id(ckp, client_id);
+}
+
+static void passthrough_client_id(ckpool_t *ckp, cdata_t *cdata, const int64_t client_id)
+{
+	client_instance_t *client;
+
+	client = ref_client_by_id(cdata, client_id);
+	if (unlikely(!client)) {
+		LOGINFO("Connector failed to find client id %"PRId64" to pass through", client_id);
+		return;
+	}
+	passthrough_client(ckp, cdata, client);
+	dec_instance_ref(cdata, client);
+}
+
+static void accept_clients(ckpool_t *ckp, cdata_t *cdata, const bool accept)
+{
+	LOGDEBUG("Connector received %s signal", accept ? "accept" : "reject");
+	cdata->accept = accept;
+	if (!accept && ckp->passthrough)
+		drop_all_clients(cdata);
+}
+
+/* Handle typed messages from the other processes, once we're ready to */
+void connector_bus(ckpool_t *ckp, bus_msg_t *msg)
+{
+	cdata_t *cdata;
+
+	while (unlikely(!ckp->connector_ready))
+		cksleep_ms(10);
+	cdata = ckp->cdata;
+
+	switch (msg->op) {
+		case BUS_DROPCLIENT:
+			drop_client_id(ckp, cdata, msg->id);
+			break;
+		case BUS_TESTCLIENT:
+			test_client_id(ckp, cdata, msg->id);
+			break;
+		case BUS_PASSTHROUGH:
+			passthrough_client_id(ckp, cdata, msg->id);
+			break;
+		case BUS_ACCEPT:
+			accept_clients(ckp, cdata, true);
+			break;
+		case BUS_REJECT:
+			accept_clients(ckp, cdata, false);
+			break;
+		default:
+			LOGWARNING("Unhandled connector bus op %d", msg->op);
+			break;
+	}
+	slab_free(&bus_msg_slab, msg);
+}
+
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd)
 {
 	cdata_t *cdata = ckp->cdata;
@@ -1433,11 +2436,7 @@ retry:
 		}
 	}
 
-	if (umsg) {
-		Close(umsg->sockd);
-		free(umsg->buf);
-		dealloc(umsg);
-	}
+	clear_unix_msg(&umsg);
 
 	do {
 		umsg = get_unix_msg(pi);
@@ -1450,50 +2449,30 @@ retry:
 	if (likely(buf[0] == '{')) {
 		json_t *val = json_loads(buf, JSON_DISABLE_EOF_CHECK, NULL);
 
-		ckmsgq_add(cdata->cmpq, val);
+		if (unlikely(!ckmsgq_add(cdata->cmpq, val)))
+			json_decref(val);
 	} else if (cmdmatch(buf, "dropclient")) {
-		client_instance_t *client;
-
+		/* From upstream when we're a passthrough, or the command line */
 		ret = sscanf(buf, "dropclient=%"PRId64, &client_id);
 		if (ret < 0) {
 			LOGDEBUG("Connector failed to parse dropclient command: %s", buf);
 			goto retry;
 		}
-		/* A passthrough client */
-		if (subclient(client_id)) {
-			drop_passthrough_client(ckp, cdata, client_id);
-			goto retry;
-		}
-		client = ref_client_by_id(cdata, client_id);
-		if (unlikely(!client)) {
-			LOGINFO("Connector failed to find client id %"PRId64" to drop", client_id);
-			goto retry;
-		}
-		ret = invalidate_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
-		if (ret >= 0)
-			LOGINFO("Connector dropped client id: %"PRId64, client_id);
+		drop_client_id(ckp, cdata, client_id);
 	} else if (cmdmatch(buf, "testclient")) {
 		ret = sscanf(buf, "testclient=%"PRId64, &client_id);
 		if (unlikely(ret < 0)) {
 			LOGDEBUG("Connector failed to parse testclient command: %s", buf);
 			goto retry;
 		}
-		if (client_exists(cdata, client_id))
-			goto retry;
-		LOGINFO("Connector detected non-existent client id: %"PRId64, client_id);
-		stratifier_drop_id(ckp, client_id);
+		test_client_id(ckp, cdata, client_id);
 	} else if (cmdmatch(buf, "ping")) {
 		LOGDEBUG("Connector received ping request");
 		send_unix_msg(umsg->sockd, "pong");
 	} else if (cmdmatch(buf, "accept")) {
-		LOGDEBUG("Connector received accept signal");
-		cdata->accept = true;
+		accept_clients(ckp, cdata, true);
 	} else if (cmdmatch(buf, "reject")) {
-		LOGDEBUG("Connector received reject signal");
-		cdata->accept = false;
-		if (ckp->passthrough)
-			drop_all_clients(cdata);
+		accept_clients(ckp, cdata, false);
 	} else if (cmdmatch(buf, "stats")) {
 		char *msg;
 
@@ -1503,20 +2482,12 @@ retry:
 	} else if (cmdmatch(buf, "loglevel")) {
 		sscanf(buf, "loglevel=%d", &ckp->loglevel);
 	} else if (cmdmatch(buf, "passthrough")) {
-		client_instance_t *client;
-
 		ret = sscanf(buf, "passthrough=%"PRId64, &client_id);
 		if (ret < 0) {
 			LOGDEBUG("Connector failed to parse passthrough command: %s", buf);
 			goto retry;
 		}
-		client = ref_client_by_id(cdata, client_id);
-		if (unlikely(!client)) {
-			LOGINFO("Connector failed to find client id %"PRId64" to pass through", client_id);
-			goto retry;
-		}
-		passthrough_client(ckp, cdata, client);
-		dec_instance_ref(cdata, client);
+		passthrough_client_id(ckp, cdata, client_id);
 	} else if (cmdmatch(buf, "getxfd")) {
 		int fdno = -1;
 
@@ -1579,6 +2550,9 @@ void *connector(void *arg)
 			Close(sockd);
 			goto out;
 		}
+		/* Every reactor accepts from the listening sockets so they
+		 * must not block when another reactor beat us to a client */
+		noblock_socket(sockd);
 		cdata->serverfd[0] = sockd;
 		url_from_socket(sockd, newurl, newport);
 		ASPRINTF(&ckp->serverurl[0], "%s:%s", newurl, newport);
@@ -1629,6 +2603,7 @@ void *connector(void *arg)
 				Close(sockd);
 				goto out;
 			}
+			noblock_socket(sockd);
 			cdata->serverfd[i] = sockd;
 		}
 	}
@@ -1647,12 +2622,15 @@ void *connector(void *arg)
 	/* Set the client id to the highest serverurl count to distinguish
 	 * them from the server fds in epoll. */
 	cdata->client_ids = ckp->serverurls;
-	mutex_init(&cdata->sender_lock);
-	cond_init(&cdata->sender_cond);
-	create_pthread(&cdata->pth_sender, sender, cdata);
 	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
-	cdata->cevents = create_ckmsgqs(ckp, "cevent", &client_event_processor, threads);
-	create_pthread(&cdata->pth_receiver, receiver, cdata);
+	cdata->reactors = ckzalloc(sizeof(reactor_t) * threads);
+	cdata->nreactors = threads;
+	for (i = 0; i < threads; i++) {
+		if (!setup_reactor(cdata, &cdata->reactors[i], i))
+			goto out;
+	}
+	for (i = 0; i < threads; i++)
+		create_pthread(&cdata->reactors[i].pth, reactor, &cdata->reactors[i]);
 	cdata->start_time = time(NULL);
 
 	ckp->connector_ready = true;
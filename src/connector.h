@@ -13,8 +13,11 @@
 int64_t connector_newclientid(ckpool_t *ckp);
 void connector_upstream_msg(ckpool_t *ckp, char *msg);
 void connector_add_message(ckpool_t *ckp, json_t *val);
+void connector_send_client(ckpool_t *ckp, const int64_t client_id, json_t *val);
+void connector_broadcast(ckpool_t *ckp, char *buf, int64_t *client_ids, const int clients);
 char *connector_stats(void *data, const int runtime);
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd);
+void connector_bus(ckpool_t *ckp, bus_msg_t *msg);
 void *connector(void *arg);
 
 #endif /* CONNECTOR_H */
@@ -316,7 +316,7 @@ living:
 	gdata->current_si = alive;
 	cs = &alive->cs;
 	LOGINFO("Connected to live server %s:%s", cs->url, cs->port);
-	send_proc(ckp->connector, alive ? "accept" : "reject");
+	bus_send(ckp->connector, alive ? BUS_ACCEPT : BUS_REJECT, 0);
 	return alive;
 }
 
@@ -336,16 +336,6 @@ static void kill_server(server_instance_t *si)
 	dealloc(cs->auth);
 }
 
-static void clear_unix_msg(unix_msg_t **umsg)
-{
-	if (*umsg) {
-		Close((*umsg)->sockd);
-		free((*umsg)->buf);
-		free(*umsg);
-		*umsg = NULL;
-	}
-}
-
 bool generator_submitblock(ckpool_t *ckp, const char *buf)
 {
 	gdata_t *gdata = ckp->gdata;
@@ -560,6 +550,9 @@ static json_t *find_notify(json_t *val)
 	return ret;
 }
 
+/* Lines received from upstream proxies while waiting for a reply */
+static slab_t proxy_line_slab = SLAB_INIT("proxy_line", char_entry_t);
+
 /* Get stored line in the proxy linked list of messages if any exist or NULL */
 static char *cached_proxy_line(proxy_instance_t *proxi)
 {
@@ -570,7 +563,7 @@ static char *cached_proxy_line(proxy_instance_t *proxi)
 
 		DL_DELETE(proxi->recvd_lines, char_t);
 		buf = char_t->buf;
-		free(char_t);
+		slab_free(&proxy_line_slab, char_t);
 	}
 	return buf;
 }
@@ -590,7 +583,7 @@ static char *next_proxy_line(connsock_t *cs, proxy_instance_t *proxi)
 /* For appending a line to the proxy recv list */
 static void append_proxy_line(proxy_instance_t *proxi, const char *buf)
 {
-	char_entry_t *char_t = ckalloc(sizeof(char_entry_t));
+	char_entry_t *char_t = slab_alloc(&proxy_line_slab);
 	char_t->buf = strdup(buf);
 	DL_APPEND(proxi->recvd_lines, char_t);
 }
@@ -1603,10 +1596,7 @@ static void drop_proxy(gdata_t *gdata, const char *buf)
 
 static void stratifier_reconnect_client(ckpool_t *ckp, const int64_t id)
 {
-	char buf[256];
-
-	sprintf(buf, "reconnclient=%"PRId64, id);
-	send_proc(ckp->stratifier, buf);
+	bus_send(ckp->stratifier, BUS_RECONNCLIENT, id);
 }
 
 /* Add a share to the gdata share hashlist. Returns the share id */
@@ -2000,7 +1990,10 @@ static void passthrough_add_send(proxy_instance_t *proxy, char *msg)
 	pm->proxy = proxy;
 	pm->cs = &proxy->cs;
 	pm->msg = msg;
-	ckmsgq_add(proxy->passsends, pm);
+	if (unlikely(!ckmsgq_add(proxy->passsends, pm))) {
+		free(pm->msg);
+		free(pm);
+	}
 }
 
 void generator_add_send(ckpool_t *ckp, json_t *val)
@@ -2631,10 +2624,10 @@ static proxy_instance_t *wait_best_proxy(ckpool_t *ckp, gdata_t *gdata)
 		/* Send reject message if we are unable to find an active
 		 * proxy for more than 5 seconds */
 		if (!((retries++) % 5))
-			send_proc(ckp->connector, "reject");
+			bus_send(ckp->connector, BUS_REJECT, 0);
 		sleep(1);
 	}
-	send_proc(ckp->connector, ret ? "accept" : "reject");
+	bus_send(ckp->connector, ret ? BUS_ACCEPT : BUS_REJECT, 0);
 	return ret;
 }
 
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Micro-benchmark for the hex encoding implementations in libckpool. Each
+ * implementation built in and supported by the CPU is checked against the
+ * generic one and then timed at sizes typical of the stratum messages.
+ * Usage: hexbench [iterations] */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libckpool.h"
+
+static const char *impls[] = { "generic", "sse2", "avx2", NULL };
+static const int sizes[] = { 4, 32, 80, 512, 4096, 0 };
+
+#define MAXSIZE 4096
+
+/* The checks deliberately generate hex2bin warnings so only show errors */
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (loglevel > LOG_ERR)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static uchar bin[MAXSIZE], bin2[MAXSIZE];
+static char hex[MAXSIZE * 2 + 1], ref[MAXSIZE * 2 + 1];
+
+/* Compare the selected implementation against generic at every length,
+ * including mixed case, invalid characters at every offset and short strings
+ * to make sure warnings are hit at the same places. */
+static bool check_impl(const char *impl)
+{
+	int len, ofs;
+
+	for (len = 1; len <= 160; len++) {
+		hex_select("generic");
+		__bin2hex(ref, bin, len);
+		hex_select(impl);
+		__bin2hex(hex, bin, len);
+		if (strcmp(hex, ref)) {
+			LOGERR("%s bin2hex mismatch at length %d", impl, len);
+			return false;
+		}
+		if (!hex2bin(bin2, hex, len) || memcmp(bin, bin2, len)) {
+			LOGERR("%s hex2bin mismatch at length %d", impl, len);
+			return false;
+		}
+		for (ofs = 0; ofs < len * 2; ofs++) {
+			bool valid, refvalid, dec, refdec;
+			char c = hex[ofs];
+
+			hex[ofs] = ofs & 1 ? 'g' : toupper(c);
+			valid = validhex(hex);
+			dec = hex2bin(bin2, hex, len);
+			hex_select("generic");
+			refvalid = validhex(hex);
+			refdec = hex2bin(bin2, hex, len);
+			hex_select(impl);
+			hex[ofs] = c;
+			if (valid != refvalid || dec != refdec) {
+				LOGERR("%s validity mismatch at length %d offset %d", impl, len, ofs);
+				return false;
+			}
+		}
+		hex[len] = '\0';
+		if (hex2bin(bin2, hex, len)) {
+			LOGERR("%s hex2bin accepted short string at length %d", impl, len);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void bench_impl(const char *impl, int iterations)
+{
+	int i, j, size;
+
+	for (i = 0; sizes[i]; i++) {
+		double encode, decode, valid;
+		tv_t start, end;
+
+		size = sizes[i];
+		tv_time(&start);
+		for (j = 0; j < iterations; j++)
+			__bin2hex(hex, bin, size);
+		tv_time(&end);
+		encode = us_tvdiff(&end, &start) * 1000 / iterations;
+
+		tv_time(&start);
+		for (j = 0; j < iterations; j++)
+			hex2bin(bin2, hex, size);
+		tv_time(&end);
+		decode = us_tvdiff(&end, &start) * 1000 / iterations;
+
+		tv_time(&start);
+		for (j = 0; j < iterations; j++)
+			validhex(hex);
+		tv_time(&end);
+		valid = us_tvdiff(&end, &start) * 1000 / iterations;
+
+		printf("%-8s %5d bytes: bin2hex %9.1f ns  hex2bin %9.1f ns  validhex %9.1f ns\n",
+		       impl, size, encode, decode, valid);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int i, iterations = 100000;
+	bool ret = true;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (iterations < 1)
+		iterations = 1;
+
+	srand(42);
+	for (i = 0; i < MAXSIZE; i++)
+		bin[i] = rand();
+
+	for (i = 0; impls[i]; i++) {
+		if (!hex_select(impls[i])) {
+			printf("%-8s not supported\n", impls[i]);
+			continue;
+		}
+		if (!check_impl(impls[i])) {
+			ret = false;
+			continue;
+		}
+		bench_impl(impls[i], iterations);
+	}
+	return ret ? 0 : 1;
+}
@@ -1493,7 +1493,482 @@ size_t round_up_page(size_t len)
 	return len;
 }
 
+/* Most slabs there can be */
+#define SLAB_MAX 32
+/* Objects moved between a thread's cache and its slab at a time, which is
+ * also how many are carved from each new chunk */
+#define SLAB_BATCH 64
+
+struct slab_cache {
+	void *head;
+	int count;
+};
+
+static slab_t *slabs[SLAB_MAX];
+static int nslabs;
+static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slab_key;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static __thread struct slab_cache *slab_caches;
+
+/* Link count objects of cache onto the slab's shared free list */
+static void __slab_put(slab_t *slab, struct slab_cache *cache, int count)
+{
+	void *head = cache->head, *tail = head;
+
+	cache->count -= count;
+	while (--count)
+		tail = *(void **)tail;
+	cache->head = *(void **)tail;
+	*(void **)tail = slab->free;
+	slab->free = head;
+}
+
+/* Return every object cached by an exiting thread to its slab */
+static void slab_exit(void *arg)
+{
+	struct slab_cache *caches = arg;
+	int i;
+
+	for (i = 0; i < SLAB_MAX; i++) {
+		struct slab_cache *cache = &caches[i];
+		slab_t *slab = slabs[i];
+
+		if (!cache->count)
+			continue;
+		mutex_lock(&slab->lock);
+		__slab_put(slab, cache, cache->count);
+		mutex_unlock(&slab->lock);
+	}
+	free(caches);
+	slab_caches = NULL;
+}
+
+static void slab_init(void)
+{
+	pthread_key_create(&slab_key, slab_exit);
+}
+
+/* Get this thread's cache for slab, registering the slab and creating the
+ * thread's caches the first time they're used */
+static struct slab_cache *slab_cache(slab_t *slab)
+{
+	int index = __atomic_load_n(&slab->index, __ATOMIC_ACQUIRE);
+
+	if (unlikely(!index)) {
+		pthread_once(&slab_once, slab_init);
+		pthread_mutex_lock(&slabs_lock);
+		if (!slab->index) {
+			if (unlikely(nslabs == SLAB_MAX))
+				quit(1, "Too many slabs creating %s", slab->name);
+			/* Objects need to be big enough to link them when
+			 * free and aligned like malloc would */
+			slab->size = MAX(slab->size, sizeof(void *));
+			align_len(&slab->size);
+			slabs[nslabs++] = slab;
+			__atomic_store_n(&slab->index, nslabs, __ATOMIC_RELEASE);
+		}
+		index = slab->index;
+		pthread_mutex_unlock(&slabs_lock);
+	}
+	if (unlikely(!slab_caches)) {
+		slab_caches = ckzalloc(sizeof(struct slab_cache) * SLAB_MAX);
+		pthread_once(&slab_once, slab_init);
+		pthread_setspecific(slab_key, slab_caches);
+	}
+	return &slab_caches[index - 1];
+}
+
+/* Refill an empty cache with a batch from the slab's free list, carving a
+ * new chunk if it has none */
+static void slab_refill(slab_t *slab, struct slab_cache *cache)
+{
+	void *head, *tail;
+	char *chunk;
+	int i;
+
+	mutex_lock(&slab->lock);
+	if (slab->free) {
+		head = tail = slab->free;
+		for (i = 1; i < SLAB_BATCH && *(void **)tail; i++)
+			tail = *(void **)tail;
+		slab->free = *(void **)tail;
+		*(void **)tail = NULL;
+		mutex_unlock(&slab->lock);
+		cache->head = head;
+		cache->count = i;
+		return;
+	}
+	slab->chunks++;
+	mutex_unlock(&slab->lock);
+
+	chunk = ckalloc(slab->size * SLAB_BATCH);
+	for (i = 0; i < SLAB_BATCH - 1; i++)
+		*(void **)(chunk + slab->size * i) = chunk + slab->size * (i + 1);
+	*(void **)(chunk + slab->size * i) = NULL;
+	cache->head = chunk;
+	cache->count = SLAB_BATCH;
+}
+
+/* Allocate an uninitialised object from slab */
+void *slab_alloc(slab_t *slab)
+{
+	struct slab_cache *cache = slab_cache(slab);
+	int64_t live;
+	void *obj;
+
+	if (unlikely(!cache->head))
+		slab_refill(slab, cache);
+	obj = cache->head;
+	cache->head = *(void **)obj;
+	cache->count--;
+
+	live = __sync_add_and_fetch(&slab->live, 1);
+	if (unlikely(live > slab->hwm))
+		slab->hwm = live;
+	return obj;
+}
+
+void *slab_zalloc(slab_t *slab)
+{
+	void *obj = slab_alloc(slab);
+
+	memset(obj, 0, slab->size);
+	return obj;
+}
+
+/* Return an object to the thread's cache, handing a batch back to the slab
+ * when the cache has more than two batches */
+void slab_free(slab_t *slab, void *obj)
+{
+	struct slab_cache *cache;
+
+	if (unlikely(!obj))
+		return;
+	cache = slab_cache(slab);
+	*(void **)obj = cache->head;
+	cache->head = obj;
+	if (unlikely(++cache->count > SLAB_BATCH * 2)) {
+		mutex_lock(&slab->lock);
+		__slab_put(slab, cache, SLAB_BATCH);
+		mutex_unlock(&slab->lock);
+	}
+	__sync_sub_and_fetch(&slab->live, 1);
+}
+
+/* The live and high water counts and memory used by every slab */
+json_t *slab_stats(void)
+{
+	json_t *val = json_object(), *subval;
+	int i, count;
+
+	pthread_mutex_lock(&slabs_lock);
+	count = nslabs;
+	pthread_mutex_unlock(&slabs_lock);
+
+	for (i = 0; i < count; i++) {
+		slab_t *slab = slabs[i];
+		int64_t memory;
+
+		mutex_lock(&slab->lock);
+		memory = slab->chunks * SLAB_BATCH * slab->size;
+		mutex_unlock(&slab->lock);
+		JSON_CPACK(subval, "{sI,sI,sI}", "live", slab->live, "hwm", slab->hwm,
+			   "memory", memory);
+		json_object_set_new_nocheck(val, slab->name, subval);
+	}
+	return val;
+}
+
+
+
+/* SIMD versions of the hex functions work on whole vectors of input at a time
+ * and return how much of the input they processed, leaving the remainder and
+ * any invalid data to the generic code so the semantics are identical. */
+struct hex_funcs {
+	const char *name;
+	/* Return binary bytes decoded, stopping at the first invalid chunk */
+	size_t (*decode)(uchar *p, const uchar *hexstr, size_t len);
+	/* Return binary bytes encoded */
+	size_t (*encode)(uchar *s, const uchar *p, size_t len);
+	/* Return leading characters that are valid hex */
+	size_t (*valid)(const uchar *buf, size_t slen);
+	bool (*supported)(void);
+};
+
+static size_t hex2bin_generic(uchar __maybe_unused *p, const uchar __maybe_unused *hexstr,
+			      size_t __maybe_unused len)
+{
+	return 0;
+}
+
+static size_t bin2hex_generic(uchar __maybe_unused *s, const uchar __maybe_unused *p,
+			      size_t __maybe_unused len)
+{
+	return 0;
+}
+
+static size_t validhex_generic(const uchar __maybe_unused *buf, size_t __maybe_unused slen)
+{
+	return 0;
+}
+
+static bool cpu_hex_generic(void)
+{
+	return true;
+}
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <immintrin.h>
+
+#define HEX_X86
+
+/* The SSE2 functions are always inlined so the AVX2 ones can finish off with
+ * them without mixing legacy SSE and VEX encoded instructions. */
+
+/* Convert 16 hex characters to their nibble values, returning false if any
+ * aren't valid hex. Upper case is folded to lower case only for testing
+ * against a-f as folding would alias some control characters onto digits. */
+static inline bool hex_nibbles_sse2(__m128i c, __m128i *val)
+{
+	const __m128i nine = _mm_set1_epi8(9), five = _mm_set1_epi8(5);
+	__m128i d, a, isdig, isalpha;
+
+	d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	a = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	isdig = _mm_cmpeq_epi8(_mm_min_epu8(d, nine), d);
+	isalpha = _mm_cmpeq_epi8(_mm_min_epu8(a, five), a);
+	if (_mm_movemask_epi8(_mm_or_si128(isdig, isalpha)) != 0xffff)
+		return false;
+	*val = _mm_or_si128(_mm_and_si128(isdig, d),
+			    _mm_and_si128(isalpha, _mm_add_epi8(a, _mm_set1_epi8(10))));
+	return true;
+}
+
+/* Combine pairs of nibbles into bytes in the low byte of each 16 bit word */
+static inline __m128i hex_bytes_sse2(__m128i val)
+{
+	return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(val, 4), _mm_set1_epi16(0xf0)),
+			    _mm_srli_epi16(val, 8));
+}
+
+/* Convert nibble values to lower case hex characters */
+static inline __m128i hex_chars_sse2(__m128i val)
+{
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(val, _mm_set1_epi8(9)),
+				      _mm_set1_epi8('a' - '0' - 10));
 
+	return _mm_add_epi8(_mm_add_epi8(val, _mm_set1_epi8('0')), alpha);
+}
+
+static inline __attribute__ ((always_inline))
+size_t hex2bin_sse2(uchar *p, const uchar *hexstr, size_t len)
+{
+	size_t done = 0;
+
+	while (len - done >= 16) {
+		__m128i val0, val1;
+
+		if (!hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)(hexstr + done * 2)), &val0) ||
+		    !hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)(hexstr + done * 2 + 16)), &val1))
+			break;
+		_mm_storeu_si128((__m128i *)(p + done),
+				 _mm_packus_epi16(hex_bytes_sse2(val0), hex_bytes_sse2(val1)));
+		done += 16;
+	}
+	return done;
+}
+
+static inline __attribute__ ((always_inline))
+size_t bin2hex_sse2(uchar *s, const uchar *p, size_t len)
+{
+	const __m128i mask = _mm_set1_epi8(0xf);
+	size_t done = 0;
+
+	while (len - done >= 16) {
+		__m128i b, hi, lo;
+
+		b = _mm_loadu_si128((const __m128i *)(p + done));
+		hi = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+		lo = _mm_and_si128(b, mask);
+		_mm_storeu_si128((__m128i *)(s + done * 2), hex_chars_sse2(_mm_unpacklo_epi8(hi, lo)));
+		_mm_storeu_si128((__m128i *)(s + done * 2 + 16), hex_chars_sse2(_mm_unpackhi_epi8(hi, lo)));
+		done += 16;
+	}
+	return done;
+}
+
+static inline __attribute__ ((always_inline))
+size_t validhex_sse2(const uchar *buf, size_t slen)
+{
+	size_t done = 0;
+	__m128i val;
+
+	while (slen - done >= 16) {
+		if (!hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)(buf + done)), &val))
+			break;
+		done += 16;
+	}
+	return done;
+}
+
+static bool cpu_hex_sse2(void)
+{
+	return true;
+}
+
+/* The AVX2 versions are the SSE2 ones at twice the width, with the lane
+ * crossing fixups AVX2 pack and unpack need, finishing off with SSE2. */
+__attribute__ ((target ("avx2")))
+static inline bool hex_nibbles_avx2(__m256i c, __m256i *val)
+{
+	const __m256i nine = _mm256_set1_epi8(9), five = _mm256_set1_epi8(5);
+	__m256i d, a, isdig, isalpha;
+
+	d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	a = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	isdig = _mm256_cmpeq_epi8(_mm256_min_epu8(d, nine), d);
+	isalpha = _mm256_cmpeq_epi8(_mm256_min_epu8(a, five), a);
+	if (_mm256_movemask_epi8(_mm256_or_si256(isdig, isalpha)) != -1)
+		return false;
+	*val = _mm256_or_si256(_mm256_and_si256(isdig, d),
+			       _mm256_and_si256(isalpha, _mm256_add_epi8(a, _mm256_set1_epi8(10))));
+	return true;
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i hex_bytes_avx2(__m256i val)
+{
+	return _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(val, 4), _mm256_set1_epi16(0xf0)),
+			       _mm256_srli_epi16(val, 8));
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i hex_chars_avx2(__m256i val)
+{
+	__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(val, _mm256_set1_epi8(9)),
+					 _mm256_set1_epi8('a' - '0' - 10));
+
+	return _mm256_add_epi8(_mm256_add_epi8(val, _mm256_set1_epi8('0')), alpha);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t hex2bin_avx2(uchar *p, const uchar *hexstr, size_t len)
+{
+	size_t done = 0;
+
+	while (len - done >= 32) {
+		__m256i val0, val1, bytes;
+
+		if (!hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(hexstr + done * 2)), &val0) ||
+		    !hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(hexstr + done * 2 + 32)), &val1))
+			break;
+		bytes = _mm256_packus_epi16(hex_bytes_avx2(val0), hex_bytes_avx2(val1));
+		_mm256_storeu_si256((__m256i *)(p + done), _mm256_permute4x64_epi64(bytes, 0xd8));
+		done += 32;
+	}
+	return done + hex2bin_sse2(p + done, hexstr + done * 2, len - done);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t bin2hex_avx2(uchar *s, const uchar *p, size_t len)
+{
+	const __m256i mask = _mm256_set1_epi8(0xf);
+	size_t done = 0;
+
+	while (len - done >= 32) {
+		__m256i b, hi, lo, c0, c1;
+
+		b = _mm256_loadu_si256((const __m256i *)(p + done));
+		hi = _mm256_and_si256(_mm256_srli_epi16(b, 4), mask);
+		lo = _mm256_and_si256(b, mask);
+		c0 = hex_chars_avx2(_mm256_unpacklo_epi8(hi, lo));
+		c1 = hex_chars_avx2(_mm256_unpackhi_epi8(hi, lo));
+		_mm256_storeu_si256((__m256i *)(s + done * 2), _mm256_permute2x128_si256(c0, c1, 0x20));
+		_mm256_storeu_si256((__m256i *)(s + done * 2 + 32), _mm256_permute2x128_si256(c0, c1, 0x31));
+		done += 32;
+	}
+	return done + bin2hex_sse2(s + done * 2, p + done, len - done);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t validhex_avx2(const uchar *buf, size_t slen)
+{
+	size_t done = 0;
+	__m256i val;
+
+	while (slen - done >= 32) {
+		if (!hex_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(buf + done)), &val))
+			break;
+		done += 32;
+	}
+	return done + validhex_sse2(buf + done, slen - done);
+}
+
+static bool cpu_hex_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif /* __x86_64__ && __SSE2__ */
+
+/* In order of preference */
+static const struct hex_funcs hex_impls[] = {
+#ifdef HEX_X86
+	{ "avx2", hex2bin_avx2, bin2hex_avx2, validhex_avx2, cpu_hex_avx2 },
+	{ "sse2", hex2bin_sse2, bin2hex_sse2, validhex_sse2, cpu_hex_sse2 },
+#endif
+	{ "generic", hex2bin_generic, bin2hex_generic, validhex_generic, cpu_hex_generic },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static const struct hex_funcs *hex_kernel;
+
+/* Select the hex implementation by name, or the fastest one the CPU supports
+ * if name is NULL. Returns the name of the selected implementation or NULL
+ * if the named one is unknown or unsupported. */
+const char *hex_select(const char *name)
+{
+	const struct hex_funcs *impl;
+
+	for (impl = hex_impls; impl->name; impl++) {
+		if (name && strcmp(name, impl->name))
+			continue;
+		if (impl->supported())
+			break;
+		if (name)
+			return NULL;
+	}
+	if (!impl->name)
+		return NULL;
+	hex_kernel = impl;
+	return impl->name;
+}
+
+/* Name of the implementation in use */
+const char *hex_impl(void)
+{
+	if (unlikely(!hex_kernel))
+		hex_select(NULL);
+	return hex_kernel->name;
+}
+
+/* Space separated names of the implementations built in */
+void hex_impls_list(char *buf, int len)
+{
+	const struct hex_funcs *impl;
+	int ofs = 0;
+
+	buf[0] = '\0';
+	for (impl = hex_impls; impl->name && ofs < len; impl++)
+		ofs += snprintf(buf + ofs, len - ofs, "%s%s", ofs ? " " : "", impl->name);
+}
+
+static inline const struct hex_funcs *hex_get_kernel(void)
+{
+	if (unlikely(!hex_kernel))
+		hex_select(NULL);
+	return hex_kernel;
+}
 
 /* Adequate size s==len*2 + 1 must be alloced to use this variant */
 void __bin2hex(void *vs, const void *vp, size_t len)
@@ -1501,9 +1976,12 @@ void __bin2hex(void *vs, const void *vp, size_t len)
 	static const char hex[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
 	const uchar *p = vp;
 	uchar *s = vs;
+	size_t done;
 	int i;
 
-	for (i = 0; i < (int)len; i++) {
+	done = hex_get_kernel()->encode(s, p, len);
+	s += done * 2;
+	for (i = done; i < (int)len; i++) {
 		*s++ = hex[p[i] >> 4];
 		*s++ = hex[p[i] & 0xF];
 	}
@@ -1555,7 +2033,7 @@ bool _validhex(const char *buf, const char *file, const char *func, const int li
 		LOGDEBUG("Invalid hex due to length %u from %s %s:%d", slen, file, func, line);
 		goto out;
 	}
-	for (i = 0; i < slen; i++) {
+	for (i = hex_get_kernel()->valid((const uchar *)buf, slen); i < slen; i++) {
 		uchar idx = buf[i];
 
 		if (hex2bin_tbl[idx] == -1) {
@@ -1576,8 +2054,17 @@ bool _hex2bin(void *vp, const void *vhexstr, size_t len, const char *file, const
 	int nibble1, nibble2;
 	bool ret = false;
 	uchar *p = vp;
+	size_t done;
 	uchar idx;
 
+	/* Only hand the vector code as many characters as the string has */
+	if (len >= 16) {
+		done = hex_get_kernel()->decode(p, hexstr, strnlen(vhexstr, len * 2) / 2);
+		p += done;
+		hexstr += done * 2;
+		len -= done;
+	}
+
 	while (*hexstr && len) {
 		if (unlikely(!hexstr[1])) {
 			LOGWARNING("Early end of string in hex2bin from %s %s:%d", file, func, line);
@@ -2255,6 +2742,16 @@ void gen_hash(uchar *data, uchar *hash, int len)
 {
 	uchar hash1[32];
 
+	/* Merkle tree nodes and block headers have dedicated versions */
+	if (len == 64) {
+		sha256d_64(data, hash);
+		return;
+	}
+	if (len == 80) {
+		sha256d_80(data, hash);
+		return;
+	}
+
 	sha256(data, len, hash1);
 	sha256(hash1, 32, hash);
 }
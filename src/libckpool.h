@@ -79,6 +79,7 @@
 #define unlikely(expr) (__builtin_expect(!!(expr), 0))
 #define likely(expr) (__builtin_expect(!!(expr), 1))
 #define __maybe_unused		__attribute__((unused))
+#define __must_check		__attribute__((warn_unused_result))
 #define uninitialised_var(x) x = x
 
 #ifndef MAX
@@ -332,6 +333,32 @@ struct cklock {
 
 typedef struct cklock cklock_t;
 
+/* Object pool for one type of small fixed size object that's allocated and
+ * freed at a high rate. Each thread keeps a cache of free objects of every
+ * slab so most allocations and frees never take a lock, only moving batches
+ * of objects to and from the slab's shared free list. Memory is carved from
+ * chunks that are never returned so objects can't fragment the heap. Slabs
+ * are statically initialised with SLAB_INIT and register themselves on first
+ * use. */
+typedef struct slab slab_t;
+
+struct slab {
+	const char *name;
+	size_t size;
+	int index; /* Of this slab in the thread caches, from 1 once registered */
+
+	mutex_t lock;
+	void *free; /* Shared list of free objects */
+	int64_t chunks;
+
+	/* Objects allocated and not freed, and the most there have been */
+	int64_t live;
+	int64_t hwm;
+};
+
+#define SLAB_INIT(NAME, TYPE) { .name = NAME, .size = sizeof(TYPE), \
+	.lock = { .mutex = PTHREAD_MUTEX_INITIALIZER } }
+
 struct unixsock {
 	int sockd;
 	char *path;
@@ -561,7 +588,15 @@ void *json_ckalloc(size_t size);
 void *_ckzalloc(size_t len, const char *file, const char *func, const int line);
 size_t round_up_page(size_t len);
 
+void *slab_alloc(slab_t *slab);
+void *slab_zalloc(slab_t *slab);
+void slab_free(slab_t *slab, void *obj);
+json_t *slab_stats(void);
+
 extern const int hex2bin_tbl[];
+const char *hex_select(const char *name);
+const char *hex_impl(void);
+void hex_impls_list(char *buf, int len);
 void __bin2hex(void *vs, const void *vp, size_t len);
 void *bin2hex(const void *vp, size_t len);
 bool _validhex(const char *buf, const char *file, const char *func, const int line);
@@ -34,6 +34,8 @@
 
 #include "config.h"
 
+#include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -85,33 +87,11 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
-#ifdef USE_AVX2
-extern void sha256_rorx(const void *, uint32_t[8], uint64_t);
+/* Every transform built in is available at runtime and sha256_select picks
+ * the fastest one the CPU supports, or one forced by name. */
+typedef void (*sha256_transform_t)(const unsigned char *, uint32_t *, uint64_t);
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_rorx(message, ctx->h, block_nb);
-}
-#elif defined(USE_AVX1)
-extern void sha256_avx(const unsigned char *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_avx(message, ctx->h, block_nb);
-}
-#elif defined(USE_SSE4)
-extern void sha256_sse4(const unsigned char *, uint32_t[8], uint64_t);
-
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
-{
-	sha256_sse4(message, ctx->h, block_nb);
-}
-#else
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+static void sha256_generic(const unsigned char *message, uint32_t *h, uint64_t block_nb)
 {
     uint32_t w[64];
     uint32_t wv[8];
@@ -133,7 +113,7 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
 
         for (j = 0; j < 8; j++) {
-            wv[j] = ctx->h[j];
+            wv[j] = h[j];
         }
 
         for (j = 0; j < 64; j++) {
@@ -151,11 +131,209 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
 
         for (j = 0; j < 8; j++) {
-            ctx->h[j] += wv[j];
+            h[j] += wv[j];
         }
     }
 }
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA256_X86
+
+#ifdef USE_SHANI
+/* Uses the SHA extensions with each pass of the loop doing 4 rounds and
+ * generating the message schedule for 4 rounds later */
+__attribute__ ((target ("sha,sse4.1")))
+static void sha256_shani(const unsigned char *message, uint32_t *h, uint64_t block_nb)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+    int i;
+
+    tmp = _mm_loadu_si128((const __m128i *)&h[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&h[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);           /* CDAB */
+    state1 = _mm_shuffle_epi32(state1, 0x1B);     /* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);     /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);  /* CDGH */
+
+    while (block_nb--) {
+        abef = state0;
+        cdgh = state1;
+
+        for (i = 0; i < 4; i++) {
+            w[i] = _mm_loadu_si128((const __m128i *)(message + (i << 4)));
+            w[i] = _mm_shuffle_epi8(w[i], mask);
+        }
+
+        for (i = 0; i < 16; i++) {
+            msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[i << 2]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+            if (i < 12) {
+                tmp = _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4);
+                w[i & 3] = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]), tmp);
+                w[i & 3] = _mm_sha256msg2_epu32(w[i & 3], w[(i + 3) & 3]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        message += SHA256_BLOCK_SIZE;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);        /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xB1);     /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);  /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);     /* ABEF */
+
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+
+static bool cpu_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ebx & bit_SHA) && __builtin_cpu_supports("sse4.1");
+}
+#endif /* USE_SHANI */
+
+#ifdef USE_AVX2
+extern void sha256_rorx(const unsigned char *, uint32_t *, uint64_t);
+
+static bool cpu_avx2(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+}
+#endif
+
+#ifdef USE_AVX1
+extern void sha256_avx(const unsigned char *, uint32_t *, uint64_t);
+
+static bool cpu_avx1(void)
+{
+    return __builtin_cpu_supports("avx");
+}
+#endif
+
+#ifdef USE_SSE4
+extern void sha256_sse4(const unsigned char *, uint32_t *, uint64_t);
+
+static bool cpu_sse4(void)
+{
+    return __builtin_cpu_supports("sse4.1");
+}
 #endif
+#endif /* __x86_64__ || __i386__ */
+
+static bool cpu_generic(void)
+{
+    return true;
+}
+
+struct sha256_impl {
+    const char *name;
+    sha256_transform_t transform;
+    bool (*supported)(void);
+};
+
+/* In order of preference */
+static const struct sha256_impl sha256_impls[] = {
+#ifdef SHA256_X86
+#ifdef USE_SHANI
+    { "shani", sha256_shani, cpu_shani },
+#endif
+#ifdef USE_AVX2
+    { "avx2", sha256_rorx, cpu_avx2 },
+#endif
+#ifdef USE_AVX1
+    { "avx1", sha256_avx, cpu_avx1 },
+#endif
+#ifdef USE_SSE4
+    { "sse4", sha256_sse4, cpu_sse4 },
+#endif
+#endif /* SHA256_X86 */
+    { "generic", sha256_generic, cpu_generic },
+    { NULL, NULL, NULL }
+};
+
+static void sha256_first(const unsigned char *message, uint32_t *h, uint64_t block_nb);
+
+/* Pick the best implementation on first use if sha256_select hasn't been
+ * called yet */
+static sha256_transform_t sha256_transform = sha256_first;
+static const char *sha256_impl_name;
+
+static void sha256_first(const unsigned char *message, uint32_t *h, uint64_t block_nb)
+{
+    sha256_select(NULL);
+    sha256_transform(message, h, block_nb);
+}
+
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb)
+{
+    sha256_transform(message, ctx->h, block_nb);
+}
+
+/* Padding block following a 64 byte message */
+static const unsigned char sha256_pad64[SHA256_BLOCK_SIZE] = {
+    0x80, [62] = 0x02
+};
+
+/* Pad the final block already holding len bytes of a tot_len message */
+static void sha256_pad_block(unsigned char *block, unsigned int len, unsigned int tot_len)
+{
+    memset(block + len, 0, SHA256_BLOCK_SIZE - len);
+    block[len] = 0x80;
+    UNPACK32(tot_len << 3, block + SHA256_BLOCK_SIZE - 4);
+}
+
+static void sha256d_final(sha256_ctx *ctx, unsigned char *digest)
+{
+    unsigned char block[SHA256_BLOCK_SIZE];
+    int i;
+
+    for (i = 0 ; i < 8; i++)
+        UNPACK32(ctx->h[i], &block[i << 2]);
+    sha256_pad_block(block, 32, 32);
+    sha256_init(ctx);
+    sha256_transf(ctx, block, 1);
+    for (i = 0 ; i < 8; i++)
+        UNPACK32(ctx->h[i], &digest[i << 2]);
+}
+
+/* Double sha256 of a 64 byte message such as a merkle tree node */
+void sha256d_64(const unsigned char *message, unsigned char *digest)
+{
+    sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_transf(&ctx, message, 1);
+    sha256_transf(&ctx, sha256_pad64, 1);
+    sha256d_final(&ctx, digest);
+}
+
+/* Double sha256 of an 80 byte message such as a block header */
+void sha256d_80(const unsigned char *message, unsigned char *digest)
+{
+    unsigned char block[SHA256_BLOCK_SIZE];
+    sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_transf(&ctx, message, 1);
+    memcpy(block, message + SHA256_BLOCK_SIZE, 16);
+    sha256_pad_block(block, 16, 80);
+    sha256_transf(&ctx, block, 1);
+    sha256d_final(&ctx, digest);
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -234,3 +412,318 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest)
         UNPACK32(ctx->h[i], &digest[i << 2]);
     }
 }
+
+/* Multi buffer SHA-256 hashing SHA256_LANES independent messages at once, one
+ * message per 32 bit lane of a vector, using the compiler's generic vector
+ * extensions so it maps onto whatever SIMD width the target supports. */
+
+typedef uint32_t sha256_vec __attribute__ ((vector_size (4 * SHA256_LANES)));
+
+#define VROTR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define VCH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define VMAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+#define VSHA256_F1(x) (VROTR(x,  2) ^ VROTR(x, 13) ^ VROTR(x, 22))
+#define VSHA256_F2(x) (VROTR(x,  6) ^ VROTR(x, 11) ^ VROTR(x, 25))
+#define VSHA256_F3(x) (VROTR(x,  7) ^ VROTR(x, 18) ^ ((x) >>  3))
+#define VSHA256_F4(x) (VROTR(x, 17) ^ VROTR(x, 19) ^ ((x) >> 10))
+
+/* Run one block for every lane with w[] holding the message schedule words
+ * transposed so that each vector holds the same word of every lane. Always
+ * inlined so each target specific copy of the lanes code gets its own. */
+static inline __attribute__ ((always_inline))
+void sha256_transf_lanes(sha256_vec *h, sha256_vec *w)
+{
+    sha256_vec wv[8], t1, t2;
+    int j;
+
+    for (j = 16; j < 64; j++)
+        w[j] = VSHA256_F4(w[j - 2]) + w[j - 7] + VSHA256_F3(w[j - 15]) + w[j - 16];
+
+    for (j = 0; j < 8; j++)
+        wv[j] = h[j];
+
+    for (j = 0; j < 64; j++) {
+        t1 = wv[7] + VSHA256_F2(wv[4]) + VCH(wv[4], wv[5], wv[6])
+            + sha256_k[j] + w[j];
+        t2 = VSHA256_F1(wv[0]) + VMAJ(wv[0], wv[1], wv[2]);
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = wv[3] + t1;
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = t1 + t2;
+    }
+
+    for (j = 0; j < 8; j++)
+        h[j] += wv[j];
+}
+
+static inline __attribute__ ((always_inline))
+void sha256_lanes_body(sha256_ctx **ctx, const unsigned char **message,
+                       const unsigned int *len, unsigned char **digest,
+                       int lanes)
+{
+    unsigned char buf[SHA256_LANES][SHA256_LANE_BLOCKS * SHA256_BLOCK_SIZE];
+    unsigned int block_nb[SHA256_LANES] = {}, max_nb = 0, b, i;
+    sha256_vec h[8], w[64], mask;
+    uint32_t nb[SHA256_LANES];
+    int l, j;
+
+    for (l = 0; l < lanes; l++) {
+        unsigned int total = ctx[l]->len + len[l], pm_len;
+        uint64_t len_b;
+
+        block_nb[l] = (total + 9 + SHA256_BLOCK_SIZE - 1) / SHA256_BLOCK_SIZE;
+        if (block_nb[l] > SHA256_LANE_BLOCKS) {
+            /* Too long to batch, hash this one on its own */
+            sha256_update(ctx[l], message[l], len[l]);
+            sha256_final(ctx[l], digest[l]);
+            block_nb[l] = 0;
+            continue;
+        }
+        pm_len = block_nb[l] << 6;
+        memcpy(buf[l], ctx[l]->block, ctx[l]->len);
+        memcpy(buf[l] + ctx[l]->len, message[l], len[l]);
+        memset(buf[l] + total, 0, pm_len - total);
+        buf[l][total] = 0x80;
+        len_b = ((uint64_t)ctx[l]->tot_len + total) << 3;
+        UNPACK32((uint32_t)(len_b >> 32), buf[l] + pm_len - 8);
+        UNPACK32((uint32_t)len_b, buf[l] + pm_len - 4);
+        if (block_nb[l] > max_nb)
+            max_nb = block_nb[l];
+    }
+
+    for (j = 0; j < 8; j++) {
+        for (l = 0; l < SHA256_LANES; l++)
+            h[j][l] = l < lanes ? ctx[l]->h[j] : 0;
+    }
+    for (l = 0; l < SHA256_LANES; l++)
+        nb[l] = l < lanes ? block_nb[l] : 0;
+
+    for (b = 0; b < max_nb; b++) {
+        sha256_vec old[8];
+
+        for (j = 0; j < 16; j++) {
+            for (l = 0; l < SHA256_LANES; l++) {
+                uint32_t word = 0;
+
+                if (b < nb[l])
+                    PACK32(&buf[l][(b << 6) + (j << 2)], &word);
+                w[j][l] = word;
+            }
+        }
+        for (j = 0; j < 8; j++)
+            old[j] = h[j];
+        sha256_transf_lanes(h, w);
+        /* Lanes that have run out of blocks keep their final state */
+        for (l = 0; l < SHA256_LANES; l++)
+            mask[l] = b < nb[l] ? 0xffffffff : 0;
+        for (j = 0; j < 8; j++)
+            h[j] = (h[j] & mask) | (old[j] & ~mask);
+    }
+
+    for (l = 0; l < lanes; l++) {
+        if (!block_nb[l])
+            continue;
+        for (i = 0; i < 8; i++)
+            UNPACK32(h[i][l], &digest[l][i << 2]);
+    }
+}
+
+typedef void (*sha256_lanes_t)(sha256_ctx **, const unsigned char **,
+                               const unsigned int *, unsigned char **, int);
+
+static void sha256_lanes_generic(sha256_ctx **ctx, const unsigned char **message,
+                                 const unsigned int *len, unsigned char **digest,
+                                 int lanes)
+{
+    sha256_lanes_body(ctx, message, len, digest, lanes);
+}
+
+#ifdef SHA256_X86
+__attribute__ ((target ("avx2")))
+static void sha256_lanes_avx2(sha256_ctx **ctx, const unsigned char **message,
+                              const unsigned int *len, unsigned char **digest,
+                              int lanes)
+{
+    sha256_lanes_body(ctx, message, len, digest, lanes);
+}
+#endif
+
+static sha256_lanes_t __sha256_lanes = sha256_lanes_generic;
+
+/* Complete the sha256 of each context after hashing the remaining message
+ * into it, as sha256_update followed by sha256_final would, processing up to
+ * SHA256_LANES contexts in parallel. The contexts are left undefined. */
+void sha256_lanes(sha256_ctx **ctx, const unsigned char **message,
+                  const unsigned int *len, unsigned char **digest, int lanes)
+{
+    while (lanes > 0) {
+        int n = lanes < SHA256_LANES ? lanes : SHA256_LANES;
+
+        __sha256_lanes(ctx, message, len, digest, n);
+        ctx += n;
+        message += n;
+        len += n;
+        digest += n;
+        lanes -= n;
+    }
+}
+
+/* Double sha256 of any number of messages, SHA256_LANES at a time */
+void sha256d_lanes(const unsigned char **message, const unsigned int *len,
+                   unsigned char **digest, int lanes)
+{
+    sha256_ctx ctxs[SHA256_LANES], *ctx[SHA256_LANES];
+    const unsigned char *hash1p[SHA256_LANES];
+    unsigned char hash1[SHA256_LANES][32];
+    unsigned int len1[SHA256_LANES];
+    unsigned char *hash1d[SHA256_LANES];
+    int l;
+
+    for (l = 0; l < SHA256_LANES; l++) {
+        ctx[l] = &ctxs[l];
+        hash1p[l] = hash1[l];
+        hash1d[l] = hash1[l];
+        len1[l] = 32;
+    }
+    while (lanes > 0) {
+        int n = lanes < SHA256_LANES ? lanes : SHA256_LANES;
+
+        for (l = 0; l < n; l++)
+            sha256_init(ctx[l]);
+        __sha256_lanes(ctx, message, len, hash1d, n);
+        for (l = 0; l < n; l++)
+            sha256_init(ctx[l]);
+        __sha256_lanes(ctx, hash1p, len1, digest, n);
+        message += n;
+        len += n;
+        digest += n;
+        lanes -= n;
+    }
+}
+
+static const struct {
+    const char *message;
+    const char *digest;
+} sha256_tests[] = {
+    { "",
+      "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc",
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+      "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+    { NULL, NULL }
+};
+
+static void sha256_hex(const unsigned char *digest, char *hex)
+{
+    static const char hexchars[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        hex[i * 2] = hexchars[digest[i] >> 4];
+        hex[i * 2 + 1] = hexchars[digest[i] & 0xf];
+    }
+    hex[SHA256_DIGEST_SIZE * 2] = '\0';
+}
+
+/* Test the selected implementation against known answers and the multi
+ * buffer and fixed length functions against plain sha256 */
+bool sha256_selftest(void)
+{
+    const unsigned char *msgs[SHA256_LANES];
+    unsigned char digest[SHA256_LANES][SHA256_DIGEST_SIZE], *digests[SHA256_LANES];
+    unsigned char data[SHA256_LANES][160], hash1[SHA256_DIGEST_SIZE], check[SHA256_DIGEST_SIZE];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    unsigned int lens[SHA256_LANES];
+    int i, j;
+
+    for (i = 0; sha256_tests[i].message; i++) {
+        sha256((const unsigned char *)sha256_tests[i].message,
+               strlen(sha256_tests[i].message), digest[0]);
+        sha256_hex(digest[0], hex);
+        if (strcmp(hex, sha256_tests[i].digest))
+            return false;
+    }
+
+    for (i = 0; i < SHA256_LANES; i++) {
+        for (j = 0; j < (int)sizeof(data[i]); j++)
+            data[i][j] = i * 37 + j * 11;
+        msgs[i] = data[i];
+        lens[i] = 40 + i * 15;
+        digests[i] = digest[i];
+    }
+    sha256d_lanes(msgs, lens, digests, SHA256_LANES);
+    for (i = 0; i < SHA256_LANES; i++) {
+        sha256(data[i], lens[i], hash1);
+        sha256(hash1, SHA256_DIGEST_SIZE, check);
+        if (memcmp(check, digest[i], SHA256_DIGEST_SIZE))
+            return false;
+    }
+
+    sha256(data[0], 64, hash1);
+    sha256(hash1, SHA256_DIGEST_SIZE, check);
+    sha256d_64(data[0], digest[0]);
+    if (memcmp(check, digest[0], SHA256_DIGEST_SIZE))
+        return false;
+    sha256(data[0], 80, hash1);
+    sha256(hash1, SHA256_DIGEST_SIZE, check);
+    sha256d_80(data[0], digest[0]);
+    if (memcmp(check, digest[0], SHA256_DIGEST_SIZE))
+        return false;
+    return true;
+}
+
+/* Select the sha256 implementation by name, or the fastest one the CPU
+ * supports if name is NULL. Returns the name of the selected implementation
+ * or NULL if the named one is unknown or unsupported. */
+const char *sha256_select(const char *name)
+{
+    const struct sha256_impl *impl;
+
+    for (impl = sha256_impls; impl->name; impl++) {
+        if (name && strcmp(name, impl->name))
+            continue;
+        if (impl->supported())
+            break;
+        if (name)
+            return NULL;
+    }
+    if (!impl->name)
+        return NULL;
+
+    sha256_transform = impl->transform;
+    sha256_impl_name = impl->name;
+    __sha256_lanes = sha256_lanes_generic;
+#ifdef SHA256_X86
+    /* The generic implementation is for forcing no cpu specific code */
+    if (impl->transform != sha256_generic && __builtin_cpu_supports("avx2"))
+        __sha256_lanes = sha256_lanes_avx2;
+#endif
+    return impl->name;
+}
+
+/* Name of the implementation in use */
+const char *sha256_impl(void)
+{
+    if (!sha256_impl_name)
+        sha256_select(NULL);
+    return sha256_impl_name;
+}
+
+/* Space separated list of the implementations built in */
+void sha256_impls_list(char *buf, int len)
+{
+    const struct sha256_impl *impl;
+    int ofs = 0;
+
+    buf[0] = '\0';
+    for (impl = sha256_impls; impl->name && ofs < len; impl++)
+        ofs += snprintf(buf + ofs, len - ofs, "%s%s", ofs ? " " : "", impl->name);
+}
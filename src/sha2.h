@@ -37,9 +37,16 @@
 #ifndef SHA2_H
 #define SHA2_H
 
+#include <stdbool.h>
+
 #define SHA256_DIGEST_SIZE ( 256 / 8)
 #define SHA256_BLOCK_SIZE  ( 512 / 8)
 
+/* Number of messages hashed in parallel by the multi buffer functions and the
+ * most blocks a message may span to be hashed in a lane */
+#define SHA256_LANES 8
+#define SHA256_LANE_BLOCKS 16
+
 #define SHFR(x, n)    (x >> n)
 #define ROTR(x, n)   ((x >> n) | (x << ((sizeof(x) << 3) - n)))
 #define CH(x, y, z)  ((x & y) ^ (~x & z))
@@ -65,5 +72,15 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+void sha256d_64(const unsigned char *message, unsigned char *digest);
+void sha256d_80(const unsigned char *message, unsigned char *digest);
+void sha256_lanes(sha256_ctx **ctx, const unsigned char **message,
+                  const unsigned int *len, unsigned char **digest, int lanes);
+void sha256d_lanes(const unsigned char **message, const unsigned int *len,
+                   unsigned char **digest, int lanes);
+const char *sha256_select(const char *name);
+const char *sha256_impl(void);
+void sha256_impls_list(char *buf, int len);
+bool sha256_selftest(void);
 
 #endif /* !SHA2_H */
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef SHARELOG_H
+#define SHARELOG_H
+
+#include <stdint.h>
+
+/* Compact binary share logs, written to workbase .sharebin files instead of
+ * the json .sharelog ones with the sharelog_binary option, and converted back
+ * to the same json by ckpsharelog.
+ *
+ * A file is a series of packed records in the pool host's byte order, each
+ * starting with its type byte. Every session of writing to a file starts with
+ * a workinfo record which resets the string and client tables. Strings are
+ * interned with a string record the first time they're used in a session,
+ * and each client's details are written once per session as a client record
+ * referring to them, so a share record only carries the fields unique to the
+ * share. String and client indexes are each handed out in order from zero in
+ * every session. */
+
+#define SHARELOG_VERSION 1
+
+enum sharelog_rectype {
+	SLR_WORKINFO = 1,
+	SLR_STRING,
+	SLR_CLIENT,
+	SLR_SHARE,
+};
+
+struct sharelog_workinfo {
+	uint8_t type;
+	uint8_t version;
+	uint8_t pad[6];
+	int64_t workinfoid;
+} __attribute__((packed));
+
+/* Followed by len bytes of the string without its nul terminator */
+struct sharelog_string {
+	uint8_t type;
+	uint8_t pad;
+	uint16_t len;
+	uint32_t index;
+} __attribute__((packed));
+
+/* String index of a string that was missing altogether */
+#define SHARELOG_NULL 0xffffffff
+
+/* Client details as indexes in the string table */
+struct sharelog_client {
+	uint8_t type;
+	uint8_t pad[3];
+	uint32_t index;
+	int64_t clientid;
+	uint32_t enonce1;
+	uint32_t createinet;
+	uint32_t workername;
+	uint32_t username;
+	uint32_t address;
+	uint32_t agent;
+} __attribute__((packed));
+
+#define SLF_RESULT	0x01 /* Share was accepted */
+#define SLF_REJECT	0x02 /* Has a reject-reason of SHARE_ERR(errn) */
+#define SLF_ERROR	0x04 /* Has an error of SHARE_ERR(errn) */
+#define SLF_HASH	0x08 /* Has a hash, otherwise it was not hashed */
+#define SLF_RAW		0x10 /* Nonce2, nonce and ntime are not plain lower case hex */
+
+/* Followed by hashlen bytes of the hash after its leading zero bytes, then
+ * nonce2len bytes of binary nonce2. With SLF_RAW, nonce and ntime are unused
+ * and instead nonce2, nonce and ntime follow the hash as strings, each
+ * prefixed by a length byte. */
+struct sharelog_share {
+	uint8_t type;
+	uint8_t flags;
+	int8_t errn;
+	uint8_t hashlen;
+	uint8_t nonce2len;
+	uint8_t pad[3];
+	uint32_t client;
+	uint32_t createsec;
+	uint32_t creatensec;
+	uint32_t nonce;
+	uint32_t ntime;
+	double diff;
+	double sdiff;
+} __attribute__((packed));
+
+/* Largest share record including what follows it */
+#define SHARELOG_SHARE_MAX (sizeof(struct sharelog_share) + 32 + 3 * 256)
+
+#endif /* SHARELOG_H */
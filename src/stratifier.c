@@ -14,9 +14,14 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <sched.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -29,6 +34,7 @@
 #include "bitcoin.h"
 #include "sha2.h"
 #include "stratifier.h"
+#include "sharelog.h"
 #include "uthash.h"
 #include "utlist.h"
 #include "connector.h"
@@ -40,8 +46,8 @@ static const char *scriptsig_header = "01000000010000000000000000000000000000000
 static uchar scriptsig_header_bin[41];
 static const double nonces = 4294967296;
 
-/* Add unaccounted shares when they arrive, remove them with each update of
- * rolling stats. */
+/* Unaccounted shares are added to the uastats slots when they arrive and
+ * folded in with each update of rolling stats. */
 struct pool_stats {
 	tv_t start_time;
 	ts_t last_update;
@@ -54,7 +60,6 @@ struct pool_stats {
 	int remote_users;
 
 	/* Absolute shares stats */
-	int64_t unaccounted_shares;
 	int64_t accounted_shares;
 
 	/* Cycle of 32 to determine which users to dump stats on */
@@ -67,9 +72,7 @@ struct pool_stats {
 	double sps60;
 
 	/* Diff shares stats */
-	int64_t unaccounted_diff_shares;
 	int64_t accounted_diff_shares;
-	int64_t unaccounted_rejects;
 	int64_t accounted_rejects;
 
 	/* Diff shares per second for 1/5/15... minute rolling averages */
@@ -98,18 +101,31 @@ struct json_params {
 
 typedef struct json_params json_params_t;
 
-/* Stratum json messages with their associated client id */
+/* Stratum json messages with their associated client id, or for a broadcast
+ * the list of directly connected clients to send the serialised buf to */
 struct smsg {
 	json_t *json_msg;
 	int64_t client_id;
+	char *buf;
+	int64_t *client_ids;
+	int clients;
 };
 
 typedef struct smsg smsg_t;
 
+/* Slabs for the messages passed between the stratifier's threads */
+static slab_t smsg_slab = SLAB_INIT("smsg", smsg_t);
+static slab_t json_params_slab = SLAB_INIT("json_params", json_params_t);
+static slab_t submit_msg_slab = SLAB_INIT("submit_msg", submit_msg_t);
+static slab_t msg_entry_slab = SLAB_INIT("msg_entry", char_entry_t);
+
 struct userwb {
 	UT_hash_handle hh;
 	int64_t id;
 
+	/* Held by the user's userwbs table and by each client caching it */
+	int ref;
+
 	uchar *coinb2bin; // Coinb2 cointaining this user's address for generation
 	char *coinb2;
 	int coinb2len; // Length of user coinb2
@@ -200,9 +216,26 @@ struct worker_instance {
 
 typedef struct stratifier_data sdata_t;
 
+/* Unaccounted pool share stats are added up by each share processing thread
+ * in its own slot, cacheline aligned, and folded into the pool stats by
+ * statsupdate so the share path has no shared lock. Slots are updated
+ * atomically so threads beyond UASTATS_SLOTS can safely share them. */
+#define UASTATS_SLOTS 64
+
+struct uastats {
+	int64_t shares;
+	int64_t diff_shares;
+	int64_t rejects;
+} __attribute__ ((aligned (64)));
+
+typedef struct uastats uastats_t;
+
 typedef struct proxy_base proxy_t;
 
 /* Per client stratum instance == workers */
+/* How many of its latest notifies' userwbs a btcsolo client caches */
+#define CLIENT_USERWBS 4
+
 struct stratum_instance {
 	UT_hash_handle hh;
 	int64_t id;
@@ -222,11 +255,15 @@ struct stratum_instance {
 	stratum_instance_t *remote_next;
 	stratum_instance_t *remote_prev;
 
+	/* Next instance in the same instance_slots chain */
+	stratum_instance_t *slot_next;
+
 	/* Descriptive of ID number and passthrough if any */
 	char identity[128];
 
-	/* Reference count for when this instance is used outside of the
-	 * instance_lock */
+	/* Atomic reference count for when this instance is used outside of
+	 * the instance_lock, set to INSTANCE_DEAD once it's claimed for
+	 * killing so no more references can be taken */
 	int ref;
 
 	char enonce1[36]; /* Fit up to 16 byte binary enonce1 */
@@ -297,15 +334,56 @@ struct stratum_instance {
 	bool passthrough; /* Is this a passthrough */
 	bool trusted; /* Is this a trusted remote server */
 	bool remote; /* Is this a remote client on a trusted remote server */
+
+	/* Cached coinbase midstate up to the end of enonce1 for the workbase
+	 * midstate_id, used when enonce1 completes a sha256 block. Only ever
+	 * accessed with midstate_busy set. */
+	int midstate_busy;
+	int64_t midstate_id;
+	uchar midstate_enonce1[16];
+	sha256_ctx midstate;
+
+	/* Userwbs of the most recent notifies sent to a btcsolo client, each
+	 * holding a ref, so share validation can find its coinb2 without the
+	 * instance lock. Only ever accessed with userwb_busy set. */
+	int userwb_busy;
+	int userwb_next;
+	struct userwb *userwbs[CLIENT_USERWBS];
 };
 
-struct share {
-	UT_hash_handle hh;
-	uchar hash[32];
-	int64_t workbase_id;
+/* Shares are checked for dupes in a table per workbase, split into stripes
+ * selected by the low bits of the share hash so share processing threads
+ * rarely contend. Each stripe is an open addressing table of share hashes
+ * with linear probing, keyed on the first 8 bytes of the hash where a zero
+ * key marks an empty slot. */
+#define SHARE_STRIPES 16
+#define SHARE_STRIPE_MIN 64
+
+typedef struct share_stripe {
+	mutex_t lock;
+	uchar (*hashes)[32];
+	int count;
+	int size; /* Power of 2 */
+} share_stripe_t;
+
+struct sharetable {
+	share_stripe_t stripes[SHARE_STRIPES];
 };
 
-typedef struct share share_t;
+typedef struct sharetable sharetable_t;
+
+/* Stratum instances are also chained in a table of slots selected by their
+ * client id, so they can be looked up and referenced without taking the
+ * instance_lock. Chains are only changed with the instance_lock held for
+ * writing, bumping the slot's seq to odd before and back to even after, so
+ * lookups can tell when they may have raced with a change and retry. */
+#define INSTANCE_SLOTS 65536
+#define INSTANCE_DEAD INT_MIN
+
+typedef struct instance_slot {
+	int seq;
+	stratum_instance_t *head;
+} instance_slot_t;
 
 struct proxy_base {
 	UT_hash_handle hh;
@@ -387,6 +465,89 @@ struct txntable {
 #define ID_ADDRAUTH 8
 #define ID_HEARTBEAT 9
 
+/* A share log line for the workbase id, or with no line, a notification that
+ * the workbase was retired and its file can be closed */
+typedef struct sharelog_msg {
+	int64_t id;
+	char *fname;
+	char *buf; /* Json line or binary share record */
+	int len;
+
+	/* Binary share logs only, the client details to intern */
+	int64_t clientid;
+	const char *createinet;
+	char *strings; /* Enonce1, workername, username, address and agent */
+	int nullstrings; /* Bitmap of which of strings were NULL */
+} sharelog_msg_t;
+
+/* The outcome of a share submission for the sinks recording every share, the
+ * share logs and upstream pool, only put together when one is in use */
+typedef struct share_record {
+	int64_t id;
+	char *fname; /* Share log file, taken over by the share log */
+	const ts_t *now;
+	const char *nonce2;
+	const char *nonce;
+	const char *ntime;
+	double diff;
+	double sdiff;
+	const char *sharehash; /* NULL if the share wasn't hashed */
+	const char *hexhash;
+	bool result;
+	json_t *reject; /* Reject reason */
+	json_t *error;
+	int errn;
+} share_record_t;
+
+typedef struct share_sink share_sink_t;
+
+/* A sink registered at startup to be handed the record of every share. Those
+ * wanting json all share the one json version built for the share. */
+struct share_sink {
+	share_sink_t *next;
+	const char *name;
+	bool json;
+	void (*record)(ckpool_t *ckp, const stratum_instance_t *client, share_record_t *rec,
+		       json_t *val);
+};
+
+/* Maximum share log lines written at once */
+#define SHARELOG_BATCH 256
+
+/* Strings and clients interned in a binary share log */
+typedef struct sharelog_str {
+	UT_hash_handle hh;
+	char *str;
+	uint32_t index;
+} sharelog_str_t;
+
+typedef struct sharelog_cli {
+	UT_hash_handle hh;
+	int64_t clientid;
+	struct sharelog_client rec;
+} sharelog_cli_t;
+
+/* An open share log file with the lines queued for it in this batch */
+typedef struct sharelog {
+	UT_hash_handle hh;
+	int64_t id;
+	int fd;
+	char *fname;
+	time_t synced;
+	bool dirty;
+	int count;
+	sharelog_msg_t *msgs[SHARELOG_BATCH];
+
+	/* Binary share logs are encoded into bin as they're queued */
+	char *bin;
+	int binlen;
+	int binsize;
+	sharelog_str_t *strs;
+	uint32_t nstrs;
+	sharelog_cli_t *clis;
+	uint32_t nclis;
+} sharelog_t;
+
 struct stratifier_data {
 	ckpool_t *ckp;
 
@@ -398,8 +559,8 @@ struct stratifier_data {
 	pool_stats_t stats;
 	/* Protects changes to pool stats */
 	mutex_t stats_lock;
-	/* Protects changes to unaccounted pool stats */
-	mutex_t uastats_lock;
+	/* Per thread unaccounted pool stats */
+	uastats_t uastats[UASTATS_SLOTS];
 
 	bool verbose;
 
@@ -414,6 +575,9 @@ struct stratifier_data {
 	/* For the hashtable of all workbases */
 	workbase_t *workbases;
 	workbase_t *current_workbase;
+	/* Vardiff ceiling from the current workbase, the network diff or the
+	 * proxy diff, cached for reading without the workbase_lock */
+	double current_diff;
 	int workbases_generated;
 	txntable_t *txns;
 	int64_t txns_generated;
@@ -436,16 +600,25 @@ struct stratifier_data {
 	char lastswaphash[68];
 
 	ckmsgq_t *updateq;	// Generator base work updates
-	ckmsgq_t *ssends;	// Stratum sends
 	ckmsgq_t *srecvs;	// Stratum receives
 	ckmsgq_t *sshareq;	// Stratum share sends
 	ckmsgq_t *sauthq;	// Stratum authorisations
 	ckmsgq_t *stxnq;	// Transaction requests
+	ckmsgq_t *sharelogq;	// Share log writes
+
+	/* Share log files currently open, only accessed by the sharelogq */
+	sharelog_t *sharelogs;
+	int open_sharelogs; /* Count of them for stats */
+
+	/* Sinks recording every share, and how many of them want json */
+	share_sink_t *share_sinks;
+	int json_sinks;
 
 	int user_instance_id;
 
 	stratum_instance_t *stratum_instances;
 	stratum_instance_t *recycled_instances;
+	instance_slot_t *instance_slots;
 	stratum_instance_t *node_instances;
 	stratum_instance_t *remote_instances;
 
@@ -459,9 +632,6 @@ struct stratifier_data {
 	/* Protects both stratum and user instances */
 	cklock_t instance_lock;
 
-	share_t *shares;
-	mutex_t share_lock;
-
 	int64_t shares_generated;
 
 	int proxy_count; /* Total proxies generated (not necessarily still alive) */
@@ -492,7 +662,7 @@ static void add_msg_entry(char_entry_t **entries, char **buf)
 
 	if (!*buf)
 		return;
-	entry = ckalloc(sizeof(char_entry_t));
+	entry = slab_alloc(&msg_entry_slab);
 	entry->buf = *buf;
 	*buf = NULL;
 	DL_APPEND(*entries, entry);
@@ -506,7 +676,7 @@ static void notice_msg_entries(char_entry_t **entries)
 		DL_DELETE(*entries, entry);
 		LOGNOTICE("%s", entry->buf);
 		free(entry->buf);
-		free(entry);
+		slab_free(&msg_entry_slab, entry);
 	}
 }
 
@@ -518,12 +688,20 @@ static void info_msg_entries(char_entry_t **entries)
 		DL_DELETE(*entries, entry);
 		LOGINFO("%s", entry->buf);
 		free(entry->buf);
-		free(entry);
+		slab_free(&msg_entry_slab, entry);
 	}
 }
 
 static const int witnessdata_size = 36; // commitment header + hash
 
+/* Store the sha256 midstate of the constant coinb1 prefix of the coinbase so
+ * share validation only has to hash the variable tail. */
+static void coinb1_midstate(workbase_t *wb)
+{
+	sha256_init(&wb->coinb1ctx);
+	sha256_update(&wb->coinb1ctx, wb->coinb1bin, wb->coinb1len);
+}
+
 static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 {
 	uint64_t *u64, g64, d64 = 0;
@@ -590,6 +768,7 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 
 	wb->coinb1bin[41] = len - 1; /* Set the length now */
 	__bin2hex(wb->coinb1, wb->coinb1bin, wb->coinb1len);
+	coinb1_midstate(wb);
 	LOGDEBUG("Coinb1: %s", wb->coinb1);
 	/* Coinbase 1 complete */
 
@@ -746,6 +925,82 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, bool clean);
 static void stratum_broadcast_updates(sdata_t *sdata, bool clean);
 
+static void put_userwb(struct userwb *userwb)
+{
+	if (__sync_sub_and_fetch(&userwb->ref, 1))
+		return;
+	free(userwb->coinb2bin);
+	free(userwb->coinb2);
+	free(userwb);
+}
+
+static void lock_client_userwbs(stratum_instance_t *client)
+{
+	while (__sync_lock_test_and_set(&client->userwb_busy, 1))
+		sched_yield();
+}
+
+static void unlock_client_userwbs(stratum_instance_t *client)
+{
+	__sync_lock_release(&client->userwb_busy);
+}
+
+/* Cache userwb as the latest one sent to client, taking over the caller's
+ * ref to it and dropping the ref of the oldest one it replaces. */
+static void client_cache_userwb(stratum_instance_t *client, struct userwb *userwb)
+{
+	struct userwb *old = NULL;
+	int i;
+
+	lock_client_userwbs(client);
+	for (i = 0; i < CLIENT_USERWBS; i++) {
+		if (client->userwbs[i] && client->userwbs[i]->id == userwb->id) {
+			old = userwb;
+			goto out_unlock;
+		}
+	}
+	i = client->userwb_next;
+	old = client->userwbs[i];
+	client->userwbs[i] = userwb;
+	client->userwb_next = (i + 1) % CLIENT_USERWBS;
+out_unlock:
+	unlock_client_userwbs(client);
+	if (old)
+		put_userwb(old);
+}
+
+/* Copy the coinb2 client was sent for wb into buf if it's cached and the cache
+ * isn't busy, returning its length or -1 otherwise. */
+static int client_cached_coinb2(stratum_instance_t *client, const workbase_t *wb, uchar *buf)
+{
+	int i, ret = -1;
+
+	if (__sync_lock_test_and_set(&client->userwb_busy, 1))
+		return ret;
+	for (i = 0; i < CLIENT_USERWBS; i++) {
+		struct userwb *userwb = client->userwbs[i];
+
+		if (userwb && userwb->id == wb->id) {
+			memcpy(buf, userwb->coinb2bin, userwb->coinb2len);
+			ret = userwb->coinb2len;
+			break;
+		}
+	}
+	unlock_client_userwbs(client);
+	return ret;
+}
+
+/* Called when client is no longer referenced */
+static void clear_client_userwbs(stratum_instance_t *client)
+{
+	int i;
+
+	for (i = 0; i < CLIENT_USERWBS; i++) {
+		if (client->userwbs[i])
+			put_userwb(client->userwbs[i]);
+	}
+}
+
 static void clear_userwb(sdata_t *sdata, int64_t id)
 {
 	user_instance_t *instance, *tmp;
@@ -758,17 +1013,21 @@ static void clear_userwb(sdata_t *sdata, int64_t id)
 		if (!userwb)
 			continue;
 		HASH_DEL(instance->userwbs, userwb);
-		free(userwb->coinb2bin);
-		free(userwb->coinb2);
-		free(userwb);
+		put_userwb(userwb);
 	}
 	ck_wunlock(&sdata->instance_lock);
 }
 
+static void free_sharetable(sharetable_t **table);
+static void retire_sharelog(ckpool_t *ckp, const int64_t id);
+
 static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 {
 	if (ckp->btcsolo)
 		clear_userwb(ckp->sdata, wb->id);
+	if (ckp->logshares)
+		retire_sharelog(ckp, wb->id);
+	free_sharetable(&wb->shares);
 	free(wb->flags);
 	free(wb->txn_data);
 	free(wb->txn_hashes);
@@ -784,72 +1043,106 @@ static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 	free(wb);
 }
 
-/* Remove all shares with a workbase id less than wb_id for block changes */
-static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+static sharetable_t *create_sharetable(void)
 {
-	share_t *share, *tmp;
-	int purged = 0;
+	sharetable_t *table = ckzalloc(sizeof(sharetable_t));
+	int i;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id < wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			purged++;
-		}
-	}
-	mutex_unlock(&sdata->share_lock);
+	for (i = 0; i < SHARE_STRIPES; i++)
+		mutex_init(&table->stripes[i].lock);
+	return table;
+}
 
-	if (purged)
-		LOGINFO("Cleared %d shares from share hashtable", purged);
+static void empty_sharetable(sharetable_t *table)
+{
+	int i;
+
+	for (i = 0; i < SHARE_STRIPES; i++) {
+		share_stripe_t *stripe = &table->stripes[i];
+
+		mutex_lock(&stripe->lock);
+		dealloc(stripe->hashes);
+		stripe->count = stripe->size = 0;
+		mutex_unlock(&stripe->lock);
+	}
 }
 
-/* Remove all shares with a workbase id == wb_id being discarded */
-static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+/* Only called once there are no more references to the workbase so the
+ * whole table can go at once */
+static void free_sharetable(sharetable_t **table)
 {
-	share_t *share, *tmp;
-	int aged = 0;
+	int i;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id == wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			aged++;
-		}
+	if (!*table)
+		return;
+	for (i = 0; i < SHARE_STRIPES; i++) {
+		free((*table)->stripes[i].hashes);
+		mutex_destroy(&(*table)->stripes[i].lock);
 	}
-	mutex_unlock(&sdata->share_lock);
+	dealloc(*table);
+}
+
+static inline uint64_t share_key(const uchar *hash)
+{
+	uint64_t key;
+
+	memcpy(&key, hash, 8);
+	return key;
+}
+
+/* Find the slot hash belongs in, either where it already is or the first
+ * empty one. Stripe lock must be held. */
+static uchar *__stripe_slot(share_stripe_t *stripe, const uchar *hash, const uint64_t key)
+{
+	const int mask = stripe->size - 1;
+	int i = (key / SHARE_STRIPES) & mask;
+
+	while (42) {
+		uchar *slot = stripe->hashes[i];
+		uint64_t slotkey = share_key(slot);
 
-	if (aged)
-		LOGINFO("Aged %d shares from share hashtable", aged);
+		if (!slotkey || (slotkey == key && !memcmp(slot, hash, 32)))
+			return slot;
+		i = (i + 1) & mask;
+	}
 }
 
-/* Append a bulk list already created to the ssends list */
-static void ssend_bulk_append(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
+/* Double the size of a stripe once it's half full. Stripe lock must be held. */
+static void __grow_stripe(share_stripe_t *stripe)
 {
-	ckmsgq_t *ssends = sdata->ssends;
+	uchar (*hashes)[32] = stripe->hashes;
+	int i, size = stripe->size;
+
+	stripe->size = size ? size * 2 : SHARE_STRIPE_MIN;
+	stripe->hashes = ckzalloc(stripe->size * 32);
+	for (i = 0; i < size; i++) {
+		uint64_t key = share_key(hashes[i]);
 
-	mutex_lock(ssends->lock);
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, bulk_send);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+		if (key)
+			memcpy(__stripe_slot(stripe, hashes[i], key), hashes[i], 32);
+	}
+	free(hashes);
 }
 
-/* As ssend_bulk_append but for high priority messages to be put at the front
- * of the list. */
-static void ssend_bulk_prepend(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
+/* Clear the dupe check tables of all workbases before wb_id on block changes
+ * since their shares are now stale. Only the tables are emptied as shares
+ * may still be processed against these workbases. */
+static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-	ckmsg_t *tmp;
+	workbase_t *wb, *tmp;
+	int purged = 0;
+
+	ck_rlock(&sdata->workbase_lock);
+	HASH_ITER(hh, sdata->workbases, wb, tmp) {
+		if (wb->id < wb_id && wb->shares) {
+			empty_sharetable(wb->shares);
+			purged++;
+		}
+	}
+	ck_runlock(&sdata->workbase_lock);
 
-	mutex_lock(ssends->lock);
-	tmp = ssends->msgs;
-	ssends->msgs = bulk_send;
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, tmp);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+	if (purged)
+		LOGINFO("Cleared %d workbase share hashtables", purged);
 }
 
 /* Send a json msg to an upstream trusted remote server */
@@ -879,11 +1172,47 @@ static void upstream_msgtype(ckpool_t *ckp, const json_t *val, const int msg_typ
 	json_decref(json_msg);
 }
 
+static void ssend_process(ckpool_t *ckp, smsg_t *msg)
+{
+	/* The connector takes over the buf and client list of broadcasts */
+	if (msg->buf) {
+		connector_broadcast(ckp, msg->buf, msg->client_ids, msg->clients);
+		slab_free(&smsg_slab, msg);
+		return;
+	}
+
+	if (unlikely(!msg->json_msg)) {
+		LOGERR("Sent null json msg to stratum_sender");
+		free(msg->client_ids);
+		slab_free(&smsg_slab, msg);
+		return;
+	}
+
+	/* Add client_id to the json message and send it to the
+	 * connector process to be delivered */
+	json_object_set_new_nocheck(msg->json_msg, "client_id", json_integer(msg->client_id));
+	connector_add_message(ckp, msg->json_msg);
+	/* The connector will free msg->json_msg */
+	slab_free(&smsg_slab, msg);
+}
+
+/* Send a list of messages built without holding locks, on the calling thread
+ * so they reach each client's connection in the same order as any messages
+ * sent to it directly with stratum_add_send. */
+static void ssend_list(ckpool_t *ckp, ckmsg_t *bulk_send)
+{
+	ckmsg_t *client_msg, *tmp;
+
+	DL_FOREACH_SAFE(bulk_send, client_msg, tmp) {
+		ssend_process(ckp, client_msg->data);
+		slab_free(&ckmsg_slab, client_msg);
+	}
+}
+
 static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *wb)
 {
 	stratum_instance_t *client;
 	ckmsg_t *bulk_send = NULL;
-	int messages = 0;
 	json_t *wb_val;
 
 	wb_val = json_object();
@@ -918,13 +1247,12 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		json_t *json_msg = json_deep_copy(wb_val);
 
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
-		messages++;
 	}
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
 		ckmsg_t *client_msg;
@@ -932,13 +1260,12 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		json_t *json_msg = json_deep_copy(wb_val);
 
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
-		messages++;
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -949,7 +1276,7 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 
 	if (bulk_send) {
 		LOGINFO("Sending workinfo to mining nodes");
-		ssend_bulk_append(sdata, bulk_send, messages);
+		ssend_list(ckp, bulk_send);
 	}
 }
 
@@ -985,8 +1312,9 @@ static void send_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *wb)
 		send_node_workinfo(ckp, sdata, wb);
 }
 
-/* Entered with instance_lock held, make sure wb can't be pulled from us */
-static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *user)
+/* Entered with instance_lock held, make sure wb can't be pulled from us.
+ * Returns the user's userwb for wb, generating it if it doesn't exist. */
+static struct userwb *__generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *user)
 {
 	struct userwb *userwb;
 	int64_t id = wb->id;
@@ -994,11 +1322,12 @@ static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *u
 	/* Make sure this user doesn't have this userwb already */
 	HASH_FIND_I64(user->userwbs, &id, userwb);
 	if (unlikely(userwb))
-		return;
+		return userwb;
 
 	sdata->userwbs_generated++;
 	userwb = ckzalloc(sizeof(struct userwb));
 	userwb->id = id;
+	userwb->ref = 1;
 	userwb->coinb2bin = ckalloc(wb->coinb2len + 1 + user->txnlen + wb->coinb3len);
 	memcpy(userwb->coinb2bin, wb->coinb2bin, wb->coinb2len);
 	userwb->coinb2len = wb->coinb2len;
@@ -1009,6 +1338,7 @@ static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *u
 	userwb->coinb2len += wb->coinb3len;
 	userwb->coinb2 = bin2hex(userwb->coinb2bin, userwb->coinb2len);
 	HASH_ADD_I64(user->userwbs, id, userwb);
+	return userwb;
 }
 
 static void generate_userwbs(sdata_t *sdata, workbase_t *wb)
@@ -1024,6 +1354,361 @@ static void generate_userwbs(sdata_t *sdata, workbase_t *wb)
 	ck_wunlock(&sdata->instance_lock);
 }
 
+static const char *sharelog_suffix(const ckpool_t *ckp)
+{
+	return ckp->sharelog_binary ? "sharebin" : "sharelog";
+}
+
+static void free_sharelog_msg(sharelog_msg_t *msg)
+{
+	free(msg->fname);
+	free(msg->buf);
+	free(msg->strings);
+	free(msg);
+}
+
+/* Queue a share log line for the workbase id to be written to fname, taking
+ * over fname */
+static void queue_sharelog(ckpool_t *ckp, const int64_t id, char *fname, const json_t *val)
+{
+	sharelog_msg_t *msg = ckzalloc(sizeof(sharelog_msg_t));
+	sdata_t *sdata = ckp->sdata;
+
+	msg->id = id;
+	msg->fname = fname;
+	msg->buf = json_dumps(val, JSON_EOL);
+	msg->len = strlen(msg->buf);
+	if (unlikely(!ckmsgq_add(sdata->sharelogq, msg)))
+		free_sharelog_msg(msg);
+}
+
+/* Is this len chars of lower case hex */
+static bool plain_hex(const char *hex, const int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (!isxdigit(hex[i]) || isupper(hex[i]))
+			return false;
+	}
+	return !hex[len];
+}
+
+static void append_rawstr(uchar **p, const char *str)
+{
+	int len = strlen(str);
+
+	if (unlikely(len > 255))
+		len = 255;
+	*(*p)++ = len;
+	memcpy(*p, str, len);
+	*p += len;
+}
+
+/* Queue a share for the binary share log as a share record with everything
+ * but the client index, which is interned by the writer along with the client
+ * details. Takes over rec->fname. */
+static void queue_sharelog_bin(ckpool_t *ckp, const stratum_instance_t *client, share_record_t *rec)
+{
+	const char *nonce2 = rec->nonce2, *nonce = rec->nonce, *ntime = rec->ntime;
+	const char *sharehash = rec->sharehash;
+	int flags = rec->result ? SLF_RESULT : 0;
+	const char *strings[5] = { client->enonce1, client->workername, client->user_instance->username,
+				   client->address, client->useragent };
+	sharelog_msg_t *msg = ckzalloc(sizeof(sharelog_msg_t));
+	struct sharelog_share *share;
+	sdata_t *sdata = ckp->sdata;
+	int i, len, n2len;
+	uchar *p;
+
+	msg->id = rec->id;
+	msg->fname = rec->fname;
+	rec->fname = NULL;
+	msg->clientid = ckp->remote ? client->virtualid : client->id;
+	msg->createinet = ckp->serverurl[client->server];
+	for (i = len = 0; i < 5; i++) {
+		if (strings[i])
+			len += strlen(strings[i]);
+		len++;
+	}
+	msg->strings = ckalloc(len);
+	for (i = len = 0; i < 5; i++) {
+		if (!strings[i]) {
+			msg->nullstrings |= 1 << i;
+			msg->strings[len++] = '\0';
+			continue;
+		}
+		strcpy(msg->strings + len, strings[i]);
+		len += strlen(strings[i]) + 1;
+	}
+
+	msg->buf = ckzalloc(SHARELOG_SHARE_MAX);
+	share = (struct sharelog_share *)msg->buf;
+	p = (uchar *)(share + 1);
+	share->type = SLR_SHARE;
+	share->errn = rec->errn;
+	share->createsec = rec->now->tv_sec;
+	share->creatensec = rec->now->tv_nsec;
+	share->diff = rec->diff;
+	share->sdiff = rec->sdiff;
+	if (rec->reject)
+		flags |= SLF_REJECT;
+	if (rec->error)
+		flags |= SLF_ERROR;
+	if (sharehash) {
+		flags |= SLF_HASH;
+		for (i = 0; i < 32 && !sharehash[i]; i++);
+		share->hashlen = 32 - i;
+		memcpy(p, sharehash + i, share->hashlen);
+		p += share->hashlen;
+	}
+	n2len = strlen(nonce2);
+	if (!(n2len & 1) && n2len <= 32 && plain_hex(nonce2, n2len) && plain_hex(nonce, 8) &&
+	    plain_hex(ntime, 8)) {
+		share->nonce2len = n2len / 2;
+		hex2bin(p, nonce2, share->nonce2len);
+		p += share->nonce2len;
+		share->nonce = strtoul(nonce, NULL, 16);
+		share->ntime = strtoul(ntime, NULL, 16);
+	} else {
+		flags |= SLF_RAW;
+		append_rawstr(&p, nonce2);
+		append_rawstr(&p, nonce);
+		append_rawstr(&p, ntime);
+	}
+	share->flags = flags;
+	msg->len = p - (uchar *)msg->buf;
+	if (unlikely(!ckmsgq_add(sdata->sharelogq, msg)))
+		free_sharelog_msg(msg);
+}
+
+/* Tell the share log writer a workbase was freed so it can close its file.
+ * No more shares can be logged for it, as shares are only logged while
+ * holding a reference to their workbase, and the ones already queued are
+ * written before this. */
+static void retire_sharelog(ckpool_t *ckp, const int64_t id)
+{
+	sharelog_msg_t *msg = ckzalloc(sizeof(sharelog_msg_t));
+	sdata_t *sdata = ckp->sdata;
+
+	msg->id = id;
+	if (unlikely(!ckmsgq_add(sdata->sharelogq, msg)))
+		free_sharelog_msg(msg);
+}
+
+/* Write all the lines queued for a share log with as few writev calls as
+ * possible and sync it to disk if that's configured and due. */
+static void flush_sharelog(ckpool_t *ckp, sharelog_t *log)
+{
+	struct iovec iov[SHARELOG_BATCH + 1], *cur = iov;
+	int i, cnt = log->count;
+	time_t now_t;
+	ssize_t ret;
+
+	for (i = 0; i < cnt; i++) {
+		iov[i].iov_base = log->msgs[i]->buf;
+		iov[i].iov_len = log->msgs[i]->len;
+	}
+	if (log->binlen) {
+		iov[cnt].iov_base = log->bin;
+		iov[cnt++].iov_len = log->binlen;
+	}
+	if (!cnt)
+		return;
+	while (cnt) {
+		ret = writev(log->fd, cur, cnt);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Failed to writev to %s", log->fname);
+			break;
+		}
+		/* Skip what was written in case of a short write */
+		while (cnt && ret >= (ssize_t)cur->iov_len) {
+			ret -= cur->iov_len;
+			cur++;
+			cnt--;
+		}
+		if (cnt) {
+			cur->iov_base = (char *)cur->iov_base + ret;
+			cur->iov_len -= ret;
+		}
+	}
+	for (i = 0; i < log->count; i++)
+		free_sharelog_msg(log->msgs[i]);
+	log->count = 0;
+	log->binlen = 0;
+
+	if (!ckp->sharelog_sync)
+		return;
+	log->dirty = true;
+	now_t = time(NULL);
+	if (now_t - log->synced >= ckp->sharelog_sync) {
+		fdatasync(log->fd);
+		log->synced = now_t;
+		log->dirty = false;
+	}
+}
+
+static void close_sharelog(ckpool_t *ckp, sdata_t *sdata, sharelog_t *log)
+{
+	sharelog_str_t *str, *tmpstr;
+	sharelog_cli_t *cli, *tmpcli;
+
+	flush_sharelog(ckp, log);
+	if (log->dirty)
+		fdatasync(log->fd);
+	close(log->fd);
+	HASH_DEL(sdata->sharelogs, log);
+	__atomic_sub_fetch(&sdata->open_sharelogs, 1, __ATOMIC_RELAXED);
+	HASH_ITER(hh, log->strs, str, tmpstr) {
+		HASH_DEL(log->strs, str);
+		free(str->str);
+		free(str);
+	}
+	HASH_ITER(hh, log->clis, cli, tmpcli) {
+		HASH_DEL(log->clis, cli);
+		free(cli);
+	}
+	free(log->bin);
+	free(log->fname);
+	free(log);
+}
+
+static void sharelog_append(sharelog_t *log, const void *data, const int len)
+{
+	if (log->binlen + len > log->binsize) {
+		log->binsize = (log->binlen + len) * 2;
+		log->bin = realloc(log->bin, log->binsize);
+		if (unlikely(!log->bin))
+			quit(1, "Failed to realloc sharelog bin buffer");
+	}
+	memcpy(log->bin + log->binlen, data, len);
+	log->binlen += len;
+}
+
+/* Return the index of str in the share log's string table, adding it if it's
+ * not there yet */
+static uint32_t sharelog_intern(sharelog_t *log, const char *string)
+{
+	struct sharelog_string rec = {};
+	sharelog_str_t *str;
+	int len;
+
+	if (!string)
+		return SHARELOG_NULL;
+	HASH_FIND_STR(log->strs, string, str);
+	if (str)
+		return str->index;
+	str = ckalloc(sizeof(sharelog_str_t));
+	str->str = strdup(string);
+	str->index = log->nstrs++;
+	len = strlen(string);
+	HASH_ADD_KEYPTR(hh, log->strs, str->str, len, str);
+
+	if (unlikely(len > 65535))
+		len = 65535;
+	rec.type = SLR_STRING;
+	rec.len = len;
+	rec.index = str->index;
+	sharelog_append(log, &rec, sizeof(rec));
+	sharelog_append(log, string, len);
+	return str->index;
+}
+
+/* Return the index of the client in msg, writing a new client record if we
+ * haven't seen it or its details have changed */
+static uint32_t sharelog_client(sharelog_t *log, const sharelog_msg_t *msg)
+{
+	const char *strings[5], *string = msg->strings;
+	struct sharelog_client rec = {};
+	sharelog_cli_t *cli;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		strings[i] = msg->nullstrings & (1 << i) ? NULL : string;
+		string += strlen(string) + 1;
+	}
+	rec.type = SLR_CLIENT;
+	rec.clientid = msg->clientid;
+	rec.enonce1 = sharelog_intern(log, strings[0]);
+	rec.createinet = sharelog_intern(log, msg->createinet);
+	rec.workername = sharelog_intern(log, strings[1]);
+	rec.username = sharelog_intern(log, strings[2]);
+	rec.address = sharelog_intern(log, strings[3]);
+	rec.agent = sharelog_intern(log, strings[4]);
+
+	HASH_FIND_I64(log->clis, &msg->clientid, cli);
+	if (cli) {
+		rec.index = cli->rec.index;
+		if (!memcmp(&rec, &cli->rec, sizeof(rec)))
+			return rec.index;
+	} else {
+		cli = ckalloc(sizeof(sharelog_cli_t));
+		cli->clientid = msg->clientid;
+		HASH_ADD_I64(log->clis, clientid, cli);
+	}
+	rec.index = log->nclis++;
+	memcpy(&cli->rec, &rec, sizeof(rec));
+	sharelog_append(log, &rec, sizeof(rec));
+	return rec.index;
+}
+
+/* Share log writer, keeping a file open for each active workbase and writing
+ * each batch of lines to it at once, off the share processing threads. */
+static void sharelog_process(ckpool_t *ckp, sharelog_msg_t **msgs, const int count)
+{
+	sdata_t *sdata = ckp->sdata;
+	sharelog_t *log, *tmp;
+	int i, fd;
+
+	for (i = 0; i < count; i++) {
+		sharelog_msg_t *msg = msgs[i];
+
+		HASH_FIND_I64(sdata->sharelogs, &msg->id, log);
+		if (!msg->buf) {
+			if (log)
+				close_sharelog(ckp, sdata, log);
+			free_sharelog_msg(msg);
+			continue;
+		}
+		if (!log) {
+			fd = open(msg->fname, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+			if (unlikely(fd < 0)) {
+				LOGERR("Failed to open %s", msg->fname);
+				free_sharelog_msg(msg);
+				continue;
+			}
+			log = ckzalloc(sizeof(sharelog_t));
+			log->id = msg->id;
+			log->fd = fd;
+			log->fname = strdup(msg->fname);
+			log->synced = time(NULL);
+			HASH_ADD_I64(sdata->sharelogs, id, log);
+			__atomic_add_fetch(&sdata->open_sharelogs, 1, __ATOMIC_RELAXED);
+			if (ckp->sharelog_binary) {
+				struct sharelog_workinfo rec = {};
+
+				rec.type = SLR_WORKINFO;
+				rec.version = SHARELOG_VERSION;
+				rec.workinfoid = msg->id;
+				sharelog_append(log, &rec, sizeof(rec));
+			}
+		}
+		if (ckp->sharelog_binary) {
+			struct sharelog_share *share = (struct sharelog_share *)msg->buf;
+
+			share->client = sharelog_client(log, msg);
+			sharelog_append(log, msg->buf, msg->len);
+			free_sharelog_msg(msg);
+			continue;
+		}
+		log->msgs[log->count++] = msg;
+	}
+	HASH_ITER(hh, sdata->sharelogs, log, tmp)
+		flush_sharelog(ckp, log);
+}
+
 /* Add a new workbase to the table of workbases. Sdata is the global data in
  * pool mode but unique to each subproxy in proxy mode */
 static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_block)
@@ -1039,6 +1724,7 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 
 	len = strlen(ckp->logdir) + 8 + 1 + 16 + 1;
 	wb->logdir = ckzalloc(len);
+	wb->shares = create_sharetable();
 
 	/* In proxy mode, the wb->id is received in the notify update and
 	 * we set workbase_id from it. In server mode the stratifier is
@@ -1072,7 +1758,9 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	HASH_ADD_I64(sdata->workbases, id, wb);
 	if (sdata->current_workbase)
 		tv_time(&sdata->current_workbase->retired);
-	sdata->current_workbase = wb;
+	sdata->current_diff = ckp->proxy ? wb->diff : wb->network_diff;
+	/* Publish wb fully set up to the readers that don't take the lock */
+	__atomic_store_n(&sdata->current_workbase, wb, __ATOMIC_RELEASE);
 
 	/* Is this long enough to ensure we don't dereference a workbase
 	 * immediately? Should be unless clock changes 10 minutes so we use
@@ -1090,7 +1778,6 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 			ck_wunlock(&sdata->workbase_lock);
 
 			/* Drop lock to avoid recursive locks */
-			age_share_hashtable(sdata, tmp->id);
 			clear_workbase(ckp, tmp);
 
 			ck_wlock(&sdata->workbase_lock);
@@ -1189,7 +1876,6 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 	stratum_instance_t *client;
 	ckmsg_t *bulk_send = NULL;
 	ckmsg_t *client_msg;
-	int messages = 0;
 	json_t *json_msg;
 	smsg_t *msg;
 
@@ -1197,24 +1883,22 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 	DL_FOREACH2(sdata->node_instances, client, node_next) {
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_TRANSACTIONS]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
-		messages++;
 	}
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_TRANSACTIONS]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
-		messages++;
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -1223,7 +1907,7 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 
 	if (bulk_send) {
 		LOGINFO("Sending transactions to mining nodes");
-		ssend_bulk_append(sdata, bulk_send, messages);
+		ssend_list(ckp, bulk_send);
 	}
 }
 
@@ -1533,13 +2217,9 @@ out:
 	free(prio);
 }
 
-#define SSEND_PREPEND	0
-#define SSEND_APPEND	1
-
 /* Downstream a json message to all remote servers except for the one matching
  * client_id */
-static void downstream_json(sdata_t *sdata, const json_t *val, const int64_t client_id,
-			    const int prio)
+static void downstream_json(sdata_t *sdata, const json_t *val, const int64_t client_id)
 {
 	stratum_instance_t *client;
 	ckmsg_t *bulk_send = NULL;
@@ -1555,8 +2235,8 @@ static void downstream_json(sdata_t *sdata, const json_t *val, const int64_t cli
 		if (client->id == client_id)
 			continue;
 		json_msg = json_deep_copy(val);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1567,14 +2247,7 @@ static void downstream_json(sdata_t *sdata, const json_t *val, const int64_t cli
 
 	if (bulk_send) {
 		LOGINFO("Sending json to %d remote servers", messages);
-		switch (prio) {
-			case SSEND_PREPEND:
-				ssend_bulk_prepend(sdata, bulk_send, messages);
-				break;
-			case SSEND_APPEND:
-				ssend_bulk_append(sdata, bulk_send, messages);
-				break;
-		}
+		ssend_list(sdata->ckp, bulk_send);
 	}
 }
 
@@ -1593,7 +2266,7 @@ static void request_txns(ckpool_t *ckp, sdata_t *sdata, json_t *txns)
 		/* We don't know which remote sent the transaction hash so ask
 		 * all of them for it */
 		json_set_string(val, "method", stratum_msgs[SM_REQTXNS]);
-		downstream_json(sdata, val, 0, SSEND_APPEND);
+		downstream_json(sdata, val, 0);
 	}
 }
 
@@ -1770,8 +2443,8 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 			continue;
 		json_msg = json_deep_copy(val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1788,8 +2461,8 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 			continue;
 		json_msg = json_deep_copy(val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1802,7 +2475,7 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 
 	if (bulk_send) {
 		LOGINFO("Sending remote workinfo to %d other remote servers", messages);
-		ssend_bulk_append(sdata, bulk_send, messages);
+		ssend_list(ckp, bulk_send);
 	}
 }
 
@@ -1852,6 +2525,7 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 	json_intcpy(&wb->coinb1len, val, "coinb1len");
 	wb->coinb1bin = ckzalloc(wb->coinb1len);
 	hex2bin(wb->coinb1bin, wb->coinb1, wb->coinb1len);
+	coinb1_midstate(wb);
 	json_strdup(&wb->coinb2, val, "coinb2");
 	json_intcpy(&wb->coinb2len, val, "coinb2len");
 	wb->coinb2bin = ckzalloc(wb->coinb2len);
@@ -1881,6 +2555,17 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
 }
 
+/* Complete the double sha256 of the coinbase from a context that has already
+ * hashed the coinbase up to the start of tail. */
+static void coinbase_hash(sha256_ctx *ctx, const uchar *tail, const int taillen, uchar *hash)
+{
+	uchar hash1[32];
+
+	sha256_update(ctx, tail, taillen);
+	sha256_final(ctx, hash1);
+	sha256(hash1, 32, hash);
+}
+
 /* Calculate share diff and fill in hash and swap. Need to hold workbase read count */
 static double
 share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const char *nonce2,
@@ -1890,6 +2575,7 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	unsigned char merkle_root[32], merkle_sha[64];
 	uint32_t *data32, *swap32, benonce32;
 	uchar hash1[32];
+	sha256_ctx ctx;
 	char data[80];
 	int i;
 
@@ -1902,7 +2588,9 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	memcpy(coinbase + *cblen, wb->coinb2bin, wb->coinb2len);
 	*cblen += wb->coinb2len;
 
-	gen_hash((uchar *)coinbase, merkle_root, *cblen);
+	/* Only hash what follows the cached coinb1 midstate */
+	memcpy(&ctx, &wb->coinb1ctx, sizeof(sha256_ctx));
+	coinbase_hash(&ctx, (uchar *)coinbase + wb->coinb1len, *cblen - wb->coinb1len, merkle_root);
 	memcpy(merkle_sha, merkle_root, 32);
 	for (i = 0; i < wb->merkles; i++) {
 		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
@@ -1982,8 +2670,8 @@ static void send_nodes_block(sdata_t *sdata, const json_t *block_val, const int6
 			continue;
 		json_msg = json_deep_copy(block_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_BLOCK]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1994,7 +2682,7 @@ static void send_nodes_block(sdata_t *sdata, const json_t *block_val, const int6
 
 	if (bulk_send) {
 		LOGNOTICE("Sending block to %d mining nodes", messages);
-		ssend_bulk_prepend(sdata, bulk_send, messages);
+		ssend_list(sdata->ckp, bulk_send);
 	}
 
 }
@@ -2094,15 +2782,37 @@ static bool local_block_submit(ckpool_t *ckp, char *gbt_block, const uchar *flip
 	return ret;
 }
 
+/* Workbase readcounts are changed atomically so readers only need the read
+ * workbase_lock to find a workbase and take a readcount on it, and none to
+ * drop it again. Workbases are only ever removed under the write lock once
+ * their readcount is zero so they can't go away while being looked up. */
+static inline void __get_workbase(workbase_t *wb)
+{
+	__sync_fetch_and_add(&wb->readcount, 1);
+}
+
 static workbase_t *get_workbase(sdata_t *sdata, const int64_t id)
 {
 	workbase_t *wb;
 
-	ck_wlock(&sdata->workbase_lock);
+	ck_rlock(&sdata->workbase_lock);
 	HASH_FIND_I64(sdata->workbases, &id, wb);
 	if (wb)
-		wb->readcount++;
-	ck_wunlock(&sdata->workbase_lock);
+		__get_workbase(wb);
+	ck_runlock(&sdata->workbase_lock);
+
+	return wb;
+}
+
+static workbase_t *get_current_workbase(sdata_t *sdata)
+{
+	workbase_t *wb;
+
+	ck_rlock(&sdata->workbase_lock);
+	wb = sdata->current_workbase;
+	if (wb)
+		__get_workbase(wb);
+	ck_runlock(&sdata->workbase_lock);
 
 	return wb;
 }
@@ -2120,24 +2830,22 @@ static workbase_t *get_remote_workbase(sdata_t *sdata, const int64_t id, const i
 {
 	workbase_t *wb;
 
-	ck_wlock(&sdata->workbase_lock);
+	ck_rlock(&sdata->workbase_lock);
 	wb = __find_remote_workbase(sdata, id, client_id);
 	if (wb) {
 		if (wb->incomplete)
 			wb = NULL;
 		else
-			wb->readcount++;
+			__get_workbase(wb);
 	}
-	ck_wunlock(&sdata->workbase_lock);
+	ck_runlock(&sdata->workbase_lock);
 
 	return wb;
 }
 
-static void put_workbase(sdata_t *sdata, workbase_t *wb)
+static void put_workbase(sdata_t __maybe_unused *sdata, workbase_t *wb)
 {
-	ck_wlock(&sdata->workbase_lock);
-	wb->readcount--;
-	ck_wunlock(&sdata->workbase_lock);
+	__sync_fetch_and_sub(&wb->readcount, 1);
 }
 
 #define put_remote_workbase(sdata, wb) put_workbase(sdata, wb)
@@ -2276,7 +2984,10 @@ static void update_base(sdata_t *sdata, const int prio)
 
 	uprio = ckalloc(sizeof(int));
 	*uprio = prio;
-	ckmsgq_add(sdata->updateq, uprio);
+	if (unlikely(!ckmsgq_add(sdata->updateq, uprio))) {
+		free(uprio);
+		cksem_post(&sdata->update_sem);
+	}
 }
 
 /* Instead of removing the client instance, we add it to a list of recycled
@@ -2290,7 +3001,13 @@ static void __kill_instance(sdata_t *sdata, stratum_instance_t *client)
 	free(client->workername);
 	free(client->password);
 	free(client->useragent);
-	memset(client, 0, sizeof(stratum_instance_t));
+	clear_client_userwbs(client);
+	/* Clear everything but the ref, which stays INSTANCE_DEAD till the
+	 * instance is recruited again since a lock free lookup racing with us
+	 * may still try to take a reference to it. */
+	memset(client, 0, offsetof(stratum_instance_t, ref));
+	memset(&client->ref + 1, 0, sizeof(stratum_instance_t) - offsetof(stratum_instance_t, ref) -
+	       sizeof(client->ref));
 	DL_APPEND2(sdata->recycled_instances, client, recycled_prev, recycled_next);
 }
 
@@ -2343,6 +3060,57 @@ static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *clien
 	sdata->disconnected_generated++;
 }
 
+static instance_slot_t *instance_slot(sdata_t *sdata, const int64_t id)
+{
+	return &sdata->instance_slots[(id ^ (id >> 32)) & (INSTANCE_SLOTS - 1)];
+}
+
+/* Enter with write instance_lock held */
+static void __add_instance_slot(sdata_t *sdata, stratum_instance_t *client)
+{
+	instance_slot_t *slot = instance_slot(sdata, client->id);
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	client->slot_next = slot->head;
+	__atomic_store_n(&slot->head, client, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Enter with write instance_lock held */
+static void __del_instance_slot(sdata_t *sdata, stratum_instance_t *client)
+{
+	instance_slot_t *slot = instance_slot(sdata, client->id);
+	stratum_instance_t **prev;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (prev = &slot->head; *prev; prev = &(*prev)->slot_next) {
+		if (*prev == client) {
+			__atomic_store_n(prev, client->slot_next, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Mark a client as no longer having any references allowed, returning true
+ * if it had none and the caller can now kill it. Anyone still holding a
+ * reference will instead drop it when their last one is released, provided
+ * client->dropped was set before trying to claim it. */
+static bool __claim_instance(stratum_instance_t *client)
+{
+	int ref = 0;
+
+	return __atomic_compare_exchange_n(&client->ref, &ref, INSTANCE_DEAD, false,
+					   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void __set_dropped(stratum_instance_t *client)
+{
+	__atomic_store_n(&client->dropped, true, __ATOMIC_SEQ_CST);
+}
+
 /* Removes a client instance we know is on the stratum_instances list and from
  * the user client list if it's been placed on it */
 static void __del_client(sdata_t *sdata, stratum_instance_t *client)
@@ -2350,6 +3118,7 @@ static void __del_client(sdata_t *sdata, stratum_instance_t *client)
 	user_instance_t *user = client->user_instance;
 
 	HASH_DEL(sdata->stratum_instances, client);
+	__del_instance_slot(sdata, client);
 	if (user) {
 		DL_DELETE2(user->clients, client, user_prev, user_next );
 		__dec_worker(sdata, user, client->worker_instance);
@@ -2358,11 +3127,8 @@ static void __del_client(sdata_t *sdata, stratum_instance_t *client)
 
 static void connector_drop_client(ckpool_t *ckp, const int64_t id)
 {
-	char buf[256];
-
 	LOGDEBUG("Stratifier requesting connector drop client %"PRId64, id);
-	snprintf(buf, 255, "dropclient=%"PRId64, id);
-	send_proc(ckp->connector, buf);
+	bus_send(ckp->connector, BUS_DROPCLIENT, id);
 }
 
 static void drop_allclients(ckpool_t *ckp)
@@ -2375,11 +3141,11 @@ static void drop_allclients(ckpool_t *ckp)
 	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
 		int64_t client_id = client->id;
 
-		if (!client->ref) {
+		__set_dropped(client);
+		if (__claim_instance(client)) {
 			__del_client(sdata, client);
 			__kill_instance(sdata, client);
-		} else
-			client->dropped = true;
+		}
 		kills++;
 		connector_drop_client(ckp, client_id);
 	}
@@ -2402,7 +3168,6 @@ static sdata_t *duplicate_sdata(const sdata_t *sdata)
 	memcpy(dsdata->dontxnbin, sdata->dontxnbin, 40);
 
 	/* Use the same work queues for all subproxies */
-	dsdata->ssends = sdata->ssends;
 	dsdata->srecvs = sdata->srecvs;
 	dsdata->sshareq = sdata->sshareq;
 	dsdata->sauthq = sdata->sauthq;
@@ -3020,6 +3785,7 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	wb->coinb1 = ckalloc(wb->coinb1len * 2 + 1);
 	json_strcpy(wb->coinb1, val, "coinbase1");
 	hex2bin(wb->coinb1bin, wb->coinb1, wb->coinb1len);
+	coinb1_midstate(wb);
 	wb->height = get_sernumber(wb->coinb1bin + 42);
 	json_strdup(&wb->coinb2, val, "coinbase2");
 	wb->coinb2len = strlen(wb->coinb2) / 2;
@@ -3127,6 +3893,7 @@ static void update_diff(ckpool_t *ckp, const char *cmd)
 	ck_wlock(&dsdata->workbase_lock);
 	old_diff = proxy->diff;
 	dsdata->current_workbase->diff = proxy->diff = diff;
+	dsdata->current_diff = diff;
 	ck_wunlock(&dsdata->workbase_lock);
 
 	if (old_diff < diff)
@@ -3162,18 +3929,10 @@ static void free_proxy(ckpool_t *ckp, proxy_t *proxy)
 {
 	sdata_t *dsdata = proxy->sdata;
 
-	/* Delete any shares in the proxy's hashtable. */
+	/* Delete the proxy's workbases along with their shares. */
 	if (dsdata) {
-		share_t *share, *tmpshare;
 		workbase_t *wb, *tmpwb;
 
-		mutex_lock(&dsdata->share_lock);
-		HASH_ITER(hh, dsdata->shares, share, tmpshare) {
-			HASH_DEL(dsdata->shares, share);
-			dealloc(share);
-		}
-		mutex_unlock(&dsdata->share_lock);
-
 		/* Do we need to check readcount here if freeing the proxy? */
 		ck_wlock(&dsdata->workbase_lock);
 		HASH_ITER(hh, dsdata->workbases, wb, tmpwb) {
@@ -3240,38 +3999,104 @@ static void reap_proxies(ckpool_t *ckp, sdata_t *sdata)
 		LOGINFO("Stratifier discarded %d dead proxies", dead);
 }
 
-/* Enter with instance_lock held */
-static stratum_instance_t *__instance_by_id(sdata_t *sdata, const int64_t id)
+/* Find the instance with client id in its slot chain, returning NULL if a
+ * change to the chain hides it */
+static stratum_instance_t *slot_instance(instance_slot_t *slot, const int64_t id)
 {
 	stratum_instance_t *client;
 
-	HASH_FIND_I64(sdata->stratum_instances, &id, client);
+	for (client = __atomic_load_n(&slot->head, __ATOMIC_ACQUIRE); client;
+	     client = __atomic_load_n(&client->slot_next, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&client->id, __ATOMIC_RELAXED) == id)
+			break;
+	}
 	return client;
 }
 
-/* Increase the reference count of instance */
+/* Enter with instance_lock held */
+static stratum_instance_t *__instance_by_id(sdata_t *sdata, const int64_t id)
+{
+	/* Subproxy sdata don't have any instances of their own */
+	if (unlikely(!sdata->instance_slots))
+		return NULL;
+	return slot_instance(instance_slot(sdata, id), id);
+}
+
+/* Increase the reference count of instance unless it has been claimed for
+ * killing, which can happen at any time to a dropped instance with no
+ * references, even while holding the instance_lock. */
+static bool __must_check __try_instance_ref(stratum_instance_t *client)
+{
+	int ref = __atomic_load_n(&client->ref, __ATOMIC_RELAXED);
+
+	do {
+		if (unlikely(ref < 0))
+			return false;
+	} while (!__atomic_compare_exchange_n(&client->ref, &ref, ref + 1, true,
+					      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	return true;
+}
+
+/* Increase the reference count of an instance that can't be claimed for
+ * killing, as we already hold a reference or have just added it with the
+ * instance_lock held. */
 static void __inc_instance_ref(stratum_instance_t *client)
 {
-	client->ref++;
+	if (unlikely(!__try_instance_ref(client)))
+		quit(1, "Tried to reference killed instance %s", client->identity);
 }
 
-/* Find an __instance_by_id and increase its reference count allowing us to
- * use this instance outside of instance_lock without fear of it being
- * dereferenced. Does not return dropped clients still on the list. */
-static inline stratum_instance_t *ref_instance_by_id(sdata_t *sdata, const int64_t id)
+static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const char *file,
+			      const char *func, const int line);
+
+#define dec_instance_ref(sdata, instance) _dec_instance_ref(sdata, instance, __FILE__, __func__, __LINE__)
+
+/* Find the instance with client id and take a reference to it without
+ * holding the instance_lock, including dropped instances that have not been
+ * claimed for killing yet. Instances are only ever recycled, never freed, so
+ * a stale pointer from a racing lookup is always safe to reference and is
+ * weeded out by checking the slot's seq again once we hold the reference. */
+static stratum_instance_t *__ref_instance(sdata_t *sdata, const int64_t id)
 {
 	stratum_instance_t *client;
+	instance_slot_t *slot;
+	int seq;
 
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, id);
-	if (client) {
-		if (unlikely(client->dropped))
-			client = NULL;
-		else
-			__inc_instance_ref(client);
+	if (unlikely(!sdata->instance_slots))
+		return NULL;
+	slot = instance_slot(sdata, id);
+retry:
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (unlikely(seq & 1)) {
+		sched_yield();
+		goto retry;
 	}
-	ck_wunlock(&sdata->instance_lock);
+	client = slot_instance(slot, id);
+	if (client && !__try_instance_ref(client))
+		client = NULL;
+	/* Whatever we found can't be trusted if the chain changed under us.
+	 * Once we hold a reference the instance can't be unlinked any more. */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (unlikely(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)) {
+		if (client)
+			dec_instance_ref(sdata, client);
+		goto retry;
+	}
+	return client;
+}
+
+/* Find an instance by id and increase its reference count allowing us to
+ * use this instance outside of instance_lock without fear of it being
+ * dereferenced. Does not return dropped clients still on the list. Takes no
+ * locks unless it's the last reference to an instance dropped meanwhile. */
+static inline stratum_instance_t *ref_instance_by_id(sdata_t *sdata, const int64_t id)
+{
+	stratum_instance_t *client = __ref_instance(sdata, id);
 
+	if (client && unlikely(__atomic_load_n(&client->dropped, __ATOMIC_SEQ_CST))) {
+		dec_instance_ref(sdata, client);
+		client = NULL;
+	}
 	return client;
 }
 
@@ -3308,10 +4133,11 @@ static void __drop_client(sdata_t *sdata, stratum_instance_t *client, bool lazil
 
 static int __dec_instance_ref(stratum_instance_t *client)
 {
-	return --client->ref;
+	return __atomic_sub_fetch(&client->ref, 1, __ATOMIC_SEQ_CST);
 }
 
-/* Decrease the reference count of instance. */
+/* Decrease the reference count of instance, only taking the instance_lock
+ * if it was the last reference to an instance that was dropped meanwhile. */
 static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const char *file,
 			      const char *func, const int line)
 {
@@ -3320,17 +4146,18 @@ static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const
 	char *msg = NULL;
 	int ref;
 
-	ck_wlock(&sdata->instance_lock);
 	ref = __dec_instance_ref(client);
 	/* See if there are any instances that were dropped that could not be
 	 * moved due to holding a reference and drop them now. */
-	if (unlikely(client->dropped && !ref)) {
+	if (unlikely(!ref && __atomic_load_n(&client->dropped, __ATOMIC_SEQ_CST) &&
+		     __claim_instance(client))) {
 		dropped = true;
+		ck_wlock(&sdata->instance_lock);
 		__drop_client(sdata, client, true, &msg);
+		ck_wunlock(&sdata->instance_lock);
 		if (msg)
 			add_msg_entry(&entries, &msg);
 	}
-	ck_wunlock(&sdata->instance_lock);
 
 	if (entries)
 		notice_msg_entries(&entries);
@@ -3342,8 +4169,6 @@ static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const
 		reap_proxies(sdata->ckp, sdata);
 }
 
-#define dec_instance_ref(sdata, instance) _dec_instance_ref(sdata, instance, __FILE__, __func__, __LINE__)
-
 /* If we have a no longer used stratum instance in the recycled linked list,
  * use that, otherwise calloc a fresh one. */
 static stratum_instance_t *__recruit_stratum_instance(sdata_t *sdata)
@@ -3413,7 +4238,10 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 	}
 
 	ck_wlock(&sdata->instance_lock);
+	/* Allow references to be taken once it's fully set up */
+	__atomic_store_n(&client->ref, 0, __ATOMIC_RELEASE);
 	HASH_ADD_I64(sdata->stratum_instances, id, client);
+	__add_instance_slot(sdata, client);
 	return client;
 }
 
@@ -3455,23 +4283,25 @@ static inline bool remote_server(stratum_instance_t *client)
  * client no longer exists. */
 static void connector_test_client(ckpool_t *ckp, const int64_t id)
 {
-	char buf[256];
-
 	LOGDEBUG("Stratifier requesting connector test client %"PRId64, id);
-	snprintf(buf, 255, "testclient=%"PRId64, id);
-	send_proc(ckp->connector, buf);
+	bus_send(ckp->connector, BUS_TESTCLIENT, id);
 }
 
 /* For creating a list of sends without locking that can then be concatenated
  * to the stratum_sends list. Minimises locking and avoids taking recursive
- * locks. Sends only to sdata bound clients (everyone in ckpool) */
+ * locks. Sends only to sdata bound clients (everyone in ckpool). Directly
+ * connected clients all share the one serialised message, while subclients
+ * each need their own copy with node.method set. */
 static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 {
 	ckpool_t *ckp = sdata->ckp;
 	sdata_t *ckp_sdata = ckp->sdata;
 	stratum_instance_t *client, *tmp;
+	int64_t *client_ids = NULL;
 	ckmsg_t *bulk_send = NULL;
-	int messages = 0;
+	int clients = 0;
+	ckmsg_t *client_msg;
+	smsg_t *msg;
 
 	if (unlikely(!val)) {
 		LOGERR("Sent null json to stratum_broadcast");
@@ -3485,9 +4315,6 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 
 	ck_rlock(&ckp_sdata->instance_lock);
 	HASH_ITER(hh, ckp_sdata->stratum_instances, client, tmp) {
-		ckmsg_t *client_msg;
-		smsg_t *msg;
-
 		if (sdata != ckp_sdata && client->sdata != sdata)
 			continue;
 
@@ -3498,30 +4325,46 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 		if (msg_type == SM_MSG && !client->messages)
 			continue;
 
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
-		if (subclient(client->id))
-			json_set_string(val, "node.method", stratum_msgs[msg_type]);
+		if (!subclient(client->id)) {
+			if (unlikely(!client_ids))
+				client_ids = ckalloc(sizeof(int64_t) * HASH_COUNT(ckp_sdata->stratum_instances));
+			client_ids[clients++] = client->id;
+			continue;
+		}
+
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
 		msg->json_msg = json_deep_copy(val);
+		json_set_string(msg->json_msg, "node.method", stratum_msgs[msg_type]);
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
-		messages++;
 	}
 	ck_runlock(&ckp_sdata->instance_lock);
 
+	if (clients) {
+		client_msg = slab_alloc(&ckmsg_slab);
+		msg = slab_zalloc(&smsg_slab);
+		msg->buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
+		msg->client_ids = client_ids;
+		msg->clients = clients;
+		client_msg->data = msg;
+		DL_PREPEND(bulk_send, client_msg);
+	}
 	json_decref(val);
 
 	if (likely(bulk_send))
-		ssend_bulk_append(sdata, bulk_send, messages);
+		ssend_list(ckp, bulk_send);
 }
 
+/* Messages to single clients are serialised by the calling thread and queued
+ * straight to the client's connection, as are broadcasts with ssend_list, so
+ * every client gets its messages in the order they were generated. */
 static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
 			     const int msg_type)
 {
 	ckpool_t *ckp = sdata->ckp;
 	int64_t remote_id;
-	smsg_t *msg;
 
 	if (ckp->node) {
 		/* Node shouldn't be sending any messages as it only uses the
@@ -3544,13 +4387,7 @@ static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_i
 		dec_instance_ref(sdata, remote);
 	}
 	LOGDEBUG("Sending stratum message %s", stratum_msgs[msg_type]);
-	msg = ckzalloc(sizeof(smsg_t));
-	msg->json_msg = val;
-	msg->client_id = client_id;
-	if (likely(ckmsgq_add(sdata->ssends, msg)))
-		return;
-	json_decref(msg->json_msg);
-	free(msg);
+	connector_send_client(ckp, client_id, val);
 }
 
 static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
@@ -3567,12 +4404,12 @@ static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
 		__disconnect_session(sdata, client);
 		/* If the client is still holding a reference, don't drop them
 		 * now but wait till the reference is dropped */
-		if (!client->ref) {
+		__set_dropped(client);
+		if (__claim_instance(client)) {
 			__drop_client(sdata, client, false, &msg);
 			if (msg)
 				add_msg_entry(&entries, &msg);
-		} else
-			client->dropped = true;
+		}
 	}
 	ck_wunlock(&sdata->instance_lock);
 
@@ -3836,27 +4673,13 @@ static void broadcast_ping(sdata_t *sdata)
 	stratum_broadcast(sdata, json_msg, SM_PING);
 }
 
-static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
-{
-	int64_t memsize, generated;
-	ckmsg_t *msg;
-	int objects;
-
-	mutex_lock(ckmsgq->lock);
-	DL_COUNT(ckmsgq->msgs, msg, objects);
-	generated = ckmsgq->messages;
-	mutex_unlock(ckmsgq->lock);
-
-	memsize = (sizeof(ckmsg_t) + size) * objects;
-	JSON_CPACK(*val, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
-}
-
 char *stratifier_stats(ckpool_t *ckp, void *data)
 {
 	json_t *val = json_object(), *subval;
 	int64_t memsize, generated;
+	workbase_t *wb, *tmpwb;
 	sdata_t *sdata = data;
-	int objects;
+	int objects, i;
 	char *buf;
 
 	ck_rlock(&sdata->workbase_lock);
@@ -3896,6 +4719,7 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 
 	objects = HASH_COUNT(sdata->stratum_instances);
 	memsize = SAFE_HASH_OVERHEAD(sdata->stratum_instances);
+	memsize += sizeof(instance_slot_t) * INSTANCE_SLOTS;
 	generated = sdata->stratum_generated;
 	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "clients", subval);
@@ -3908,15 +4732,33 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_set_object(val, "disconnected", subval);
 	ck_runlock(&sdata->instance_lock);
 
-	mutex_lock(&sdata->share_lock);
 	generated = sdata->shares_generated;
-	objects = HASH_COUNT(sdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(sdata->shares) + sizeof(share_t) * objects;
-	mutex_unlock(&sdata->share_lock);
+	objects = memsize = 0;
+	ck_rlock(&sdata->workbase_lock);
+	HASH_ITER(hh, sdata->workbases, wb, tmpwb) {
+		if (!wb->shares)
+			continue;
+		memsize += sizeof(sharetable_t);
+		for (i = 0; i < SHARE_STRIPES; i++) {
+			share_stripe_t *stripe = &wb->shares->stripes[i];
+
+			mutex_lock(&stripe->lock);
+			objects += stripe->count;
+			memsize += stripe->size * 32;
+			mutex_unlock(&stripe->lock);
+		}
+	}
+	ck_runlock(&sdata->workbase_lock);
 
 	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "shares", subval);
 
+	if (ckp->logshares) {
+		objects = __atomic_load_n(&sdata->open_sharelogs, __ATOMIC_RELAXED);
+		JSON_CPACK(subval, "{si}", "open", objects);
+		json_set_object(val, "sharelogs", subval);
+	}
+
 	ck_rlock(&sdata->txn_lock);
 	objects = HASH_COUNT(sdata->txns);
 	memsize = SAFE_HASH_OVERHEAD(sdata->txns) + sizeof(txntable_t) * objects;
@@ -3925,13 +4767,19 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_set_object(val, "transactions", subval);
 	ck_runlock(&sdata->txn_lock);
 
-	ckmsgq_stats(sdata->ssends, sizeof(smsg_t), &subval);
-	json_set_object(val, "ssends", subval);
 	/* Don't know exactly how big the string is so just count the pointer for now */
 	ckmsgq_stats(sdata->srecvs, sizeof(char *), &subval);
 	json_set_object(val, "srecvs", subval);
 	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval);
 	json_set_object(val, "stxnq", subval);
+	ckmsgq_stats(sdata->sshareq, sizeof(submit_msg_t), &subval);
+	json_set_object(val, "sshareq", subval);
+	if (sdata->sharelogq) {
+		ckmsgq_stats(sdata->sharelogq, sizeof(sharelog_msg_t), &subval);
+		json_set_object(val, "sharelogq", subval);
+	}
+	bus_stats(&ckp->stratifier, &subval);
+	json_set_object(val, "bus", subval);
 
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
@@ -4505,6 +5353,36 @@ static void get_uptime(sdata_t *sdata, int *sockd)
 	send_api_response(val, *sockd);
 }
 
+/* Handle typed messages from the other processes, once we're ready to */
+void stratifier_bus(ckpool_t *ckp, bus_msg_t *msg)
+{
+	sdata_t *sdata;
+
+	while (unlikely(!ckp->stratifier_ready))
+		cksleep_ms(10);
+	sdata = ckp->sdata;
+
+	switch (msg->op) {
+		case BUS_DROPCLIENT:
+			drop_client(ckp, sdata, msg->id);
+			break;
+		case BUS_RECONNCLIENT:
+			reconnect_client_id(sdata, msg->id);
+			break;
+		default:
+			LOGWARNING("Unhandled stratifier bus op %d", msg->op);
+			break;
+	}
+	slab_free(&bus_msg_slab, msg);
+}
+
+/* The client a received message is from, keeping each client's messages on
+ * one srecvs thread */
+static int64_t recv_client_id(json_t *val)
+{
+	return json_integer_value(json_object_get(val, "client_id"));
+}
+
 static void stratum_loop(ckpool_t *ckp, proc_instance_t *pi)
 {
 	sdata_t *sdata = ckp->sdata;
@@ -4513,11 +5391,7 @@ static void stratum_loop(ckpool_t *ckp, proc_instance_t *pi)
 	char *buf;
 
 retry:
-	if (umsg) {
-		Close(umsg->sockd);
-		free(umsg->buf);
-		dealloc(umsg);
-	}
+	clear_unix_msg(&umsg);
 
 	do {
 		time_t end_t;
@@ -4544,8 +5418,8 @@ retry:
 		json_t *val = json_loads(buf, JSON_DISABLE_EOF_CHECK, NULL);
 
 		/* This is a message for a node */
-		if (likely(val))
-			ckmsgq_add(sdata->srecvs, val);
+		if (likely(val) && unlikely(!ckmsgq_add_key(sdata->srecvs, val, recv_client_id(val))))
+			json_decref(val);
 		goto retry;
 	}
 	if (cmdmatch(buf, "ping")) {
@@ -5439,14 +6313,17 @@ static void client_auth(ckpool_t *ckp, stratum_instance_t *client, user_instance
 	client->authorising = false;
 }
 
-static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user, const bool clean);
+static json_t *__user_notify(const workbase_t *wb, const struct userwb *userwb, const bool clean);
 
-static void update_solo_client(sdata_t *sdata, workbase_t *wb, const int64_t client_id,
-				 user_instance_t *user_instance)
+/* Send client a notify with its userwb for wb, passing our ref to userwb on
+ * to the client's cache. */
+static void update_solo_client(sdata_t *sdata, workbase_t *wb, stratum_instance_t *client,
+			       struct userwb *userwb)
 {
-	json_t *json_msg = __user_notify(wb, user_instance, true);
+	json_t *json_msg = __user_notify(wb, userwb, true);
 
-	stratum_add_send(sdata, json_msg, client_id, SM_UPDATE);
+	client_cache_userwb(client, userwb);
+	stratum_add_send(sdata, json_msg, client->id, SM_UPDATE);
 }
 
 /* Needs to be entered with client holding a ref count. */
@@ -5528,23 +6405,20 @@ static json_t *parse_authorise(stratum_instance_t *client, const json_t *params_
 out:
 	if (ckp->btcsolo && ret && !client->remote) {
 		sdata_t *sdata = ckp->sdata;
+		struct userwb *userwb;
 		workbase_t *wb;
 
 		/* To avoid grabbing recursive lock */
-		ck_wlock(&sdata->workbase_lock);
-		wb = sdata->current_workbase;
-		wb->readcount++;
-		ck_wunlock(&sdata->workbase_lock);
+		wb = get_current_workbase(sdata);
 
 		ck_wlock(&sdata->instance_lock);
-		__generate_userwb(sdata, wb, user);
+		userwb = __generate_userwb(sdata, wb, user);
+		__sync_add_and_fetch(&userwb->ref, 1);
 		ck_wunlock(&sdata->instance_lock);
 
-		update_solo_client(sdata, wb, client->id, user);
+		update_solo_client(sdata, wb, client, userwb);
 
-		ck_wlock(&sdata->workbase_lock);
-		wb->readcount--;
-		ck_wunlock(&sdata->workbase_lock);
+		put_workbase(sdata, wb);
 
 		stratum_send_diff(sdata, client);
 	}
@@ -5584,6 +6458,37 @@ static double time_bias(const double tdiff, const double period)
 	return 1.0 - 1.0 / exp(dexp);
 }
 
+static int uastats_threads;
+static __thread uastats_t *uastats_slot;
+
+static void add_uastats(sdata_t *sdata, const double diff, const bool valid)
+{
+	uastats_t *slot = uastats_slot;
+
+	if (unlikely(!slot))
+		slot = uastats_slot = &sdata->uastats[__sync_fetch_and_add(&uastats_threads, 1) % UASTATS_SLOTS];
+	if (valid) {
+		__sync_fetch_and_add(&slot->shares, 1);
+		__sync_fetch_and_add(&slot->diff_shares, (int64_t)diff);
+	} else
+		__sync_fetch_and_add(&slot->rejects, (int64_t)diff);
+}
+
+/* Collect and reset the unaccounted stats from all the slots */
+static void fold_uastats(sdata_t *sdata, int64_t *shares, int64_t *diff_shares, int64_t *rejects)
+{
+	int i;
+
+	*shares = *diff_shares = *rejects = 0;
+	for (i = 0; i < UASTATS_SLOTS; i++) {
+		uastats_t *slot = &sdata->uastats[i];
+
+		*shares += __sync_lock_test_and_set(&slot->shares, 0);
+		*diff_shares += __sync_lock_test_and_set(&slot->diff_shares, 0);
+		*rejects += __sync_lock_test_and_set(&slot->rejects, 0);
+	}
+}
+
 /* Needs to be entered with client holding a ref count. */
 static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double diff, const bool valid,
 		       const bool submit)
@@ -5595,30 +6500,22 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 	int64_t next_blockid, optimal, mindiff;
 	tv_t now_t;
 
-	mutex_lock(&ckp_sdata->uastats_lock);
-	if (valid) {
-		ckp_sdata->stats.unaccounted_shares++;
-		ckp_sdata->stats.unaccounted_diff_shares += diff;
-	} else
-		ckp_sdata->stats.unaccounted_rejects += diff;
-	mutex_unlock(&ckp_sdata->uastats_lock);
+	add_uastats(ckp_sdata, diff, valid);
 
-	/* Count only accepted and stale rejects in diff calculation. */
+	/* Count only accepted and stale rejects in diff calculation. Shares
+	 * from different clients of the same user can be processed
+	 * concurrently. */
 	if (valid) {
-		worker->shares += diff;
-		user->shares += diff;
+		__sync_fetch_and_add(&worker->shares, (int64_t)diff);
+		__sync_fetch_and_add(&user->shares, (int64_t)diff);
 	} else if (!submit)
 		return;
 
 	tv_time(&now_t);
 
-	ck_rlock(&sdata->workbase_lock);
+	/* Neither of these are critical values so we read them unlocked */
 	next_blockid = sdata->workbase_id + 1;
-	if (ckp->proxy)
-		network_diff = sdata->current_workbase->diff;
-	else
-		network_diff = sdata->current_workbase->network_diff;
-	ck_runlock(&sdata->workbase_lock);
+	network_diff = sdata->current_diff;
 
 	if (unlikely(!client->first_share.tv_sec)) {
 		copy_tv(&client->first_share, &now_t);
@@ -5724,7 +6621,7 @@ downstream_block(ckpool_t *ckp, sdata_t *sdata, const json_t *val, const int cbl
 	/* Strip unnecessary fields and add extra fields needed */
 	json_set_string(block_val, "method", stratum_msgs[SM_BLOCK]);
 	add_remote_blockdata(ckp, block_val, cblen, coinbase, data);
-	downstream_json(sdata, block_val, 0, SSEND_PREPEND);
+	downstream_json(sdata, block_val, 0);
 	json_decref(block_val);
 }
 
@@ -5822,102 +6719,324 @@ out_nouserwb:
 	return wb->coinb2bin;
 }
 
-/* Needs to be entered with workbase readcount and client holding a ref count. */
-static double submission_diff(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
-			      const char *nonce2, const uint32_t ntime32, uint32_t version_mask,
-			      const char *nonce, uchar *hash, const bool stale)
+/* Fill in ctx with the coinbase hashed up to the end of the client's enonce1.
+ * Where enonce1 completes one or more sha256 blocks beyond the coinb1 midstate
+ * we cache the resulting midstate per client and workbase. The cache is only
+ * ever trylocked so concurrent share threads never wait on each other. */
+static void client_coinbase_ctx(stratum_instance_t *client, const workbase_t *wb, sha256_ctx *ctx)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32, benonce32;
-	char *coinbase, data[80];
-	uchar swap[80], hash1[32];
-	int cblen, i, cb2len;
+	int enonce1len = wb->enonce1constlen + wb->enonce1varlen;
+
+	memcpy(ctx, &wb->coinb1ctx, sizeof(sha256_ctx));
+	if (wb->coinb1ctx.len + enonce1len < SHA256_BLOCK_SIZE ||
+	    __sync_lock_test_and_set(&client->midstate_busy, 1)) {
+		sha256_update(ctx, client->enonce1bin, enonce1len);
+		return;
+	}
+	if (client->midstate_id == wb->id &&
+	    !memcmp(client->midstate_enonce1, client->enonce1bin, enonce1len))
+		memcpy(ctx, &client->midstate, sizeof(sha256_ctx));
+	else {
+		sha256_update(ctx, client->enonce1bin, enonce1len);
+		memcpy(&client->midstate, ctx, sizeof(sha256_ctx));
+		memcpy(client->midstate_enonce1, client->enonce1bin, enonce1len);
+		client->midstate_id = wb->id;
+	}
+	__sync_lock_release(&client->midstate_busy);
+}
+
+/* The binary coinbase and header of a share submission along with its hash,
+ * allowing the hashing to be done in batches ahead of share processing. */
+typedef struct submission {
+	/* Workbase held with a readcount for batch submissions */
+	workbase_t *wb;
+
+	/* The data the binaries were generated from */
+	char nonce2[36];
+	char nonce[12];
+	uint32_t ntime32;
+	uint32_t version_mask;
+
+	char *coinbase;
+	int cblen;
+	int ofs; /* Offset in coinbase of data not yet hashed into ctx */
+	sha256_ctx ctx;
+	char data[80]; /* Header without the merkle root */
+	uchar swap[80];
+	uchar hash[32];
+	bool hashed;
+} submission_t;
+
+/* The string params of a mining.submit, pointing into either its json or the
+ * fields decoded by the connector */
+typedef struct submit_args {
+	const char *workername;
+	const char *job_id;
+	const char *nonce2;
+	const char *ntime;
+	const char *nonce;
+	const char *version_mask;
+	enum share_err err;
+} submit_args_t;
+
+static void get_submit_args(const submit_msg_t *share, submit_args_t *args)
+{
+	const json_t *params_val;
+
+	memset(args, 0, sizeof(submit_args_t));
+	args->err = SE_NONE;
+	if (!share->jp) {
+		args->workername = share->workername;
+		args->job_id = share->job_id;
+		args->nonce2 = share->nonce2;
+		args->ntime = share->ntime;
+		args->nonce = share->nonce;
+		if (share->params > 5)
+			args->version_mask = share->version_mask;
+		return;
+	}
+	params_val = share->jp->params;
+	if (unlikely(!json_is_array(params_val))) {
+		args->err = SE_NOT_ARRAY;
+		return;
+	}
+	if (unlikely(json_array_size(params_val) < 5)) {
+		args->err = SE_INVALID_SIZE;
+		return;
+	}
+	args->workername = json_string_value(json_array_get(params_val, 0));
+	args->job_id = json_string_value(json_array_get(params_val, 1));
+	args->nonce2 = json_string_value(json_array_get(params_val, 2));
+	args->ntime = json_string_value(json_array_get(params_val, 3));
+	args->nonce = json_string_value(json_array_get(params_val, 4));
+	args->version_mask = json_string_value(json_array_get(params_val, 5));
+}
+
+/* Size of the coinbase buffer required for submissions on wb. Leave enough
+ * room for 25 byte generation address + length counter */
+static inline int submission_cblen(const workbase_t *wb)
+{
+	return wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen +
+		wb->coinb2len + 26 + wb->coinb3len;
+}
+
+/* Generate the coinbase and header binaries of a submission, hashing only as
+ * far as the cached coinbase midstate. sub->coinbase needs to be at least
+ * submission_cblen() long. Needs to be entered with workbase readcount and
+ * client holding a ref count. */
+static void prepare_submission(sdata_t *sdata, stratum_instance_t *client, const workbase_t *wb,
+			       const char *nonce2, const uint32_t ntime32, uint32_t version_mask,
+			       const char *nonce, submission_t *sub)
+{
+	uint32_t *data32, benonce32;
+	char *coinbase = sub->coinbase;
 	uchar *coinb2bin;
-	double ret;
+	int cblen, cb2len;
 
-	/* Leave enough room for 25 byte generation address + length counter */
-	coinbase = alloca(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len + 26 + wb->coinb3len);
 	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
 	cblen = wb->coinb1len;
 	memcpy(coinbase + cblen, &client->enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
 	cblen += wb->enonce1constlen + wb->enonce1varlen;
+	sub->ofs = cblen;
 	hex2bin(coinbase + cblen, nonce2, wb->enonce2varlen);
 	cblen += wb->enonce2varlen;
 
-	ck_rlock(&sdata->instance_lock);
-	coinb2bin = __user_coinb2(client, wb, &cb2len);
-	memcpy(coinbase + cblen, coinb2bin, cb2len);
-	ck_runlock(&sdata->instance_lock);
+	/* Btcsolo clients normally have the coinb2 of the notify they were
+	 * sent cached, sparing us the instance lock */
+	if (!client->ckp->btcsolo) {
+		cb2len = wb->coinb2len;
+		memcpy(coinbase + cblen, wb->coinb2bin, cb2len);
+	} else if ((cb2len = client_cached_coinb2(client, wb, coinbase + cblen)) < 0) {
+		ck_rlock(&sdata->instance_lock);
+		coinb2bin = __user_coinb2(client, wb, &cb2len);
+		memcpy(coinbase + cblen, coinb2bin, cb2len);
+		ck_runlock(&sdata->instance_lock);
+	}
 
 	cblen += cb2len;
+	sub->cblen = cblen;
 
-	gen_hash((uchar *)coinbase, merkle_root, cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip_32(swap32, data32);
+	/* Start from the cached midstate so only nonce2 and coinb2 are left */
+	client_coinbase_ctx(client, wb, &sub->ctx);
 
-	/* Copy the cached header binary and insert the merkle root */
-	memcpy(data, wb->headerbin, 80);
-	memcpy(data + 36, merkle_root, 32);
+	/* Copy the cached header binary, the merkle root is inserted once the
+	 * coinbase is hashed */
+	memcpy(sub->data, wb->headerbin, 80);
 
 	/* Update nVersion when version_mask is in use */
 	if (version_mask) {
 		version_mask = htobe32(version_mask);
-		data32 = (uint32_t *)data;
+		data32 = (uint32_t *)sub->data;
 		*data32 |= version_mask;
 	}
 
 	/* Insert the nonce value into the data */
 	hex2bin(&benonce32, nonce, 4);
-	data32 = (uint32_t *)(data + 64 + 12);
+	data32 = (uint32_t *)(sub->data + 64 + 12);
 	*data32 = benonce32;
 
 	/* Insert the ntime value into the data */
-	data32 = (uint32_t *)(data + 68);
+	data32 = (uint32_t *)(sub->data + 68);
 	*data32 = htobe32(ntime32);
+}
 
-	/* Hash the share */
-	data32 = (uint32_t *)data;
-	swap32 = (uint32_t *)swap;
+/* Insert the merkle root into the header and flip it ready for hashing */
+static void submission_header(submission_t *sub, const uchar *merkle_sha)
+{
+	uint32_t *data32, *swap32;
+	uchar merkle_root[32];
+
+	data32 = (uint32_t *)merkle_sha;
+	swap32 = (uint32_t *)merkle_root;
+	flip_32(swap32, data32);
+	memcpy(sub->data + 36, merkle_root, 32);
+
+	data32 = (uint32_t *)sub->data;
+	swap32 = (uint32_t *)sub->swap;
 	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, hash);
+}
+
+static void hash_submission(const workbase_t *wb, submission_t *sub)
+{
+	unsigned char merkle_root[32], merkle_sha[64];
+	int i;
+
+	coinbase_hash(&sub->ctx, (uchar *)sub->coinbase + sub->ofs, sub->cblen - sub->ofs, merkle_root);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < wb->merkles; i++) {
+		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+	submission_header(sub, merkle_sha);
+
+	/* Hash the share */
+	gen_hash(sub->swap, sub->hash, 80);
+	sub->hashed = true;
+}
+
+/* As hash_submission but for an array of prepared submissions, hashing their
+ * coinbases, merkle branches and headers in parallel lanes. */
+static void hash_submissions(submission_t **subs, const int count)
+{
+	const unsigned char *msg[SHA256_LANES];
+	unsigned char *digest[SHA256_LANES];
+	sha256_ctx ctxs[SHA256_LANES], *ctx[SHA256_LANES];
+	uchar merkle_sha[SHA256_LANES][64], hash1[SHA256_LANES][32];
+	unsigned int len[SHA256_LANES];
+	int base, i, l, n, lanes, merkles;
+
+	for (base = 0; base < count; base += SHA256_LANES) {
+		submission_t **sub = subs + base;
+
+		n = MIN(SHA256_LANES, count - base);
+
+		/* Coinbase from each submission's midstate */
+		for (l = 0; l < n; l++) {
+			ctx[l] = &sub[l]->ctx;
+			msg[l] = (uchar *)sub[l]->coinbase + sub[l]->ofs;
+			len[l] = sub[l]->cblen - sub[l]->ofs;
+			digest[l] = hash1[l];
+		}
+		sha256_lanes(ctx, msg, len, digest, n);
+		for (l = 0; l < n; l++) {
+			sha256_init(&ctxs[l]);
+			ctx[l] = &ctxs[l];
+			msg[l] = hash1[l];
+			len[l] = 32;
+			digest[l] = merkle_sha[l];
+		}
+		sha256_lanes(ctx, msg, len, digest, n);
+
+		/* Merkle branches, which may differ in length across
+		 * workbases */
+		merkles = 0;
+		for (l = 0; l < n; l++)
+			merkles = MAX(merkles, sub[l]->wb->merkles);
+		for (i = 0; i < merkles; i++) {
+			for (l = lanes = 0; l < n; l++) {
+				if (i >= sub[l]->wb->merkles)
+					continue;
+				memcpy(merkle_sha[l] + 32, &sub[l]->wb->merklebin[i], 32);
+				msg[lanes] = merkle_sha[l];
+				len[lanes] = 64;
+				digest[lanes++] = hash1[l];
+			}
+			sha256d_lanes(msg, len, digest, lanes);
+			for (l = 0; l < n; l++) {
+				if (i < sub[l]->wb->merkles)
+					memcpy(merkle_sha[l], hash1[l], 32);
+			}
+		}
+
+		/* Headers */
+		for (l = 0; l < n; l++) {
+			submission_header(sub[l], merkle_sha[l]);
+			msg[l] = sub[l]->swap;
+			len[l] = 80;
+			digest[l] = sub[l]->hash;
+			sub[l]->hashed = true;
+		}
+		sha256d_lanes(msg, len, digest, n);
+	}
+}
+
+/* Needs to be entered with workbase readcount and client holding a ref count.
+ * Uses the hash of sub if it has already been hashed. */
+static double submission_diff(sdata_t *sdata, stratum_instance_t *client, const workbase_t *wb,
+			      const char *nonce2, const uint32_t ntime32, uint32_t version_mask,
+			      const char *nonce, uchar *hash, const bool stale, submission_t *sub)
+{
+	submission_t local;
+	double ret;
+
+	if (!sub || !sub->hashed) {
+		sub = &local;
+		sub->coinbase = alloca(submission_cblen(wb));
+		prepare_submission(sdata, client, wb, nonce2, ntime32, version_mask, nonce, sub);
+		hash_submission(wb, sub);
+	}
+	memcpy(hash, sub->hash, 32);
+	if (version_mask)
+		version_mask = htobe32(version_mask);
 
 	/* Calculate the diff of the share here */
 	ret = diff_from_target(hash);
 
 	/* Test we haven't solved a block regardless of share status */
-	test_blocksolve(client, wb, swap, hash, ret, coinbase, cblen, nonce2, nonce, ntime32, version_mask, stale);
+	test_blocksolve(client, wb, sub->swap, hash, ret, sub->coinbase, sub->cblen, nonce2, nonce,
+			ntime32, version_mask, stale);
 
 	return ret;
 }
 
-/* Optimised for the common case where shares are new */
-static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
+/* Optimised for the common case where shares are new. Must be entered with
+ * wb held with a readcount. */
+static bool new_share(sdata_t *sdata, workbase_t *wb, const uchar *hash)
 {
-	share_t *share = ckzalloc(sizeof(share_t)), *match = NULL;
+	const uint64_t key = share_key(hash);
+	share_stripe_t *stripe;
 	bool ret = true;
+	uchar *slot;
 
-	memcpy(share->hash, hash, 32);
-	share->workbase_id = wb_id;
-
-	mutex_lock(&sdata->share_lock);
-	sdata->shares_generated++;
-	HASH_FIND(hh, sdata->shares, hash, 32, match);
-	if (likely(!match))
-		HASH_ADD(hh, sdata->shares, hash, 32, share);
-	mutex_unlock(&sdata->share_lock);
-
-	if (unlikely(match)) {
-		dealloc(share);
+	__sync_fetch_and_add(&sdata->shares_generated, 1);
+	/* A share hash with a zero key can't be stored, but is as likely as
+	 * a duplicate sha256 */
+	if (unlikely(!key || !wb->shares))
+		return ret;
+	stripe = &wb->shares->stripes[key % SHARE_STRIPES];
+
+	mutex_lock(&stripe->lock);
+	if (unlikely(stripe->count >= stripe->size / 2))
+		__grow_stripe(stripe);
+	slot = __stripe_slot(stripe, hash, key);
+	if (likely(!share_key(slot))) {
+		memcpy(slot, hash, 32);
+		stripe->count++;
+	} else
 		ret = false;
-	}
+	mutex_unlock(&stripe->lock);
+
 	return ret;
 }
 
@@ -5978,18 +7097,114 @@ static void check_best_diff(sdata_t *sdata, user_instance_t *user,worker_instanc
 	stratum_send_message(sdata, client, buf);
 }
 
-#define JSON_ERR(err) json_string(SHARE_ERR(err))
+#define JSON_ERR(err) json_string(SHARE_ERR(err))
+
+/* Are there any sinks wanting a record of every share */
+static inline bool share_recorded(const ckpool_t *ckp)
+{
+	const sdata_t *sdata = ckp->sdata;
+
+	return sdata->share_sinks;
+}
+
+/* Add a sink to be handed every share. Only called before the stratifier is
+ * ready as the list is walked without locking. */
+static void register_share_sink(sdata_t *sdata, share_sink_t *sink)
+{
+	LL_APPEND(sdata->share_sinks, sink);
+	if (sink->json)
+		sdata->json_sinks++;
+	LOGNOTICE("Recording shares to %s", sink->name);
+}
+
+static json_t *share_record_json(ckpool_t *ckp, const stratum_instance_t *client,
+				 const share_record_t *rec)
+{
+	char cdfield[64];
+	json_t *val;
+
+	sprintf(cdfield, "%lu,%lu", rec->now->tv_sec, rec->now->tv_nsec);
+	val = json_object();
+	json_set_int(val, "workinfoid", rec->id);
+	if (ckp->remote)
+		json_set_int64(val, "clientid", client->virtualid);
+	else
+		json_set_int64(val, "clientid", client->id);
+	json_set_string(val, "enonce1", client->enonce1);
+	json_set_string(val, "nonce2", rec->nonce2);
+	json_set_string(val, "nonce", rec->nonce);
+	json_set_string(val, "ntime", rec->ntime);
+	json_set_double(val, "diff", rec->diff);
+	json_set_double(val, "sdiff", rec->sdiff);
+	json_set_string(val, "hash", rec->hexhash);
+	json_set_bool(val, "result", rec->result);
+	json_object_set(val, "reject-reason", rec->reject);
+	json_object_set(val, "error", rec->error);
+	json_set_int(val, "errn", rec->errn);
+	json_set_string(val, "createdate", cdfield);
+	json_set_string(val, "createby", "code");
+	json_set_string(val, "createcode", "parse_submit");
+	json_set_string(val, "createinet", ckp->serverurl[client->server]);
+	json_set_string(val, "workername", client->workername);
+	json_set_string(val, "username", client->user_instance->username);
+	json_set_string(val, "address", client->address);
+	json_set_string(val, "agent", client->useragent);
+	return val;
+}
+
+static void sharelog_record(ckpool_t *ckp, const stratum_instance_t __maybe_unused *client,
+			    share_record_t *rec, json_t *val)
+{
+	queue_sharelog(ckp, rec->id, rec->fname, val);
+	rec->fname = NULL;
+}
+
+static void sharelog_bin_record(ckpool_t *ckp, const stratum_instance_t *client,
+				share_record_t *rec, json_t __maybe_unused *val)
+{
+	queue_sharelog_bin(ckp, client, rec);
+}
+
+/* Adds the method to the shared json so must be registered after any sink
+ * writing the json out as is */
+static void upstream_share_record(ckpool_t *ckp, const stratum_instance_t __maybe_unused *client,
+				  share_record_t __maybe_unused *rec, json_t *val)
+{
+	upstream_json_msgtype(ckp, val, SM_SHARE);
+}
+
+static share_sink_t sharelog_sink = { NULL, "json share log", true, &sharelog_record };
+static share_sink_t sharelog_bin_sink = { NULL, "binary share log", false, &sharelog_bin_record };
+static share_sink_t upstream_share_sink = { NULL, "upstream pool", true, &upstream_share_record };
+
+/* Hand the record of a share to each registered sink, only generating the
+ * json version if a sink needs it. Takes over rec->fname. */
+static void record_share(ckpool_t *ckp, const stratum_instance_t *client, share_record_t *rec)
+{
+	sdata_t *sdata = ckp->sdata;
+	share_sink_t *sink;
+	json_t *val = NULL;
+
+	if (sdata->json_sinks)
+		val = share_record_json(ckp, client, rec);
+	LL_FOREACH(sdata->share_sinks, sink)
+		sink->record(ckp, client, rec, val);
+	free(rec->fname);
+	if (val)
+		json_decref(val);
+}
 
 /* Needs to be entered with client holding a ref count. */
+/* sub is an optional submission already hashed as part of a batch */
 static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
-			    const json_t *params_val, json_t **err_val)
+			    const submit_args_t *args, json_t **err_val, submission_t *sub)
 {
 	bool share = false, result = false, invalid = true, submit = false, stale = false;
 	const char *workername, *job_id, *ntime, *version_mask;
 	double diff = client->diff, wdiff = 0, sdiff = -1;
-	char hexhash[68] = {}, sharehash[32], cdfield[64];
+	char hexhash[68] = {}, sharehash[32];
 	user_instance_t *user = client->user_instance;
-	char *fname = NULL, *s, *nonce, *nonce2;
+	char *fname = NULL, *nonce, *nonce2;
 	uint32_t ntime32, version_mask32 = 0;
 	sdata_t *sdata = client->sdata;
 	enum share_err err = SE_NONE;
@@ -6002,54 +7217,47 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 	json_t *val;
 	int64_t id;
 	ts_t now;
-	FILE *fp;
 
 	ts_realtime(&now);
 	now_t = now.tv_sec;
-	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 
-	if (unlikely(!json_is_array(params_val))) {
-		err = SE_NOT_ARRAY;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	if (unlikely(json_array_size(params_val) < 5)) {
-		err = SE_INVALID_SIZE;
+	if (unlikely(args->err != SE_NONE)) {
+		err = args->err;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	workername = json_string_value(json_array_get(params_val, 0));
+	workername = args->workername;
 	if (unlikely(!workername || !strlen(workername))) {
 		err = SE_NO_USERNAME;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	job_id = json_string_value(json_array_get(params_val, 1));
+	job_id = args->job_id;
 	if (unlikely(!job_id || !strlen(job_id))) {
 		err = SE_NO_JOBID;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
+	nonce2 = (char *)args->nonce2;
 	if (unlikely(!nonce2 || !strlen(nonce2) || !validhex(nonce2))) {
 		err = SE_NO_NONCE2;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	ntime = json_string_value(json_array_get(params_val, 3));
+	ntime = args->ntime;
 	if (unlikely(!ntime || !strlen(ntime) || !validhex(ntime))) {
 		err = SE_NO_NTIME;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	nonce = (char *)json_string_value(json_array_get(params_val, 4));
+	nonce = (char *)args->nonce;
 	if (unlikely(!nonce || strlen(nonce) < 8 || !validhex(nonce))) {
 		err = SE_NO_NONCE;
 		*err_val = JSON_ERR(err);
 		goto out;
 	}
 
-	version_mask = json_string_value(json_array_get(params_val, 5));
+	version_mask = args->version_mask;
 	if (version_mask && strlen(version_mask) && validhex(version_mask)) {
 		sscanf(version_mask, "%x", &version_mask32);
 		// check version mask
@@ -6079,12 +7287,14 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 		err = SE_INVALID_JOBID;
 		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 		strncpy(idstring, job_id, 19);
-		ASPRINTF(&fname, "%s.sharelog", sdata->current_workbase->logdir);
+		if (ckp->logshares)
+			ASPRINTF(&fname, "%s.%s", sdata->current_workbase->logdir, sharelog_suffix(ckp));
 		goto out_nowb;
 	}
 	wdiff = wb->diff;
 	strncpy(idstring, wb->idstring, 20);
-	ASPRINTF(&fname, "%s.sharelog", wb->logdir);
+	if (ckp->logshares)
+		ASPRINTF(&fname, "%s.%s", wb->logdir, sharelog_suffix(ckp));
 	/* Fix broken clients sending too many chars. Nonce2 is part of the
 	 * read only json so use a temporary variable and modify it. */
 	len = wb->enonce2varlen * 2;
@@ -6111,7 +7321,11 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 	}
 	if (id < sdata->blockchange_id)
 		stale = true;
-	sdiff = submission_diff(sdata, client, wb, nonce2, ntime32, version_mask32, nonce, hash, stale);
+	/* Only use a batch hashed submission generated from the same data */
+	if (sub && (sub->wb != wb || sub->ntime32 != ntime32 || sub->version_mask != version_mask32 ||
+		    strcmp(sub->nonce2, nonce2) || strcmp(sub->nonce, nonce)))
+		sub = NULL;
+	sdiff = submission_diff(sdata, client, wb, nonce2, ntime32, version_mask32, nonce, hash, stale, sub);
 	if (sdiff > client->best_diff) {
 		worker_instance_t *worker = client->worker_instance;
 
@@ -6154,7 +7368,6 @@ out_submit:
 	if (sdiff >= wdiff)
 		submit = true;
 out_put:
-	put_workbase(sdata, wb);
 out_nowb:
 
 	/* Accept shares of the old diff until the next update */
@@ -6165,7 +7378,7 @@ out_nowb:
 
 		suffix_string(wdiff, wdiffsuffix, 16, 0);
 		if (sdiff >= diff) {
-			if (new_share(sdata, hash, id)) {
+			if (new_share(sdata, wb, hash)) {
 				LOGINFO("Accepted client %s share diff %.1f/%.0f/%s: %s",
 					client->identity, sdiff, diff, wdiffsuffix, hexhash);
 				result = true;
@@ -6192,52 +7405,21 @@ out_nowb:
 		LOGINFO("Submitting share upstream: %s", hexhash);
 		submit_share(client, id, nonce2, ntime, nonce);
 	}
-
 	add_submit(ckp, client, diff, result, submit);
 
-	/* Now write to the pool's sharelog. */
-	val = json_object();
-	json_set_int(val, "workinfoid", id);
-	if (ckp->remote)
-		json_set_int64(val, "clientid", client->virtualid);
-	else
-		json_set_int64(val, "clientid", client->id);
-	json_set_string(val, "enonce1", client->enonce1);
-	json_set_string(val, "nonce2", nonce2);
-	json_set_string(val, "nonce", nonce);
-	json_set_string(val, "ntime", ntime);
-	json_set_double(val, "diff", diff);
-	json_set_double(val, "sdiff", sdiff);
-	json_set_string(val, "hash", hexhash);
-	json_set_bool(val, "result", result);
-	json_object_set(val, "reject-reason", json_object_get(json_msg, "reject-reason"));
-	json_object_set(val, "error", *err_val);
-	json_set_int(val, "errn", err);
-	json_set_string(val, "createdate", cdfield);
-	json_set_string(val, "createby", "code");
-	json_set_string(val, "createcode", __func__);
-	json_set_string(val, "createinet", ckp->serverurl[client->server]);
-	json_set_string(val, "workername", client->workername);
-	json_set_string(val, "username", user->username);
-        json_set_string(val, "address", client->address);
-        json_set_string(val, "agent", client->useragent);
+	/* Now write to the pool's sharelog and send upstream */
+	if (share_recorded(ckp)) {
+		share_record_t rec = { id, fname, &now, nonce2, nonce, ntime, diff, sdiff,
+				       hexhash[0] ? sharehash : NULL, hexhash, result,
+				       json_object_get(json_msg, "reject-reason"), *err_val, err };
 
-	if (ckp->logshares) {
-		fp = fopen(fname, "ae");
-		if (likely(fp)) {
-			s = json_dumps(val, JSON_EOL);
-			len = strlen(s);
-			len = fprintf(fp, "%s", s);
-			free(s);
-			fclose(fp);
-			if (unlikely(len < 0))
-				LOGERR("Failed to fwrite to %s", fname);
-		} else
-			LOGERR("Failed to fopen %s", fname);
+		record_share(ckp, client, &rec);
+		fname = NULL;
 	}
-	if (ckp->remote)
-		upstream_json_msgtype(ckp, val, SM_SHARE);
-	json_decref(val);
+	/* Hold the workbase until here for the dupe check and proxy submit,
+	 * and so its share log can't be retired before this share is queued */
+	if (wb)
+		put_workbase(sdata, wb);
 out:
 	if (!sdata->wbincomplete && ((!result && !submit) || !share)) {
 		/* Is this the first in a run of invalids? */
@@ -6267,6 +7449,9 @@ out:
 
 	if (!share) {
 		if (ckp->remote) {
+			char cdfield[64];
+
+			sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 			val = json_object();
 			if (ckp->remote)
 				json_set_int64(val, "clientid", client->virtualid);
@@ -6345,19 +7530,11 @@ static void stratum_send_update(sdata_t *sdata, const int64_t client_id, const b
 	stratum_add_send(sdata, json_msg, client_id, SM_UPDATE);
 }
 
-/* Hold instance and workbase lock */
-static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user, const bool clean)
+/* Hold workbase lock or readcount and a ref to userwb */
+static json_t *__user_notify(const workbase_t *wb, const struct userwb *userwb, const bool clean)
 {
-	int64_t id = wb->id;
-	struct userwb *userwb;
 	json_t *val;
 
-	HASH_FIND_I64(user->userwbs, &id, userwb);
-	if (unlikely(!userwb)) {
-		LOGINFO("Failed to find userwb in __user_notify!");
-		return NULL;
-	}
-
 	JSON_CPACK(val, "{s:[ssssosssb],s:o,s:s}",
 			"params",
 			wb->idstring,
@@ -6374,31 +7551,133 @@ static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user,
 	return val;
 }
 
-/* Sends a stratum update with a unique coinb2 for every client. Avoid
- * recursive locking. */
+/* Marks where coinb2 goes in a serialised notify template since it can't
+ * appear in any of the hex fields around it */
+#define COINB2_SPLICE "\x01"
+#define COINB2_SPLICE_JSON "\\u0001"
+
+/* Serialise the notify for wb once with a placeholder coinb2, splitting it
+ * into the parts before and after coinb2 that are common to every user.
+ * Hold workbase lock or readcount. */
+static bool __user_notify_template(const workbase_t *wb, const bool clean, char **head,
+				   char **tail)
+{
+	struct userwb splice;
+	char *buf, *pos;
+	json_t *val;
+
+	splice.coinb2 = COINB2_SPLICE;
+	val = __user_notify(wb, &splice, clean);
+	buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
+	json_decref(val);
+	if (unlikely(!buf))
+		return false;
+	pos = strstr(buf, COINB2_SPLICE_JSON);
+	if (unlikely(!pos)) {
+		LOGERR("Failed to find coinb2 in notify template");
+		free(buf);
+		return false;
+	}
+	*pos = '\0';
+	*head = buf;
+	*tail = pos + strlen(COINB2_SPLICE_JSON);
+	return true;
+}
+
+/* Sends a stratum update with a unique coinb2 for every user. The notify is
+ * rendered once with each user's coinb2 spliced into the template and shared
+ * by all that user's directly connected clients. Subclients each get their
+ * own json sent once the instance lock is released to avoid recursive
+ * locking. */
 static void stratum_broadcast_updates(sdata_t *sdata, bool clean)
 {
-	stratum_instance_t *client, *tmp;
-	json_t *json_msg;
+	int headlen, taillen;
+	user_instance_t *user, *tmpuser;
+	stratum_instance_t *client;
+	ckmsg_t *bulk_send = NULL;
+	ckmsg_t *subs = NULL, *sub, *tmpsub;
+	char *head, *tail;
+	struct userwb *userwb;
+	workbase_t *wb;
+	int64_t id;
 
-	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		if (!client->user_instance)
+	wb = get_current_workbase(sdata);
+	id = wb->id;
+	if (unlikely(!__user_notify_template(wb, clean, &head, &tail)))
+		goto out;
+	headlen = strlen(head);
+	taillen = strlen(tail);
+
+	ck_rlock(&sdata->instance_lock);
+	HASH_ITER(hh, sdata->user_instances, user, tmpuser) {
+		int64_t *client_ids = NULL;
+		int clients = 0, len, coinb2len;
+		ckmsg_t *client_msg;
+		smsg_t *msg;
+
+		if (!user->clients)
 			continue;
-		__inc_instance_ref(client);
-		ck_wunlock(&sdata->instance_lock);
+		HASH_FIND_I64(user->userwbs, &id, userwb);
+		if (unlikely(!userwb)) {
+			LOGINFO("Failed to find userwb in stratum_broadcast_updates!");
+			continue;
+		}
+		DL_FOREACH2(user->clients, client, user_next) {
+			/* The client's cache takes over its own ref to userwb */
+			__sync_add_and_fetch(&userwb->ref, 1);
+			client_cache_userwb(client, userwb);
+
+			if (subclient(client->id)) {
+				sub = slab_alloc(&ckmsg_slab);
+				msg = slab_zalloc(&smsg_slab);
+				msg->json_msg = __user_notify(wb, userwb, clean);
+				msg->client_id = client->id;
+				sub->data = msg;
+				DL_APPEND(subs, sub);
+				continue;
+			}
+			if (unlikely(!client_ids)) {
+				stratum_instance_t *tmp;
+				int count;
+
+				DL_COUNT2(user->clients, tmp, count, user_next);
+				client_ids = ckalloc(sizeof(int64_t) * count);
+			}
+			client_ids[clients++] = client->id;
+		}
+		if (!clients)
+			continue;
+
+		coinb2len = strlen(userwb->coinb2);
+		len = headlen + coinb2len + taillen;
+		msg = slab_zalloc(&smsg_slab);
+		msg->buf = ckalloc(len + 1);
+		memcpy(msg->buf, head, headlen);
+		memcpy(msg->buf + headlen, userwb->coinb2, coinb2len);
+		memcpy(msg->buf + len - taillen, tail, taillen + 1);
+		msg->client_ids = client_ids;
+		msg->clients = clients;
+		client_msg = slab_alloc(&ckmsg_slab);
+		client_msg->data = msg;
+		DL_APPEND(bulk_send, client_msg);
+	}
+	ck_runlock(&sdata->instance_lock);
+
+	free(head);
 
-		ck_rlock(&sdata->workbase_lock);
-		json_msg = __user_notify(sdata->current_workbase, client->user_instance, clean);
-		ck_runlock(&sdata->workbase_lock);
+	if (likely(bulk_send))
+		ssend_list(sdata->ckp, bulk_send);
 
-		if (likely(json_msg))
-			stratum_add_send(sdata, json_msg, client->id, SM_UPDATE);
+	DL_FOREACH_SAFE(subs, sub, tmpsub) {
+		smsg_t *msg = sub->data;
 
-		ck_wlock(&sdata->instance_lock);
-		__dec_instance_ref(client);
+		DL_DELETE(subs, sub);
+		stratum_add_send(sdata, msg->json_msg, msg->client_id, SM_UPDATE);
+		slab_free(&smsg_slab, msg);
+		slab_free(&ckmsg_slab, sub);
 	}
-	ck_wunlock(&sdata->instance_lock);
+out:
+	put_workbase(sdata, wb);
 }
 
 static void send_json_err(sdata_t *sdata, const int64_t client_id, json_t *id_val, const char *err_msg)
@@ -6427,7 +7706,7 @@ static json_params_t
 *create_json_params(const int64_t client_id, const json_t *method, const json_t *params,
 		    const json_t *id_val)
 {
-	json_params_t *jp = ckalloc(sizeof(json_params_t));
+	json_params_t *jp = slab_alloc(&json_params_slab);
 
 	jp->method = json_deep_copy(method);
 	jp->params = json_deep_copy(params);
@@ -6436,6 +7715,32 @@ static json_params_t
 	return jp;
 }
 
+/* Wrap json params for the share processor */
+static submit_msg_t *json_submit_msg(json_params_t *jp)
+{
+	submit_msg_t *share = slab_alloc(&submit_msg_slab);
+
+	share->client_id = jp->client_id;
+	share->jp = jp;
+	return share;
+}
+
+static void discard_json_params(json_params_t *jp)
+{
+	json_decref(jp->method);
+	json_decref(jp->params);
+	if (jp->id_val)
+		json_decref(jp->id_val);
+	slab_free(&json_params_slab, jp);
+}
+
+static void discard_submit_msg(submit_msg_t *share)
+{
+	if (share->jp)
+		discard_json_params(share->jp);
+	slab_free(&submit_msg_slab, share);
+}
+
 /* Implement support for the diff in the params as well as the originally
  * documented form of placing diff within the method. Needs to be entered with
  * client holding a ref count. */
@@ -6503,10 +7808,10 @@ static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
 		JSON_CPACK(val, "{ss,so}", "node.method", stratum_msgs[SM_TRANSACTIONS],
 			   "transaction", txn_array);
 	}
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = slab_zalloc(&smsg_slab);
 	msg->json_msg = val;
 	msg->client_id = client->id;
-	ckmsgq_add(sdata->ssends, msg);
+	ssend_process(sdata->ckp, msg);
 	LOGNOTICE("Sending new node client %s all transactions", client->identity);
 }
 
@@ -6569,8 +7874,10 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	method = json_string_value(method_val);
 	if (likely(cmdmatch(method, "mining.submit") && client->authorised)) {
 		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
+		submit_msg_t *share = json_submit_msg(jp);
 
-		ckmsgq_add(sdata->sshareq, jp);
+		if (unlikely(!ckmsgq_add_key(sdata->sshareq, share, client_id)))
+			discard_submit_msg(share);
 		return;
 	}
 
@@ -6623,8 +7930,6 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	}
 
 	if (unlikely(cmdmatch(method, "mining.node"))) {
-		char buf[256];
-
 		/* Add this client as a passthrough in the connector and
 		 * add it to the list of mining nodes in the stratifier */
 		if (!ckp->nodeserver[client->server] || ckp->proxy) {
@@ -6633,8 +7938,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 			connector_drop_client(ckp, client_id);
 			drop_client(ckp, sdata, client_id);
 		} else {
-			snprintf(buf, 255, "passthrough=%"PRId64, client_id);
-			send_proc(ckp->connector, buf);
+			bus_send(ckp->connector, BUS_PASSTHROUGH, client_id);
 			add_mining_node(ckp, sdata, client);
 			sprintf(client->identity, "node:%"PRId64, client_id);
 		}
@@ -6642,8 +7946,6 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	}
 
 	if (unlikely(cmdmatch(method, "mining.passthrough"))) {
-		char buf[256];
-
 		if (ckp->proxy || ckp->node ) {
 			LOGNOTICE("Dropping client %s %s trying to connect as passthrough on unsupported server %d",
 				  client->identity, client->address, client->server);
@@ -6655,8 +7957,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 			 * come directly back to this stratifier. */
 			LOGNOTICE("Adding passthrough client %s %s", client->identity, client->address);
 			client->passthrough = true;
-			snprintf(buf, 255, "passthrough=%"PRId64, client_id);
-			send_proc(ckp->connector, buf);
+			bus_send(ckp->connector, BUS_PASSTHROUGH, client_id);
 			sprintf(client->identity, "passthrough:%"PRId64, client_id);
 		}
 		return;
@@ -6673,7 +7974,8 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 			return;
 		}
 		jp = create_json_params(client_id, method_val, params_val, id_val);
-		ckmsgq_add(sdata->sauthq, jp);
+		if (unlikely(!ckmsgq_add(sdata->sauthq, jp)))
+			discard_json_params(jp);
 		return;
 	}
 
@@ -6719,7 +8021,8 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	if (cmdmatch(method, "mining.get")) {
 		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
 
-		ckmsgq_add(sdata->stxnq, jp);
+		if (unlikely(!ckmsgq_add(sdata->stxnq, jp)))
+			discard_json_params(jp);
 		return;
 	}
 
@@ -6731,7 +8034,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 static void free_smsg(smsg_t *msg)
 {
 	json_decref(msg->json_msg);
-	free(msg);
+	slab_free(&smsg_slab, msg);
 }
 
 /* Even though we check the results locally in node mode, check the upstream
@@ -6882,13 +8185,10 @@ static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 	worker = get_worker(sdata, user, workername);
 	check_best_diff(sdata, user, worker, sdiff, NULL);
 
-	mutex_lock(&sdata->uastats_lock);
-	sdata->stats.unaccounted_shares++;
-	sdata->stats.unaccounted_diff_shares += diff;
-	mutex_unlock(&sdata->uastats_lock);
+	add_uastats(sdata, diff, true);
 
-	worker->shares += diff;
-	user->shares += diff;
+	__sync_fetch_and_add(&worker->shares, (int64_t)diff);
+	__sync_fetch_and_add(&user->shares, (int64_t)diff);
 	tv_time(&now_t);
 
 	decay_worker(worker, diff, &now_t);
@@ -6951,9 +8251,8 @@ static stratum_instance_t *ref_instance_by_virtualid(sdata_t *sdata, int64_t *cl
 	for (client = sdata->stratum_instances; client; client = client->hh.next) {
 		if (likely(client->virtualid != *client_id))
 			continue;
-		if (likely(!client->dropped)) {
+		if (likely(!client->dropped && __try_instance_ref(client))) {
 			ret = client;
-			__inc_instance_ref(ret);
 			/* Replace the client_id with the correct one, allowing
 			 * us to send the response to the correct client */
 			*client_id = client->id;
@@ -7046,7 +8345,8 @@ static void parse_remote_auth(ckpool_t *ckp, sdata_t *sdata, json_t *val, stratu
 	json_strcpy(client->address, val, "address");
 	ck_wunlock(&sdata->instance_lock);
 
-	ckmsgq_add(sdata->sauthq, jp);
+	if (unlikely(!ckmsgq_add(sdata->sauthq, jp)))
+		discard_json_params(jp);
 }
 
 /* Get the remote worker count once per minute from all the remote servers */
@@ -7145,7 +8445,7 @@ out_add:
 	res = json_deep_copy(val);
 	remap_workinfo_id(sdata, res, client_id);
 	if (!ckp->remote)
-		downstream_json(sdata, res, client_id, SSEND_PREPEND);
+		downstream_json(sdata, res, client_id);
 
 	json_decref(res);
 }
@@ -7317,6 +8617,7 @@ static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *clie
 	json_t *params, *method, *res_val, *id_val, *err_val = NULL;
 	int msg_type = node_msg_type(val);
 	sdata_t *sdata = ckp->sdata;
+	submit_msg_t *share;
 	json_params_t *jp;
 	char *buf = NULL;
 
@@ -7333,7 +8634,9 @@ static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *clie
 	switch (msg_type) {
 		case SM_SHARE:
 			jp = create_json_params(client->id, method, params, id_val);
-			ckmsgq_add(sdata->sshareq, jp);
+			share = json_submit_msg(jp);
+			if (unlikely(!ckmsgq_add_key(sdata->sshareq, share, client->id)))
+				discard_submit_msg(share);
 			break;
 		case SM_SHARERESULT:
 			parse_share_result(ckp, client, res_val);
@@ -7461,7 +8764,7 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 		return;
 	}
 
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = slab_zalloc(&smsg_slab);
 	msg->json_msg = val;
 	val = json_object_get(msg->json_msg, "client_id");
 	if (unlikely(!val)) {
@@ -7495,18 +8798,21 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 	server = json_integer_value(val);
 	json_object_clear(val);
 
-	/* Parse the message here */
-	ck_wlock(&sdata->instance_lock);
-	client = __instance_by_id(sdata, msg->client_id);
-	/* If client_id instance doesn't exist yet, create one */
+	/* Parse the message here, only needing the instance_lock if the
+	 * client_id is new or dropped */
+	client = ref_instance_by_id(sdata, msg->client_id);
 	if (unlikely(!client)) {
-		noid = true;
-		client = __stratum_add_instance(ckp, msg->client_id, address, server);
-	} else if (unlikely(client->dropped))
-		dropped = true;
-	if (likely(!dropped))
-		__inc_instance_ref(client);
-	ck_wunlock(&sdata->instance_lock);
+		ck_wlock(&sdata->instance_lock);
+		client = __instance_by_id(sdata, msg->client_id);
+		/* If client_id instance doesn't exist yet, create one */
+		if (!client) {
+			noid = true;
+			client = __stratum_add_instance(ckp, msg->client_id, address, server);
+			__inc_instance_ref(client);
+		} else if (client->dropped || !__try_instance_ref(client))
+			dropped = true;
+		ck_wunlock(&sdata->instance_lock);
+	}
 
 	if (unlikely(dropped)) {
 		/* Client may be NULL here */
@@ -7539,32 +8845,8 @@ void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const ch
 		return;
 	}
 	sdata = ckp->sdata;
-	ckmsgq_add(sdata->srecvs, val);
-}
-
-static void ssend_process(ckpool_t *ckp, smsg_t *msg)
-{
-	if (unlikely(!msg->json_msg)) {
-		LOGERR("Sent null json msg to stratum_sender");
-		free(msg);
-		return;
-	}
-
-	/* Add client_id to the json message and send it to the
-	 * connector process to be delivered */
-	json_object_set_new_nocheck(msg->json_msg, "client_id", json_integer(msg->client_id));
-	connector_add_message(ckp, msg->json_msg);
-	/* The connector will free msg->json_msg */
-	free(msg);
-}
-
-static void discard_json_params(json_params_t *jp)
-{
-	json_decref(jp->method);
-	json_decref(jp->params);
-	if (jp->id_val)
-		json_decref(jp->id_val);
-	free(jp);
+	if (unlikely(!ckmsgq_add_key(sdata->srecvs, val, recv_client_id(val))))
+		json_decref(val);
 }
 
 static void steal_json_id(json_t *val, json_params_t *jp)
@@ -7574,34 +8856,195 @@ static void steal_json_id(json_t *val, json_params_t *jp)
 	jp->id_val = NULL;
 }
 
-static void sshare_process(ckpool_t *ckp, json_params_t *jp)
+static json_t *submit_msg_id(submit_msg_t *share)
 {
-	json_t *result_val, *json_msg, *err_val = NULL;
-	stratum_instance_t *client;
-	sdata_t *sdata = ckp->sdata;
-	int64_t client_id;
+	json_t *id_val;
 
-	client_id = jp->client_id;
+	if (share->jp) {
+		/* Steal the id_val as is to avoid a copy */
+		id_val = share->jp->id_val;
+		share->jp->id_val = NULL;
+		return id_val;
+	}
+	switch (share->idtype) {
+		case SUBMIT_ID_INT:
+			return json_integer(share->id);
+		case SUBMIT_ID_STR:
+			return json_string(share->idstr);
+		default:
+			return json_null();
+	}
+}
 
-	client = ref_instance_by_id(sdata, client_id);
-	if (unlikely(!client)) {
-		LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!", client_id);
-		goto out;
+/* Shares decoded by the connector haven't been through parse_instance_msg so
+ * apply the same checks on the client it would have. */
+static bool decoded_submit_client(ckpool_t *ckp, stratum_instance_t *client)
+{
+	if (unlikely(client->reject == 3)) {
+		LOGINFO("Dropping client %s %s tagged for lazy invalidation",
+			client->identity, client->address);
+		connector_drop_client(ckp, client->id);
+		return false;
+	}
+	if (unlikely(client->trusted || client->passthrough)) {
+		LOGINFO("Ignoring mining.submit from %s %s", client->identity, client->address);
+		return false;
 	}
+	/* Clients may authorise before subscribing, so as in parse_method only
+	 * an unauthorised client is dropped for lacking a subscription */
+	if (unlikely(!client->authorised)) {
+		if (!client->subscribed) {
+			LOGINFO("Dropping mining.submit from unsubscribed client %s %s",
+				client->identity, client->address);
+			connector_drop_client(ckp, client->id);
+			return false;
+		}
+		LOGINFO("Dropping mining.submit from unauthorised client %s %s",
+			client->identity, client->address);
+		return false;
+	}
+	return true;
+}
+
+/* Enter with client holding a ref count */
+static void __sshare_process(sdata_t *sdata, stratum_instance_t *client, submit_msg_t *share,
+			     const submit_args_t *args, submission_t *sub)
+{
+	json_t *result_val, *json_msg, *id_val, *err_val = NULL;
+
 	if (unlikely(!client->authorised)) {
 		LOGDEBUG("Client %s no longer authorised to submit shares", client->identity);
-		goto out_decref;
+		return;
 	}
 	json_msg = json_object();
-	result_val = parse_submit(client, json_msg, jp->params, &err_val);
+	result_val = parse_submit(client, json_msg, args, &err_val, sub);
 	json_object_set_new_nocheck(json_msg, "result", result_val);
 	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
-	steal_json_id(json_msg, jp);
-	stratum_add_send(sdata, json_msg, client_id, SM_SHARERESULT);
-out_decref:
-	dec_instance_ref(sdata, client);
-out:
-	discard_json_params(jp);
+	id_val = submit_msg_id(share);
+	if (id_val)
+		json_object_set_new_nocheck(json_msg, "id", id_val);
+	stratum_add_send(sdata, json_msg, share->client_id, SM_SHARERESULT);
+}
+
+/* Decode enough of a share's parameters to generate its binaries ahead of
+ * parse_submit so it can be hashed as part of a batch. Anything that doesn't
+ * look like a valid share is left for parse_submit to reject on its own. */
+static bool prepare_batch_submission(stratum_instance_t *client, const submit_args_t *args,
+				     submission_t *sub)
+{
+	const char *job_id, *nonce2, *ntime, *nonce, *version_mask;
+	sdata_t *sdata = client->sdata;
+	workbase_t *wb;
+	int len, nlen;
+	int64_t id;
+
+	if (unlikely(!client->authorised || args->err != SE_NONE))
+		return false;
+	job_id = args->job_id;
+	nonce2 = args->nonce2;
+	ntime = args->ntime;
+	nonce = args->nonce;
+	if (unlikely(!job_id || !nonce2 || !ntime || !nonce))
+		return false;
+	if (unlikely(!validhex(nonce2) || !validhex(ntime) || strlen(nonce) < 8 || !validhex(nonce)))
+		return false;
+	version_mask = args->version_mask;
+	if (version_mask && strlen(version_mask) && validhex(version_mask))
+		sscanf(version_mask, "%x", &sub->version_mask);
+	sscanf(job_id, "%lx", &id);
+	sscanf(ntime, "%x", &sub->ntime32);
+
+	wb = get_workbase(sdata, id);
+	if (unlikely(!wb))
+		return false;
+	/* Fix nonce2 and nonce lengths the same way parse_submit does */
+	len = wb->enonce2varlen * 2;
+	if (unlikely(len > 16)) {
+		put_workbase(sdata, wb);
+		return false;
+	}
+	nlen = strlen(nonce2);
+	memset(sub->nonce2, '0', len);
+	memcpy(sub->nonce2, nonce2, MIN(nlen, len));
+	sub->nonce2[len] = '\0';
+	memcpy(sub->nonce, nonce, 8);
+	sub->nonce[8] = '\0';
+
+	sub->wb = wb;
+	sub->coinbase = ckalloc(submission_cblen(wb));
+	prepare_submission(sdata, client, wb, sub->nonce2, sub->ntime32, sub->version_mask,
+			   sub->nonce, sub);
+	return true;
+}
+
+/* Maximum number of queued shares each share processing thread takes at once */
+#define SHARE_BATCH 32
+
+/* Process a batch of shares, hashing all the ones we can in parallel lanes
+ * first before processing each in the order they were received. */
+static void sshare_process_batch(ckpool_t *ckp, submit_msg_t **shares, const int count)
+{
+	stratum_instance_t **clients = alloca(sizeof(stratum_instance_t *) * count);
+	submission_t **hashes = alloca(sizeof(submission_t *) * count);
+	submit_args_t *args = alloca(sizeof(submit_args_t) * count);
+	submission_t *subs = ckzalloc(sizeof(submission_t) * count);
+	sdata_t *sdata = ckp->sdata;
+	int i, prepared = 0;
+
+	for (i = 0; i < count; i++) {
+		clients[i] = ref_instance_by_id(sdata, shares[i]->client_id);
+		if (unlikely(!clients[i])) {
+			/* A share decoded by the connector may be the first we
+			 * hear of a client, which would otherwise have been
+			 * created then dropped for not subscribing. */
+			if (!shares[i]->jp) {
+				LOGINFO("Dropping mining.submit from unsubscribed client %"PRId64,
+					shares[i]->client_id);
+				connector_drop_client(ckp, shares[i]->client_id);
+			} else {
+				LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!",
+					shares[i]->client_id);
+			}
+			continue;
+		}
+		if (!shares[i]->jp && !decoded_submit_client(ckp, clients[i])) {
+			dec_instance_ref(sdata, clients[i]);
+			clients[i] = NULL;
+			continue;
+		}
+		get_submit_args(shares[i], &args[i]);
+		if (prepare_batch_submission(clients[i], &args[i], &subs[i]))
+			hashes[prepared++] = &subs[i];
+	}
+	if (prepared)
+		hash_submissions(hashes, prepared);
+
+	for (i = 0; i < count; i++) {
+		stratum_instance_t *client = clients[i];
+
+		if (likely(client)) {
+			__sshare_process(sdata, client, shares[i], &args[i], &subs[i]);
+			if (subs[i].wb) {
+				put_workbase(client->sdata, subs[i].wb);
+				free(subs[i].coinbase);
+			}
+			dec_instance_ref(sdata, client);
+		}
+		discard_submit_msg(shares[i]);
+	}
+	free(subs);
+}
+
+void stratifier_add_submit(ckpool_t *ckp, const submit_msg_t *share)
+{
+	sdata_t *sdata = ckp->sdata;
+	submit_msg_t *msg;
+
+	msg = slab_alloc(&submit_msg_slab);
+	memcpy(msg, share, sizeof(submit_msg_t));
+	msg->jp = NULL;
+	if (unlikely(!ckmsgq_add_key(sdata->sshareq, msg, msg->client_id)))
+		slab_free(&submit_msg_slab, msg);
 }
 
 /* As ref_instance_by_id but only returns clients not authorising or authorised,
@@ -7613,10 +9056,10 @@ static stratum_instance_t *preauth_ref_instance_by_id(sdata_t *sdata, const int6
 	ck_wlock(&sdata->instance_lock);
 	client = __instance_by_id(sdata, id);
 	if (client) {
-		if (client->dropped || client->authorising || client->authorised)
+		if (client->dropped || client->authorising || client->authorised ||
+		    !__try_instance_ref(client))
 			client = NULL;
 		else {
-			__inc_instance_ref(client);
 			client->authorising = true;
 		}
 	}
@@ -7915,10 +9358,10 @@ static void *statsupdate(void *arg)
 		timersub(&now, &stats->start_time, &diff);
 
 		ck_wlock(&sdata->instance_lock);
-		/* Grab the first entry */
+		/* Grab the first entry not already claimed for killing */
 		client = sdata->stratum_instances;
-		if (likely(client))
-			__inc_instance_ref(client);
+		while (client && unlikely(!__try_instance_ref(client)))
+			client = client->hh.next;
 		ck_wunlock(&sdata->instance_lock);
 
 		while (client) {
@@ -7958,8 +9401,8 @@ static void *statsupdate(void *arg)
 			client = client->hh.next;
 			/* Grab a reference to this client allowing us to examine
 			 * it without holding the lock */
-			if (likely(client))
-				__inc_instance_ref(client);
+			while (client && unlikely(!__try_instance_ref(client)))
+				client = client->hh.next;
 			ck_wunlock(&sdata->instance_lock);
 		}
 
@@ -8252,14 +9695,8 @@ static void *statsupdate(void *arg)
 			 * stats update */
 			per_tdiff = tvdiff(&now, &diff);
 
-			mutex_lock(&sdata->uastats_lock);
-			unaccounted_shares = stats->unaccounted_shares;
-			unaccounted_diff_shares = stats->unaccounted_diff_shares;
-			unaccounted_rejects = stats->unaccounted_rejects;
-			stats->unaccounted_shares =
-			stats->unaccounted_diff_shares =
-			stats->unaccounted_rejects = 0;
-			mutex_unlock(&sdata->uastats_lock);
+			fold_uastats(sdata, &unaccounted_shares, &unaccounted_diff_shares,
+				     &unaccounted_rejects);
 
 			mutex_lock(&sdata->stats_lock);
 			stats->accounted_shares += unaccounted_shares;
@@ -8540,18 +9977,26 @@ void *stratifier(void *arg)
 		sdata->blockchange_id = sdata->workbase_id = randomiser;
 
 	cklock_init(&sdata->instance_lock);
+	sdata->instance_slots = ckzalloc(sizeof(instance_slot_t) * INSTANCE_SLOTS);
 	cksem_init(&sdata->update_sem);
 	cksem_post(&sdata->update_sem);
 
 	/* Create half as many share processing and receiving threads as there
-	 * are CPUs */
+	 * are CPUs, each handling its own shard of the clients */
 	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
 	sdata->updateq = create_ckmsgq(ckp, "updater", &block_update);
-	sdata->sshareq = create_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
-	sdata->ssends = create_ckmsgqs(ckp, "ssender", &ssend_process, threads);
+	sdata->sshareq = create_ckmsgqs_batch(ckp, "sprocessor", &sshare_process_batch, threads,
+					      SHARE_BATCH, true);
 	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
-	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
+	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads, true);
+	if (ckp->logshares) {
+		sdata->sharelogq = create_ckmsgqs_batch(ckp, "sharelog", &sharelog_process, 1,
+							SHARELOG_BATCH, false);
+		register_share_sink(sdata, ckp->sharelog_binary ? &sharelog_bin_sink : &sharelog_sink);
+	}
+	if (ckp->remote)
+		register_share_sink(sdata, &upstream_share_sink);
 	create_pthread(&pth_throbber, throbber, ckp);
 	read_poolstats(ckp, &tvsec_diff);
 	read_userstats(ckp, sdata, tvsec_diff);
@@ -8568,11 +10013,9 @@ void *stratifier(void *arg)
 	}
 
 	mutex_init(&sdata->stats_lock);
-	mutex_init(&sdata->uastats_lock);
 	if (!ckp->passthrough || ckp->node)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
 
-	mutex_init(&sdata->share_lock);
 	if (!ckp->proxy)
 		create_pthread(&pth_zmqnotify, zmqnotify, ckp);
 
@@ -10,6 +10,8 @@
 #ifndef STRATIFIER_H
 #define STRATIFIER_H
 
+#include "sha2.h"
+
 /* Generic structure for both workbase in stratifier and gbtbase in generator */
 struct genwork {
 	/* Hash table data */
@@ -23,8 +25,8 @@ struct genwork {
 
 	char idstring[20];
 
-	/* How many readers we currently have of this workbase, set
-	 * under write workbase_lock */
+	/* How many readers we currently have of this workbase, changed
+	 * atomically and only taken under at least read workbase_lock */
 	int readcount;
 
 	/* The id a remote workinfo is mapped to locally */
@@ -33,6 +35,9 @@ struct genwork {
 	ts_t gentime;
 	tv_t retired;
 
+	/* Hashes of shares accepted on this workbase for dupe checks */
+	struct sharetable *shares;
+
 	/* GBT/shared variables */
 	char target[68];
 	double diff;
@@ -61,6 +66,7 @@ struct genwork {
 	char *coinb1; // coinbase1
 	uchar *coinb1bin;
 	int coinb1len; // length of above
+	sha256_ctx coinb1ctx; // sha256 midstate of coinb1bin
 
 	char enonce1const[32]; // extranonce1 section that is constant
 	uchar enonce1constbin[16];
@@ -88,6 +94,38 @@ struct genwork {
 	json_t *json; /* getblocktemplate json */
 };
 
+/* Type of the id of a submit_msg_t decoded by the connector */
+enum submit_idtype {
+	SUBMIT_ID_NULL,
+	SUBMIT_ID_INT,
+	SUBMIT_ID_STR,
+};
+
+/* A mining.submit, either decoded by the connector straight from the line it
+ * was received on or wrapping the json params when it arrived any other way.
+ * Fields that don't fit leave the message to the json parser. */
+struct submit_msg {
+	int64_t client_id;
+
+	/* Set when the share came via the json parser */
+	struct json_params *jp;
+
+	enum submit_idtype idtype;
+	int64_t id;
+	char idstr[32];
+
+	/* Number of params, 5 or 6 with the version mask */
+	int params;
+	char workername[128];
+	char job_id[20];
+	char nonce2[36];
+	char ntime[12];
+	char nonce[20];
+	char version_mask[12];
+};
+
+typedef struct submit_msg submit_msg_t;
+
 void parse_remote_txns(ckpool_t *ckp, const json_t *val);
 #define parse_upstream_txns(ckp, val) parse_remote_txns(ckp, val)
 void parse_upstream_auth(ckpool_t *ckp, json_t *val);
@@ -97,6 +135,8 @@ void parse_upstream_reqtxns(ckpool_t *ckp, json_t *val);
 char *stratifier_stats(ckpool_t *ckp, void *data);
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line);
 #define stratifier_add_recv(ckp, val) _stratifier_add_recv(ckp, val, __FILE__, __func__, __LINE__)
+void stratifier_add_submit(ckpool_t *ckp, const submit_msg_t *share);
+void stratifier_bus(ckpool_t *ckp, bus_msg_t *msg);
 void *stratifier(void *arg);
 
 #endif /* STRATIFIER_H */
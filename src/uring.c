@@ -0,0 +1,228 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#ifdef USE_IO_URING
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "uring.h"
+
+static int io_uring_setup(const unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(const int fd, const unsigned to_submit, const unsigned min_complete,
+			  const unsigned flags, void *arg, const size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int io_uring_register(const int fd, const unsigned opcode, void *arg, const unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Set up a ring with entries submission queue entries and four times as many
+ * completion queue entries, requiring the features we depend on. */
+bool uring_init(uring_t *ring, const unsigned entries)
+{
+	struct io_uring_params p;
+	size_t size;
+	char *sq;
+
+	memset(ring, 0, sizeof(uring_t));
+	ring->fd = -1;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	p.cq_entries = entries * 4;
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		LOGWARNING("Failed to set up io_uring with errno %d:%s", errno, strerror(errno));
+		return false;
+	}
+	if ((p.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)) !=
+	    (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)) {
+		LOGWARNING("Kernel io_uring lacks required features %x", p.features);
+		goto out_close;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+	ring->sq_ring_size = ring->cq_ring_size = size;
+	ring->sq_ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		LOGWARNING("Failed to mmap io_uring rings with errno %d:%s", errno, strerror(errno));
+		goto out_close;
+	}
+	ring->cq_ring = ring->sq_ring;
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		LOGWARNING("Failed to mmap io_uring sqes with errno %d:%s", errno, strerror(errno));
+		munmap(ring->sq_ring, size);
+		goto out_close;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *)(sq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(sq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+	return true;
+
+out_close:
+	Close(ring->fd);
+	return false;
+}
+
+void uring_exit(uring_t *ring)
+{
+	if (ring->fd < 0)
+		return;
+	if (ring->br) {
+		munmap(ring->br, round_up_page(ring->br_entries * sizeof(struct io_uring_buf)));
+		free(ring->bufs);
+	}
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	Close(ring->fd);
+}
+
+/* Make the sqes we've filled visible to the kernel, returning how many are
+ * waiting to be submitted. */
+static unsigned uring_flush(uring_t *ring)
+{
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Get an empty sqe, submitting what's already queued if the submission queue
+ * is full. Returns NULL only if the kernel can't take any more. */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (unlikely(ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)) {
+		io_uring_enter(ring->fd, uring_flush(ring), 0, 0, NULL, 0);
+		if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+			return NULL;
+	}
+	idx = ring->sqe_tail++ & ring->sq_mask;
+	ring->sq_array[idx] = idx;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/* Submit all queued sqes and wait up to timeout_ms for at least one
+ * completion, not waiting at all with a zero timeout. */
+int uring_submit_wait(uring_t *ring, const int timeout_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned to_submit;
+	int ret;
+
+	to_submit = uring_flush(ring);
+	if (!timeout_ms)
+		return io_uring_enter(ring->fd, to_submit, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (unsigned long)&ts;
+	ret = io_uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			     &arg, sizeof(arg));
+	if (ret < 0 && (errno == ETIME || errno == EINTR))
+		ret = 0;
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Register a ring of entries buffers of buflen bytes each as buffer group
+ * bgid for recvs to select from. Entries must be a power of 2. */
+bool uring_setup_bufs(uring_t *ring, const int bgid, const unsigned entries, const int buflen)
+{
+	struct io_uring_buf_reg reg;
+	size_t size;
+	unsigned i;
+
+	size = round_up_page(entries * sizeof(struct io_uring_buf));
+	ring->br = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED) {
+		ring->br = NULL;
+		LOGWARNING("Failed to mmap io_uring buffer ring");
+		return false;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		LOGWARNING("Failed to register io_uring buffer ring with errno %d:%s",
+			   errno, strerror(errno));
+		munmap(ring->br, size);
+		ring->br = NULL;
+		return false;
+	}
+	ring->br_entries = entries;
+	ring->bgid = bgid;
+	ring->buflen = buflen;
+	ring->bufs = ckalloc((size_t)entries * buflen);
+	for (i = 0; i < entries; i++)
+		uring_recycle_buf(ring, i);
+	return true;
+}
+
+/* Hand buffer bid back to the kernel once we're done with its contents */
+void uring_recycle_buf(uring_t *ring, const unsigned bid)
+{
+	unsigned short tail = ring->br->tail;
+	struct io_uring_buf *buf = &ring->br->bufs[tail & (ring->br_entries - 1)];
+
+	buf->addr = (unsigned long)uring_buf(ring, bid);
+	buf->len = ring->buflen;
+	buf->bid = bid;
+	__atomic_store_n(&ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* USE_IO_URING */
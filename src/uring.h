@@ -0,0 +1,73 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Minimal io_uring ring handling on the raw system calls so there's no
+ * dependency on liburing. One thread owns each ring. */
+struct uring {
+	int fd;
+
+	/* Submission queue, with the tail we've filled sqes up to */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail;
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	/* Ring of buffers provided to the kernel for recvs to pick from */
+	struct io_uring_buf_ring *br;
+	unsigned br_entries;
+	int bgid;
+	char *bufs;
+	int buflen;
+};
+
+typedef struct uring uring_t;
+
+bool uring_init(uring_t *ring, const unsigned entries);
+void uring_exit(uring_t *ring);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+int uring_submit_wait(uring_t *ring, const int timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+bool uring_setup_bufs(uring_t *ring, const int bgid, const unsigned entries, const int buflen);
+void uring_recycle_buf(uring_t *ring, const unsigned bid);
+
+static inline char *uring_buf(uring_t *ring, const unsigned bid)
+{
+	return ring->bufs + (size_t)bid * ring->buflen;
+}
+
+#endif /* USE_IO_URING */
+
+#endif /* URING_H */